@@ -34,7 +34,7 @@ done
 
 # start workers
 for ((i=0; i<${num_workers}; ++i)); do
-    port=$((9500 + ${i}))
+    port=$((9600 + ${num_servers} + ${i}))
     N="role:WORKER,hostname:'127.0.0.1',port:${port},id:'W${i}'"
     # HEAPPROFILE=/tmp/W${i} \
     # CPUPROFILE=/tmp/W${i} \
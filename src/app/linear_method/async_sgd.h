@@ -9,6 +9,7 @@
 #include "util/evaluation.h"
 #include "parameter/kv_vector.h"
 #include "parameter/kv_map.h"
+#include "util/compact_float.h"
 #include "app/linear_method/learning_rate.h"
 #include "app/linear_method/proto/linear.pb.h"
 #include "app/linear_method/loss.h"
@@ -29,6 +30,9 @@ class AsyncSGDScheduler : public ISGDScheduler {
     load.set_replica(conf_.async_sgd().num_data_pass());
     load.set_shuffle(true);
     workload_pool_ = new WorkloadPool(load);
+    const auto& sgd = conf_.async_sgd();
+    set_checkpoint(sgd.checkpoint_dir(), sgd.checkpoint_interval(),
+                   sgd.checkpoint_full_every());
   }
   virtual ~AsyncSGDScheduler() { }
 
@@ -47,20 +51,29 @@ class AsyncSGDServer : public ISGDCompNode {
     SGDState state(conf_.penalty(), conf_.learning_rate());
     state.reporter = &(this->reporter_);
     if (conf_.async_sgd().algo() == SGDConfig::FTRL) {
-      auto model = new KVMap<Key, V, FTRLEntry, SGDState>();
-      model->set_state(state);
-      model_ = model;
+      if (conf_.async_sgd().ftrl_store_weight()) {
+        model_ = CreateModel<FTRLEntry>(state);
+      } else {
+        model_ = CreateModel<CompactFTRLEntry>(state);
+      }
     } else {
       if (conf_.async_sgd().ada_grad()) {
-        model_ = new KVMap<Key, V, AdaGradEntry, SGDState>();
+        model_ = CreateModel<AdaGradEntry>(state);
       } else {
         CHECK(false);
       //   model_ = new KVStore<Key, V, AdaGradEntry<V>, SGDState<V>>();
       }
     }
+    model_->ProcessInParallel(conf_.async_sgd().server_threads());
   }
 
   virtual ~AsyncSGDServer() {
+    // the resident memory of the process, so including the buffers besides
+    // the model
+    size_t n = model_size_ ? model_size_() : 0;
+    double mem = ResUsage::myPhyMem();
+    LOG(INFO) << MyNodeID() << ": " << n << " keys, memory " << mem << " MB, "
+              << (n ? mem * 1e6 / n : 0) << " bytes per key";
     delete model_;
   }
 
@@ -71,16 +84,26 @@ class AsyncSGDServer : public ISGDCompNode {
       std::string file = output.file(0) + "_" + MyNodeID();
       CHECK_NOTNULL(model_)->WriteToFile(file);
       LOG(INFO) << MyNodeID() << " written the model to " << file;
+    } else if (output.format() == DataConfig::BIN) {
+      CHECK(output.file_size());
+      std::string file = output.file(0) + "_" + MyNodeID();
+      CHECK_NOTNULL(model_)->WriteToBinaryFile(file, output.compressed());
+      LOG(INFO) << MyNodeID() << " written the binary model to " << file;
     }
   }
 
   virtual void ProcessRequest(Message* request) {
-    if (request->task.sgd().cmd() == SGDCall::SAVE_MODEL) {
+    const auto& sgd = request->task.sgd();
+    if (sgd.cmd() == SGDCall::SAVE_MODEL) {
       SaveModel();
+    } else if (sgd.cmd() == SGDCall::CHECKPOINT) {
+      CHECK_NOTNULL(model_)->Checkpoint(sgd.checkpoint());
     }
   }
  protected:
   Parameter* model_ = nullptr;
+  // the number of keys in model_
+  std::function<size_t()> model_size_;
   Config conf_;
 
   /**
@@ -97,7 +120,7 @@ class AsyncSGDServer : public ISGDCompNode {
     void Update() {
       if (!reporter) return;
       SGDProgress prog;
-      prog.set_nnz(nnz);
+      prog.set_nnz(*nnz);
       prog.set_weight_sum(weight_sum); weight_sum = 0;
       prog.set_delta_sum(delta_sum); delta_sum = 0;
       reporter->Report(prog);
@@ -106,9 +129,9 @@ class AsyncSGDServer : public ISGDCompNode {
     void UpdateWeight(V new_weight, V old_weight) {
       // LL << new_weight << " " << old_weight;
       if (new_weight == 0 && old_weight != 0) {
-        -- nnz;
+        -- *nnz;
       } else if (new_weight != 0 && old_weight == 0) {
-        ++ nnz;
+        ++ *nnz;
       }
       weight_sum += new_weight * new_weight;
       V delta = new_weight - old_weight;
@@ -119,50 +142,122 @@ class AsyncSGDServer : public ISGDCompNode {
     std::shared_ptr<Penalty<V>> h;
 
     int iter = 0;
-    size_t nnz = 0;
+    // shared by the copies of this state, one per server thread
+    std::shared_ptr<std::atomic<int64>> nnz =
+        std::make_shared<std::atomic<int64>>(0);
     V weight_sum = 0;
     V delta_sum = 0;
     V max_delta = 1.0;  // maximal change of weight
     MonitorSlaver<SGDProgress>* reporter = nullptr;
   };
 
+  /**
+   * @brief Creates the model with entry E<A>, where A stores the accumulated
+   * gradients in the precision of SGDConfig::accumulator
+   */
+  template <template <typename> class E>
+  Parameter* CreateModel(const SGDState& state) {
+    switch (conf_.async_sgd().accumulator()) {
+      case SGDConfig::FLOAT16: return CreateModel<E<Float16>>(state);
+      case SGDConfig::BFLOAT16: return CreateModel<E<BFloat16>>(state);
+      case SGDConfig::LOGFLOAT8: return CreateModel<E<LogFloat8>>(state);
+      default: return CreateModel<E<Float32>>(state);
+    }
+  }
+  template <typename E>
+  Parameter* CreateModel(const SGDState& state) {
+    auto model = new KVMap<Key, V, E, SGDState, FlatMap<Key, E>>();
+    model->set_state(state);
+    model_size_ = [model]() { return model->size(); };
+    return model;
+  }
+
+  /**
+   * @brief One FTRL step by gradient "grad" on weight "w", updates "z" and the
+   * accumulated gradient "sqrt_n", returns the new weight
+   */
+  template <typename A>
+  static V FTRLUpdate(V grad, V w, V* z, A* sqrt_n, SGDState* st) {
+    V n = sqrt_n->get();
+    V n_new = sqrt(n * n + grad * grad);
+    V sigma = (n_new - n) / st->lr->alpha();
+    *z += grad - sigma * w;
+    sqrt_n->set(n_new);
+    return FTRLWeight(*z, sqrt_n->get(), st);
+  }
+  static V FTRLWeight(V z, V sqrt_n, SGDState* st) {
+    if (z == 0) return 0;
+    V eta = st->lr->eval(sqrt_n);
+    return st->h->proximal(-z*eta, eta);
+  }
+
+  // the entries are packed to avoid padding, so the addresses of their members
+  // are not taken, and the members are copied in and out around the updates
+#pragma pack(push)
+#pragma pack(1)
   /**
    * @brief An entry for FTRL
    */
+  template <typename A>
   struct FTRLEntry {
-    V w = 0;  // not necessary to store w, because it can be computed from z
+    V w = 0;
     V z = 0;
-    V sqrt_n = 0;
+    A sqrt_n;
 
     void Set(const V* data, void* state) {
       SGDState* st = (SGDState*) state;
-      // update model
-      V w_old = w;
-      V grad = *data;
-      V sqrt_n_new = sqrt(sqrt_n * sqrt_n + grad * grad);
-      V sigma = (sqrt_n_new - sqrt_n) / st->lr->alpha();
-      z += grad  - sigma * w;
-      sqrt_n = sqrt_n_new;
-      V eta = st->lr->eval(sqrt_n);
-      w = st->h->proximal(-z*eta, eta);
-
-      // update status
+      V w_old = w, z_new = z;
+      A n = sqrt_n;
+      w = FTRLUpdate(*data, w_old, &z_new, &n, st);
+      z = z_new; sqrt_n = n;
       st->UpdateWeight(w, w_old);
     }
 
     void Get(V* data, void* state) { *data = w; }
   };
 
+  /**
+   * @brief An entry for FTRL without w, which is computed from z when needed
+   */
+  template <typename A>
+  struct CompactFTRLEntry {
+    V z = 0;
+    A sqrt_n;
+
+    void Set(const V* data, void* state) {
+      SGDState* st = (SGDState*) state;
+      V z_new = z;
+      A n = sqrt_n;
+      V w_old = FTRLWeight(z_new, n.get(), st);
+      V w = FTRLUpdate(*data, w_old, &z_new, &n, st);
+      z = z_new; sqrt_n = n;
+      st->UpdateWeight(w, w_old);
+    }
+
+    void Get(V* data, void* state) {
+      *data = FTRLWeight(z, sqrt_n.get(), (SGDState*) state);
+    }
+  };
+
   /**
    * @brief An entry for adaptive gradient
    */
+  template <typename A>
   struct AdaGradEntry {
     void Set(const V* data, void* state) {
       SGDState* st = (SGDState*) state;
       // update model
       V grad = *data;
-      sum_sq_grad += grad * grad;
-      V eta = st->lr->eval(sqrt(sum_sq_grad));
+      V sqrt_n;
+      if (kSumSq) {
+        acc.set(acc.get() + grad * grad);
+        sqrt_n = sqrt(acc.get());
+      } else {
+        V n = acc.get();
+        acc.set(sqrt(n * n + grad * grad));
+        sqrt_n = acc.get();
+      }
+      V eta = st->lr->eval(sqrt_n);
       V w_old = weight;
       weight = st->h->proximal(weight - eta * grad, eta);
 
@@ -172,8 +267,13 @@ class AsyncSGDServer : public ISGDCompNode {
 
     void Get(V* data, void* state) { *data = weight; }
     V weight = 0;
-    V sum_sq_grad = 0;
+    // the sum of the squared gradients in float32, the same as the old entry
+    // so its checkpoints still load. the lower precisions store the square
+    // root of the sum instead, so float16 does not overflow
+    A acc;
+    static const bool kSumSq = std::is_same<A, Float32>::value;
   };
+#pragma pack(pop)
 
   // /**
   //  * @brief An entry for standard gradient desecent
@@ -196,6 +296,9 @@ class AsyncSGDWorker : public ISGDCompNode {
   AsyncSGDWorker(const Config& conf)
       : ISGDCompNode(), conf_(conf) {
     loss_ = createLoss<V>(conf_.loss());
+    // ComputeGradient runs once the pull is finished, in the callback threads
+    int n = conf_.async_sgd().worker_threads();
+    if (n > 0) model_.SetCallbackThreads(n);
   }
   virtual ~AsyncSGDWorker() { }
 
@@ -235,7 +338,7 @@ class AsyncSGDWorker : public ISGDCompNode {
     reader.InitFilter(sgd.countmin_n(), sgd.countmin_k(), sgd.tail_feature_freq());
     reader.Start();
 
-    processed_batch_ = 0;
+    std::vector<Future> pushed;
     int id = 0;
     SArray<Key> key;
     for (; ; ++id) {
@@ -249,10 +352,12 @@ class AsyncSGDWorker : public ISGDCompNode {
       // pull the weight
       auto req = Parameter::Request(id, -1, {}, sgd.pull_filter());
       model_[id].key = key;
-      model_.Pull(req, key, [this, id]() { ComputeGradient(id); });
+      int64 ts = model_.Pull(req, key);
+      pushed.push_back(model_.WhenFinished(ts).Then(
+          [this, id]() { return ComputeGradient(id); }));
     }
 
-    while (processed_batch_ < id) { usleep(500); }
+    Future::WhenAll(pushed).Wait();
     LOG(INFO) << MyNodeID() << ": finished workload " << load.id();
   }
 
@@ -260,8 +365,9 @@ class AsyncSGDWorker : public ISGDCompNode {
    * @brief Compute gradient
    *
    * @param id minibatch id
+   * @return the future of pushing the gradient
    */
-  void ComputeGradient(int id) {
+  Future ComputeGradient(int id) {
     mu_.lock();
     auto Y = data_[id].first;
     auto X = data_[id].second;
@@ -291,8 +397,9 @@ class AsyncSGDWorker : public ISGDCompNode {
     auto req = Parameter::Request(id, -1, {}, conf_.async_sgd().push_filter());
     // grad.EigenArray() /= (V)Y->rows();
     // LL << grad;
-    model_.Push(req, model_[id].key, {grad}, [this](){ ++ processed_batch_; });
+    int64 ts = model_.Push(req, model_[id].key, {grad});
     model_.Clear(id);
+    return model_.WhenFinished(ts);
   }
 
 private:
@@ -303,7 +410,6 @@ private:
   std::unordered_map<int, std::pair<MatrixPtr<V>, MatrixPtr<V>>> data_;
 
   std::mutex mu_;
-  std::atomic_int processed_batch_;
   int workload_id_ = -1;
 
   Config conf_;
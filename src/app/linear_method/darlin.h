@@ -41,7 +41,7 @@ class DarlinScheduler : public BCDScheduler {
     int max_iter = darlin.max_pass_of_data();
 
     // algo time
-    int time = exec_.time();
+    int64 time = exec_.time();
     int first_time = time;
     // model time
     int model_time = fea_grp_.size() * 6;
@@ -2,6 +2,7 @@
 #include "system/customer.h"
 #include "data/stream_reader.h"
 #include "util/evaluation.h"
+#include "util/model_file.h"
 namespace PS {
 
 #if USE_S3
@@ -21,15 +22,20 @@ class ModelEvaluation : public App {
   virtual void Run();
  private:
   typedef float Real;
+  typedef std::shared_ptr<ModelFile<Key, Real>> ModelFilePtr;
+  // parses text model files into weight_
+  void LoadText(const DataConfig& model);
+  // maps binary model files, which are looked up without parsing
+  void LoadBinary(const DataConfig& model);
+  // returns the weight of "key", false if it is not in the model
+  bool Weight(Key key, Real* w);
+
   Config conf_;
+  std::unordered_map<Key, Real> weight_;
+  std::vector<ModelFilePtr> bin_;
 };
 
-void ModelEvaluation::Run() {
-  if (!IsScheduler()) return;
-  // load model
-  std::unordered_map<Key, Real> weight;
-  auto model = searchFiles(conf_.model_input());
-  NOTICE("find %d model files", model.file_size());
+void ModelEvaluation::LoadText(const DataConfig& model) {
   for (int i = 0; i < model.file_size(); ++i) {
 #if USE_S3
     std::ifstream in;
@@ -49,7 +55,7 @@ void ModelEvaluation::Run() {
     while (in.good()) {
       Key k; Real v;
       in >> k >> v;
-      weight[k] = v;
+      weight_[k] = v;
     }
   }
 #if USE_S3
@@ -57,8 +63,50 @@ void ModelEvaluation::Run() {
  std::string cmd="rm -rf model_file";
  system(cmd.c_str());
 #endif // USE_S3
+  NOTICE("load %lu model entries", weight_.size());
+}
+
+void ModelEvaluation::LoadBinary(const DataConfig& model) {
+  size_t n = 0;
+  for (int i = 0; i < model.file_size(); ++i) {
+    ModelFilePtr f(new ModelFile<Key, Real>());
+    CHECK(f->Open(model.file(i))) << "failed to open " << model.file(i);
+    CHECK_EQ(f->k(), 1) << model.file(i);
+    if (f->size() == 0) continue;
+    n += f->size();
+    bin_.push_back(f);
+  }
+  // servers own disjoint key ranges, sort the files by their first keys
+  std::sort(bin_.begin(), bin_.end(), [](
+      const ModelFilePtr& a, const ModelFilePtr& b) {
+        return a->front() < b->front(); });
+  NOTICE("map %lu model entries", n);
+}
 
-  NOTICE("load %lu model entries", weight.size());
+bool ModelEvaluation::Weight(Key key, Real* w) {
+  if (bin_.empty()) {
+    auto it = weight_.find(key);
+    if (it == weight_.end()) return false;
+    *w = it->second;
+    return true;
+  }
+  // the last file whose first key is not greater than "key"
+  auto it = std::upper_bound(bin_.begin(), bin_.end(), key, [](
+      Key k, const ModelFilePtr& f) { return k < f->front(); });
+  if (it == bin_.begin()) return false;
+  return (*(--it))->Get(key, w);
+}
+
+void ModelEvaluation::Run() {
+  if (!IsScheduler()) return;
+  // load model
+  auto model = searchFiles(conf_.model_input());
+  NOTICE("find %d model files", model.file_size());
+  if (model.format() == DataConfig::BIN) {
+    LoadBinary(model);
+  } else {
+    LoadText(model);
+  }
 
   // load evaluation data and compute the predicted value
   auto data = searchFiles(conf_.validation_data());
@@ -82,9 +130,9 @@ void ModelEvaluation::Run() {
       Real re = 0;
       for (size_t j = X->offset()[i]; j < X->offset()[i+1]; ++j) {
         // TODO build a bloom filter
-        auto it = weight.find(X->index()[j]);
-        if (it != weight.end()) {
-          re += it->second * (X->binary() ? 1 : X->value()[j]);
+        Real w;
+        if (Weight(X->index()[j], &w)) {
+          re += w * (X->binary() ? 1 : X->value()[j]);
         }
       }
       Xw[i] = re;
@@ -21,9 +21,13 @@ void BCDScheduler::ProcessResponse(Message* response) {
     LoadDataResponse info;
     CHECK(info.ParseFromString(task.msg()));
     // LL << info.DebugString();
-    g_train_info_ = mergeExampleInfo(g_train_info_, info.example_info());
-    hit_cache_ += info.hit_cache();
-    ++ load_data_;
+    {
+      Lock l(load_mu_);
+      g_train_info_ = mergeExampleInfo(g_train_info_, info.example_info());
+      hit_cache_ += info.hit_cache();
+      ++ load_data_;
+    }
+    load_cond_.notify_all();
   } else if (task.bcd().cmd() == BCDCall::EVALUATE_PROGRESS) {
     BCDProgress prog;
     CHECK(prog.ParseFromString(task.msg()));
@@ -37,7 +41,10 @@ void BCDScheduler::LoadData() {
   sys_.manager().WaitWorkersReady();
   auto load_time = tic();
   int n = sys_.manager().num_workers();
-  while (load_data_ < n) usleep(500);
+  {
+    std::unique_lock<std::mutex> lk(load_mu_);
+    load_cond_.wait(lk, [this, n] { return load_data_ >= n; });
+  }
   if (hit_cache_ > 0) {
     CHECK_EQ(hit_cache_, n) << "clear the local caches";
     NOTICE("Hit local caches for the training data");
@@ -9,6 +9,7 @@
 #include "data/common.h"
 #include "util/localizer.h"
 #include "parameter/kv_vector.h"
+#include "util/model_file.h"
 namespace PS {
 #if USE_S3
 bool s3file(const std::string& name);
@@ -83,7 +84,9 @@ class BCDScheduler : public App {
   void MergeProgress(int iter, const BCDProgress& recv);
 
   int hit_cache_ = 0;
-  int load_data_ = 0;
+  int load_data_ = 0;  // the number of workers finished data loading
+  std::mutex load_mu_;
+  std::condition_variable load_cond_;
   Timer total_timer_;
 };
 
@@ -244,6 +247,35 @@ class BCDServer : public BCDCompNode<V> {
 #else
       LI << MyNodeID() << " written the model to " << file;
 #endif // USE_S3
+    } else if (output.format() == DataConfig::BIN) {
+      CHECK(output.file_size());
+      std::string file = output.file(0) + "_" + MyNodeID();
+      if (!dirExists(getPath(file))) {
+        createDir(getPath(file));
+      }
+      std::vector<std::pair<Key, float>> entries;
+      for (int grp : fea_grp_) {
+        auto key = model_[grp].key;
+        auto value = model_[grp].value;
+        CHECK_EQ(key.size(), value.size());
+        for (size_t i = 0; i < key.size(); ++i) {
+          double v = value[i];
+          if (v != 0 && !(v != v)) entries.push_back(std::make_pair(key[i], v));
+        }
+      }
+      // the keys of a group are sorted, but groups may interleave or overlap
+      std::sort(entries.begin(), entries.end());
+      entries.erase(std::unique(entries.begin(), entries.end(), [](
+          const std::pair<Key, float>& a, const std::pair<Key, float>& b) {
+            return a.first == b.first; }), entries.end());
+      SArray<Key> key(entries.size());
+      SArray<float> val(entries.size());
+      for (size_t i = 0; i < entries.size(); ++i) {
+        key[i] = entries[i].first;
+        val[i] = entries[i].second;
+      }
+      ModelFile<Key, float>::Write(file, key, val, 1, output.compressed());
+      LI << MyNodeID() << " written the binary model to " << file;
     }
   }
   USING_BCD_COMP_NODE;
@@ -302,6 +334,18 @@ class BCDWorker : public BCDCompNode<V> {
     int max_parallel = std::max(
         1, bcd_conf_.max_num_parallel_groups_in_preprocessing());
 
+    // partition the key range by the keys before pushing them to servers, see
+    // -key_partition. the index is loaded again later, to bound the memory
+    auto& manager = this->sys_.manager();
+    if (!hit_cache && manager.balance_key_ranges()) {
+      NodeAssigner::KeySample sample;
+      for (int grp : fea_grp_) {
+        manager.SampleKeys(slot_reader_.index(grp), &sample);
+        slot_reader_.clear(grp);
+      }
+      manager.BalanceKeyRanges(sample);
+    }
+
     // filter keys whose occurance <= bcd_conf_.tail_feature_freq()
     std::vector<int> pull_time(grp_size);
     for (int i = 0; i < grp_size; ++i, time += 3) {
@@ -1,4 +1,5 @@
 #include "learner/sgd.h"
+#include "util/file.h"
 namespace PS {
 
 ISGDScheduler::~ISGDScheduler() {
@@ -15,12 +16,22 @@ void ISGDScheduler::Run() {
   sys_.manager().AddNodeFailureHandler([this](const NodeID& id) {
       CHECK_NOTNULL(workload_pool_)->restore(id);
     });
-  CHECK_NOTNULL(workload_pool_)->waitUtilDone();
+  if (!ckpt_dir_.empty()) {
+    RestoreCheckpoint();
+    Resume();
+  }
+  if (ckpt_interval_ > 0) {
+    while (!CHECK_NOTNULL(workload_pool_)->waitUtilDone(ckpt_interval_)) {
+      SaveCheckpoint();
+    }
+  } else {
+    CHECK_NOTNULL(workload_pool_)->waitUtilDone();
+  }
 
   // save model
   Task task;
   task.mutable_sgd()->set_cmd(SGDCall::SAVE_MODEL);
-  int ts = Submit(task, kServerGroup);
+  int64 ts = Submit(task, kServerGroup);
   Wait(ts);
 }
 
@@ -41,6 +52,10 @@ void ISGDScheduler::ProcessRequest(Message* request) {
 }
 
 void ISGDScheduler::SendWorkload(const NodeID& recver) {
+  {
+    Lock l(pause_mu_);
+    if (paused_) { idle_nodes_.push_back(recver); return; }
+  }
   Task task;
   task.mutable_sgd()->set_cmd(SGDCall::UPDATE_MODEL);
   if (workload_pool_->assign(recver, task.mutable_sgd()->mutable_load())) {
@@ -48,6 +63,103 @@ void ISGDScheduler::SendWorkload(const NodeID& recver) {
   }
 }
 
+void ISGDScheduler::Pause() {
+  Lock l(pause_mu_);
+  paused_ = true;
+}
+
+void ISGDScheduler::Resume() {
+  std::vector<NodeID> idle;
+  {
+    Lock l(pause_mu_);
+    paused_ = false;
+    idle.swap(idle_nodes_);
+  }
+  for (const auto& id : idle) SendWorkload(id);
+}
+
+void ISGDScheduler::set_checkpoint(
+    const std::string& dir, int interval, int full_every) {
+  ckpt_dir_ = dir;
+  ckpt_interval_ = dir.empty() ? 0 : interval;
+  ckpt_full_every_ = std::max(full_every, 1);
+  // no workload is assigned before restoring
+  if (!dir.empty()) Pause();
+}
+
+void ISGDScheduler::CallCheckpoint(const CheckpointCall& call) {
+  Task task;
+  task.mutable_sgd()->set_cmd(SGDCall::CHECKPOINT);
+  *task.mutable_sgd()->mutable_checkpoint() = call;
+  Wait(Submit(task, kServerGroup));
+}
+
+// the manifest "<dir>/checkpoint" has the first line "<full> <next>", see
+// ckpt_full_, and then the data files of the finished workloads, one per line
+void ISGDScheduler::SaveCheckpoint() {
+  auto tv = tic();
+  // the pushes of a workload are applied by servers once it is finished
+  Pause();
+  workload_pool_->waitUtilIdle();
+  double wait = toc(tv);
+
+  int seq = ckpt_next_;
+  bool full = ckpt_full_ < 0 || seq - ckpt_full_ >= ckpt_full_every_;
+  CheckpointCall call;
+  call.set_cmd(CheckpointCall::SAVE);
+  call.set_incremental(!full);
+  call.add_prefix(CheckpointPrefix(seq));
+  CallCheckpoint(call);
+
+  int old_full = ckpt_full_;
+  if (full) ckpt_full_ = seq;
+  ckpt_next_ = seq + 1;
+  std::string str = std::to_string(ckpt_full_) + " " +
+                    std::to_string(ckpt_next_) + "\n";
+  for (const auto& f : workload_pool_->finishedFiles()) str += f + "\n";
+  std::string manifest = ckpt_dir_ + "/checkpoint";
+  if (!dirExists(ckpt_dir_)) createDir(ckpt_dir_);
+  CHECK(writeStringToFile(str, manifest + ".tmp"));
+  CHECK_EQ(std::rename((manifest + ".tmp").c_str(), manifest.c_str()), 0);
+  Resume();
+
+  // the previous ones are not used any more
+  if (full && old_full >= 0) {
+    call.set_cmd(CheckpointCall::REMOVE);
+    call.clear_prefix();
+    for (int i = old_full; i < seq; ++i) call.add_prefix(CheckpointPrefix(i));
+    CallCheckpoint(call);
+  }
+  LOG(INFO) << "saved " << (full ? "full" : "incremental") << " checkpoint "
+            << seq << " in " << toc(tv) << " sec, including " << wait
+            << " sec waiting for the running workloads";
+}
+
+void ISGDScheduler::RestoreCheckpoint() {
+  std::string str;
+  std::string manifest = ckpt_dir_ + "/checkpoint";
+  if (!File::exists(manifest.c_str()) || !readFileToString(manifest, &str)) {
+    LOG(INFO) << "no checkpoint in " << ckpt_dir_;
+    return;
+  }
+  std::stringstream ss(str);
+  CHECK(ss >> ckpt_full_ >> ckpt_next_) << "invalid " << manifest;
+  std::vector<std::string> finished;
+  std::string line;
+  while (std::getline(ss, line)) if (!line.empty()) finished.push_back(line);
+
+  auto tv = tic();
+  CheckpointCall call;
+  call.set_cmd(CheckpointCall::RESTORE);
+  for (int i = ckpt_full_; i < ckpt_next_; ++i) {
+    call.add_prefix(CheckpointPrefix(i));
+  }
+  CallCheckpoint(call);
+  workload_pool_->markFinished(finished);
+  LOG(INFO) << "restored checkpoints [" << ckpt_full_ << ", " << ckpt_next_
+            << ") in " << toc(tv) << " sec";
+}
+
 void ISGDScheduler::ShowProgress(
     double time, std::unordered_map<NodeID, SGDProgress>* progress) {
   uint64 num_ex = 0, nnz_w = 0;
@@ -36,11 +36,43 @@ class ISGDScheduler : public App {
   void SendWorkload(const NodeID& recver);
   MonitorMaster<SGDProgress> monitor_;
 
+  /**
+   * @brief Checkpoints the servers every "interval" seconds into "dir", and
+   * restores from the last checkpoint in "dir" before assigning any workload.
+   * Every "full_every" checkpoints, one is full and the others are
+   * incremental. A checkpoint pauses assigning workloads until the running
+   * ones are finished, so the servers save the same pushes.
+   */
+  void set_checkpoint(const std::string& dir, int interval, int full_every);
+
   WorkloadPool *workload_pool_ = nullptr;
 
   // display
   size_t num_ex_processed_ = 0;
   bool show_prog_head_ = true;
+
+ private:
+  void SaveCheckpoint();
+  void RestoreCheckpoint();
+  // sends the CheckpointCall "call" to servers and waits for them
+  void CallCheckpoint(const CheckpointCall& call);
+  std::string CheckpointPrefix(int seq) {
+    return ckpt_dir_ + "/ckpt-" + std::to_string(seq);
+  }
+  std::string ckpt_dir_;
+  int ckpt_interval_ = 0;
+  int ckpt_full_every_ = 1;
+  // the checkpoints [ckpt_full_, ckpt_next_) are the last full one and the
+  // incremental ones after it
+  int ckpt_full_ = -1;
+  int ckpt_next_ = 0;
+
+  // the nodes asked for workloads while paused
+  void Pause();
+  void Resume();
+  std::mutex pause_mu_;
+  bool paused_ = false;
+  std::vector<NodeID> idle_nodes_;
 };
 
 /**
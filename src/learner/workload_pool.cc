@@ -48,30 +48,70 @@ void WorkloadPool::restore(const NodeID& node_id) {
       LOG(INFO) << "restore workload " << info.load.id() << " from " << node_id;
     }
   }
+  done_cond_.notify_all();
 }
 
 
 void WorkloadPool::finish(int id) {
-  Lock l(mu_);
-  CHECK_GE(id, 0); CHECK_LT(id, loads_.size());
-  loads_[id].finished = true;
-  ++ num_finished_;
-  VLOG(1) << "workload " << id << " is finished";
+  {
+    Lock l(mu_);
+    CHECK_GE(id, 0); CHECK_LT(id, loads_.size());
+    loads_[id].finished = true;
+    ++ num_finished_;
+    VLOG(1) << "workload " << id << " is finished";
+  }
+  done_cond_.notify_all();
 }
 
 
 void WorkloadPool::waitUtilDone() {
-  while (true) {
-    mu_.lock();
-    bool done = num_finished_ >= loads_.size();
-    mu_.unlock();
-    if (done) {
-      break;
-    } else {
-      usleep(1000);
+  std::unique_lock<std::mutex> lk(mu_);
+  done_cond_.wait(lk, [this] { return num_finished_ >= loads_.size(); });
+  VLOG(1) << "all workloads are done";
+}
+
+bool WorkloadPool::waitUtilDone(int timeout) {
+  std::unique_lock<std::mutex> lk(mu_);
+  return done_cond_.wait_for(lk, std::chrono::seconds(timeout), [this] {
+      return num_finished_ >= loads_.size(); });
+}
+
+void WorkloadPool::waitUtilIdle() {
+  std::unique_lock<std::mutex> lk(mu_);
+  done_cond_.wait(lk, [this] {
+      for (const auto& info : loads_) {
+        if (info.assigned && !info.finished) return false;
+      }
+      return true;
+    });
+}
+
+std::vector<std::string> WorkloadPool::finishedFiles() {
+  Lock l(mu_);
+  std::vector<std::string> files;
+  for (const auto& info : loads_) {
+    if (info.finished) files.push_back(info.load.data().file(0));
+  }
+  return files;
+}
+
+void WorkloadPool::markFinished(const std::vector<std::string>& files) {
+  {
+    Lock l(mu_);
+    // the order of loads_ may differ because of shuffling
+    std::unordered_map<std::string, int> cnt;
+    for (const auto& f : files) ++ cnt[f];
+    for (auto& info : loads_) {
+      auto it = cnt.find(info.load.data().file(0));
+      if (info.finished || it == cnt.end() || it->second == 0) continue;
+      -- it->second;
+      info.assigned = info.finished = true;
+      ++ num_finished_;
     }
+    LOG(INFO) << num_finished_ << " of " << loads_.size()
+              << " workloads are finished before";
   }
-  VLOG(1) << "all workloads are done";
+  done_cond_.notify_all();
 }
 
 } // namespace PS
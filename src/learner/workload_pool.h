@@ -25,6 +25,17 @@ class WorkloadPool {
 
   // block until all workloads are finished
   void waitUtilDone();
+  // block until all workloads are finished or *timeout* seconds passed. return
+  // true if all are finished
+  bool waitUtilDone(int timeout);
+  // block until no assigned workload is unfinished
+  void waitUtilIdle();
+
+  // the data files of the finished workloads, one per workload
+  std::vector<std::string> finishedFiles();
+  // mark a workload of each file in *files* as finished, e.g. the ones
+  // finished before restoring from a checkpoint
+  void markFinished(const std::vector<std::string>& files);
 
  protected:
   struct WorkloadInfo {
@@ -36,6 +47,7 @@ class WorkloadPool {
   std::vector<WorkloadInfo> loads_;
   int num_finished_ = 0;
   std::mutex mu_;
+  std::condition_variable done_cond_;
 };
 
 } // namespace PS
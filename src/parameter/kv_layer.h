@@ -58,7 +58,7 @@ class  KVLayer : public Parameter {
    *
    * @return the timestamp of the push request
    */
-  int Push(const Task& task, V* data, size_t size, bool zero_copy = false);
+  int64 Push(const Task& task, V* data, size_t size, bool zero_copy = false);
 
   /**
    * @brief Sent a pull request to servers.
@@ -71,7 +71,7 @@ class  KVLayer : public Parameter {
    *
    * @return the timestamp of the pull request
    */
-  int Pull(const Task& task, V* data, size_t size,
+  int64 Pull(const Task& task, V* data, size_t size,
            Message::Callback callback = Message::Callback());
 
   virtual void Slice(const Message& request, const std::vector<Range<Key>>& krs,
@@ -88,7 +88,7 @@ class  KVLayer : public Parameter {
 };
 
 template <typename V, class Updater>
-int KVLayer<V, Updater>::Push(const Task& task, V* data, size_t size, bool zero_copy) {
+int64 KVLayer<V, Updater>::Push(const Task& task, V* data, size_t size, bool zero_copy) {
   // LOG_FIRST_N(INFO, 100) << size;
   SArray<V> val;
   if (zero_copy) {
@@ -103,7 +103,7 @@ int KVLayer<V, Updater>::Push(const Task& task, V* data, size_t size, bool zero_
 }
 
 template <typename V, class Updater>
-int KVLayer<V, Updater>::Pull(
+int64 KVLayer<V, Updater>::Pull(
     const Task& task, V* data, size_t size, std::function<void()> callback) {
   int id = task.key_channel();
   if (data == NULL) {
@@ -1,6 +1,8 @@
 #pragma once
 #include "ps.h"
 #include "parameter/parameter.h"
+#include "util/model_file.h"
+#include "util/flat_map.h"
 namespace PS {
 
 /**
@@ -20,18 +22,40 @@ struct KVMapState {
   void Update() { }
 };
 
+/**
+ * @brief Calls f(i, (*map)[key[i]]) for i = 0, ..., n-1
+ */
+template <typename M, typename K, typename F>
+void VisitEntries(M* map, const K* key, size_t n, F f) {
+  for (size_t i = 0; i < n; ++i) f(i, (*map)[key[i]]);
+}
+
+/**
+ * @brief FlatMap hashes the keys in batches and prefetches the slots
+ */
+template <typename K, typename E, typename H, typename F>
+void VisitEntries(FlatMap<K, E, H>* map, const K* key, size_t n, F f) {
+  map->visit(key, n, f);
+}
+
 /**
  * @brief A key-value store with fixed length value.
  *
+ * With -num_replicas, a server forwards the entries changed by pushes to its
+ * replicas, which are copied byte by byte, and so are the checkpoints. So E
+ * must be trivially copyable.
  *
  * @tparam K the key type
  * @tparam V the value type
  * @tparam E the entry type
  * @tparam S the state type
+ * @tparam M the map storing the entries of a processing thread, such as
+ * FlatMap<K,E>, which uses much less memory per key
  */
 template <typename K, typename V,
           typename E = KVMapEntry<V>,
-          typename S = KVMapState>
+          typename S = KVMapState,
+          typename M = std::unordered_map<K, E>>
 class KVMap : public Parameter {
  public:
   /**
@@ -41,54 +65,343 @@ class KVMap : public Parameter {
    * @param id customer id
    */
   KVMap(int k = 1, int id = NextCustomerID()) :
-      Parameter(id), k_(k) {
+      Parameter(id), k_(k), data_(1), state_(1), backup_(1), changed_(1) {
     CHECK_GT(k, 0);
   }
-  virtual ~KVMap() { }
+  virtual ~KVMap() { StopBackup(); }
+
+  void set_state(const S& s) {
+    for (auto& st : state_) st = s;
+  }
 
-  void set_state(const S& s) { state_ = s; }
+  /// @brief the number of entries, do not call it while processing requests
+  size_t size() const {
+    size_t n = 0;
+    for (const auto& d : data_) n += d.size();
+    return n;
+  }
+
+  /**
+   * @brief Each processing thread owns the entries and the state of its key
+   * range, see Customer::ProcessInParallel
+   */
+  virtual void ProcessInParallel(int num_threads) {
+    num_threads = std::max(num_threads, 1);
+    data_.resize(num_threads);
+    S s = state_[0];
+    state_.resize(num_threads, s);
+    backup_.resize(num_threads);
+    changed_.resize(num_threads);
+    Parameter::ProcessInParallel(num_threads);
+  }
 
   virtual void Slice(const Message& request, const std::vector<Range<Key>>& krs,
                      std::vector<Message*>* msgs) {
+    if (SliceReplica(request, krs, msgs)) return;
     SliceKOFVMessage<K>(request, krs, msgs);
   }
 
   virtual void GetValue(Message* msg);
   virtual void SetValue(const Message* msg);
 
+  virtual void BackupValue(const Message* msg);
+  virtual void GetBackup(std::vector<Message*>* msgs);
+  virtual void SetReplica(const Message* msg);
+  virtual void Recover(Message* msg);
+
+  virtual void GetMigration(const Range<Key>& range, size_t batch_bytes,
+                            std::vector<Message*>* msgs);
+  virtual void SetMigration(const Message* msg);
+  virtual void EraseKeys(const Range<Key>& range);
+
+  virtual void WriteCheckpoint(bool incremental, File* file);
+  virtual void ReadCheckpoint(File* file);
+
   virtual void WriteToFile(std::string file);
+  virtual void WriteToBinaryFile(const std::string& file, bool compress);
 
  protected:
+  // the part of the entries owned by the calling thread
+  int part() const { return std::max(ProcessThreadID(), 0); }
+  // the part of the entries owning key "k", "ranges" is ProcessRanges()
+  static int PartOf(const std::vector<Range<Key>>& ranges, K k) {
+    int i = 0;
+    while (i + 1 < (int)ranges.size() && ranges[i+1].begin() <= (Key)k) ++ i;
+    return i;
+  }
+  // records the keys changed for the incremental checkpoints
+  void AddChanged(int p, const SArray<K>& key) {
+    if (!tracking_changes()) return;
+    auto& changed = changed_[p];
+    for (K k : key) changed.insert(k);
+  }
+
   int k_;
-  S state_;
-  // TODO use multi-thread cuokoo hash
-  std::unordered_map<K, E> data_;
+  std::vector<M> data_;   // one per processing thread
+  std::vector<S> state_;  // one per processing thread
+
+  // the entries changed since the last GetBackup, one per processing thread
+  std::vector<std::unordered_map<K, E>> backup_;
+  std::mutex backup_mu_;
+  // <owner, the replica of its entries>, only accessed by the executor thread
+  std::unordered_map<NodeID, std::unordered_map<K, E>> replica_;
+
+  // the keys changed since the last checkpoint, one per processing thread
+  std::vector<std::unordered_set<K>> changed_;
 };
 
-template <typename K, typename V, typename E, typename S>
-void KVMap<K,V,E,S>::GetValue(Message* msg) {
+template <typename K, typename V, typename E, typename S, typename M>
+void KVMap<K,V,E,S,M>::GetValue(Message* msg) {
   SArray<K> key(msg->key);
   size_t n = key.size();
   SArray<V> val(n * k_);
-  for (size_t i = 0; i < n; ++i) {
-    data_[key[i]].Get(val.data() + i * k_, &state_);
+  int k = k_;
+  // a request processed as a whole by the executor thread, see ProcessWhole,
+  // reads the parts of all processing threads, which are idle meanwhile
+  bool whole = ProcessThreadID() < 0 && data_.size() > 1;
+  for (size_t i = 0, j; i < n; i = j) {
+    int p = part();
+    j = n;
+    if (whole) {
+      const auto& ranges = ProcessRanges();
+      p = PartOf(ranges, key[i]);
+      if (p + 1 < (int)ranges.size()) {
+        Key end = ranges[p+1].begin();
+        j = std::lower_bound(key.begin() + i, key.end(), end,
+                             [](K a, Key b) { return (Key)a < b; }) - key.begin();
+      }
+    }
+    auto& state = state_[p];
+    V* v = val.data() + i * k;
+    VisitEntries(&data_[p], key.data() + i, j - i,
+                 [v, k, &state](size_t i, E& e) { e.Get(v + i * k, &state); });
   }
   msg->add_value(val);
 }
 
-template <typename K, typename V, typename E, typename S>
-void KVMap<K,V,E,S>::SetValue(const Message* msg) {
+template <typename K, typename V, typename E, typename S, typename M>
+void KVMap<K,V,E,S,M>::SetValue(const Message* msg) {
   SArray<K> key(msg->key);
   size_t n = key.size();
   CHECK_EQ(msg->value.size(), 1);
   SArray<V> val(msg->value[0]);
   CHECK_EQ(n * k_, val.size());
 
+  auto& state = state_[part()];
+  const V* v = val.data();
+  int k = k_;
+  VisitEntries(&data_[part()], key.data(), n, [v, k, &state](size_t i, E& e) {
+      e.Set(v + i * k, &state);
+    });
+  state.Update();
+  AddChanged(part(), key);
+}
+template <typename K, typename V, typename E, typename S, typename M>
+void KVMap<K,V,E,S,M>::BackupValue(const Message* msg) {
+  SArray<K> key(msg->key);
+  auto& data = data_[part()];
+  {
+    Lock l(backup_mu_);
+    auto& backup = backup_[part()];
+    for (K k : key) backup[k] = data[k];
+  }
+  BackupAdded(key.size() * (sizeof(K) + sizeof(E)));
+}
+
+template <typename K, typename V, typename E, typename S, typename M>
+void KVMap<K,V,E,S,M>::GetBackup(std::vector<Message*>* msgs) {
+  std::vector<std::unordered_map<K, E>> backup(backup_.size());
+  {
+    Lock l(backup_mu_);
+    for (size_t i = 0; i < backup_.size(); ++i) backup[i].swap(backup_[i]);
+  }
+  size_t n = 0;
+  for (const auto& b : backup) n += b.size();
+  if (n == 0) return;
+  SArray<K> key(n);
+  SArray<char> val(n * sizeof(E));
+  size_t i = 0;
+  for (const auto& b : backup) {
+    for (const auto& e : b) {
+      key[i] = e.first;
+      memcpy(val.data() + i * sizeof(E), &e.second, sizeof(E));
+      ++ i;
+    }
+  }
+  Message* msg = new Message();
+  msg->set_key(key);
+  msg->add_value(val);
+  msgs->push_back(msg);
+}
+
+template <typename K, typename V, typename E, typename S, typename M>
+void KVMap<K,V,E,S,M>::SetReplica(const Message* msg) {
+  SArray<K> key(msg->key);
+  size_t n = key.size();
+  CHECK_EQ(msg->value.size(), 1);
+  SArray<char> val(msg->value[0]);
+  CHECK_EQ(n * sizeof(E), val.size());
+  auto& replica = replica_[msg->sender];
+  for (size_t i = 0; i < n; ++i) {
+    memcpy(&replica[key[i]], val.data() + i * sizeof(E), sizeof(E));
+  }
+}
+
+template <typename K, typename V, typename E, typename S, typename M>
+void KVMap<K,V,E,S,M>::Recover(Message* msg) {
+  const NodeID& dead = msg->task.msg();
+  auto it = replica_.find(dead);
+  if (it == replica_.end()) {
+    LOG(WARNING) << MyNodeID() << ": no replica of " << dead;
+    return;
+  }
+  // the key range of the dead node is next to mine, so its keys are usually
+  // processed by the first or the last processing thread
+  const auto& ranges = ProcessRanges();
+  {
+    Lock l(backup_mu_);
+    for (const auto& e : it->second) {
+      int p = PartOf(ranges, e.first);
+      data_[p][e.first] = e.second;
+      // my replicas do not have them yet
+      backup_[p][e.first] = e.second;
+      if (tracking_changes()) changed_[p].insert(e.first);
+    }
+  }
+  LOG(INFO) << MyNodeID() << ": recovered " << it->second.size()
+            << " entries of " << dead;
+  BackupAdded(it->second.size() * (sizeof(K) + sizeof(E)));
+  replica_.erase(it);
+}
+
+template <typename K, typename V, typename E, typename S, typename M>
+void KVMap<K,V,E,S,M>::GetMigration(const Range<Key>& range, size_t batch_bytes,
+                                    std::vector<Message*>* msgs) {
+  std::vector<std::pair<K, const E*>> entries;
+  for (const auto& data : data_) {
+    for (const auto& e : data) {
+      if (range.contains((Key)e.first)) entries.push_back(
+              std::make_pair(e.first, &e.second));
+    }
+  }
+  std::sort(entries.begin(), entries.end(), [](
+      const std::pair<K, const E*>& a, const std::pair<K, const E*>& b) {
+      return a.first < b.first; });
+
+  size_t batch = std::max<size_t>(1, batch_bytes / (sizeof(K) + sizeof(E)));
+  for (size_t i = 0; i < entries.size(); i += batch) {
+    size_t n = std::min(batch, entries.size() - i);
+    SArray<K> key(n);
+    SArray<char> val(n * sizeof(E));
+    for (size_t j = 0; j < n; ++j) {
+      key[j] = entries[i+j].first;
+      memcpy(val.data() + j * sizeof(E), entries[i+j].second, sizeof(E));
+    }
+    Message* msg = new Message();
+    msg->set_key(key);
+    msg->add_value(val);
+    msgs->push_back(msg);
+  }
+}
+
+template <typename K, typename V, typename E, typename S, typename M>
+void KVMap<K,V,E,S,M>::SetMigration(const Message* msg) {
+  SArray<K> key(msg->key);
+  size_t n = key.size();
+  CHECK_EQ(msg->value.size(), 1);
+  SArray<char> val(msg->value[0]);
+  CHECK_EQ(n * sizeof(E), val.size());
+  auto& data = data_[part()];
   for (size_t i = 0; i < n; ++i) {
-    data_[key[i]].Set(val.data() + i * k_, &state_);
+    memcpy(&data[key[i]], val.data() + i * sizeof(E), sizeof(E));
+  }
+  AddChanged(part(), key);
+  if (IsReplicated()) BackupValue(msg);
+}
+
+template <typename K, typename V, typename E, typename S, typename M>
+void KVMap<K,V,E,S,M>::EraseKeys(const Range<Key>& range) {
+  size_t n = 0;
+  for (auto& data : data_) {
+    for (auto it = data.begin(); it != data.end(); ) {
+      if (range.contains((Key)it->first)) {
+        it = data.erase(it); ++ n;
+      } else {
+        ++ it;
+      }
+    }
+  }
+  VLOG(1) << MyNodeID() << ": erased " << n << " entries in "
+          << range.ToString();
+}
+
+template <typename K, typename V, typename E, typename S, typename M>
+void KVMap<K,V,E,S,M>::WriteCheckpoint(bool incremental, File* file) {
+  std::vector<std::pair<K, const E*>> entries;
+  for (size_t i = 0; i < data_.size(); ++i) {
+    const auto& data = data_[i];
+    if (incremental) {
+      for (K k : changed_[i]) {
+        auto it = data.find(k);
+        if (it != data.end()) entries.push_back(std::make_pair(k, &it->second));
+      }
+    } else {
+      for (const auto& e : data) {
+        entries.push_back(std::make_pair(e.first, &e.second));
+      }
+    }
+    changed_[i].clear();
+  }
+  // [sizeof(K), sizeof(E), n], and then n (key, entry) pairs
+  uint64 head[3] = {sizeof(K), sizeof(E), entries.size()};
+  file->writeOrDie(head, sizeof(head));
+  const size_t kChunk = 1 << 16;
+  std::vector<char> buf(kChunk * (sizeof(K) + sizeof(E)));
+  for (size_t i = 0; i < entries.size(); i += kChunk) {
+    size_t n = std::min(kChunk, entries.size() - i);
+    char* p = buf.data();
+    for (size_t j = 0; j < n; ++j) {
+      memcpy(p, &entries[i+j].first, sizeof(K)); p += sizeof(K);
+      memcpy(p, entries[i+j].second, sizeof(E)); p += sizeof(E);
+    }
+    file->writeOrDie(buf.data(), p - buf.data());
+  }
+}
+
+template <typename K, typename V, typename E, typename S, typename M>
+void KVMap<K,V,E,S,M>::ReadCheckpoint(File* file) {
+  uint64 head[3];
+  file->readOrDie(head, sizeof(head));
+  CHECK_EQ(head[0], sizeof(K)) << "the key type is changed";
+  CHECK_EQ(head[1], sizeof(E)) << "the entry type is changed";
+
+  Range<Key> range = MyKeyRange();
+  const auto& ranges = ProcessRanges();
+
+  const size_t kChunk = 1 << 16;
+  std::vector<char> buf(kChunk * (sizeof(K) + sizeof(E)));
+  size_t num = 0;
+  for (size_t i = 0; i < head[2]; i += kChunk) {
+    size_t n = std::min<size_t>(kChunk, head[2] - i);
+    file->readOrDie(buf.data(), n * (sizeof(K) + sizeof(E)));
+    const char* p = buf.data();
+    for (size_t j = 0; j < n; ++j, p += sizeof(K) + sizeof(E)) {
+      K k; memcpy(&k, p, sizeof(K));
+      if (!range.contains((Key)k)) continue;
+      int part = PartOf(ranges, k);
+      E& e = data_[part][k];
+      memcpy(&e, p + sizeof(K), sizeof(E));
+      if (IsReplicated()) {
+        Lock l(backup_mu_);
+        backup_[part][k] = e;
+      }
+      ++ num;
+    }
   }
-  state_.Update();
+  VLOG(1) << MyNodeID() << ": read " << num << " of " << head[2] << " entries";
+  if (IsReplicated()) BackupAdded(num * (sizeof(K) + sizeof(E)));
 }
+
 #if USE_S3
 bool s3file(const std::string& name);
 std::string s3Prefix(const std::string& path);
@@ -96,8 +409,8 @@ std::string s3Bucket(const std::string& path);
 std::string s3FileUrl(const std::string& path);
 #endif // USE_S3
 
-template <typename K, typename V, typename E, typename S>
-void KVMap<K,V,E,S>::WriteToFile(std::string file) {
+template <typename K, typename V, typename E, typename S, typename M>
+void KVMap<K,V,E,S,M>::WriteToFile(std::string file) {
 #if USE_S3
   std::string s3_file;
   if (s3file(file)) {
@@ -111,9 +424,11 @@ void KVMap<K,V,E,S>::WriteToFile(std::string file) {
   }
   std::ofstream out(file); CHECK(out.good());
   V v;
-  for (auto& e : data_) {
-    e.second.Get(&v, &state_);
-    if (v != 0) out << e.first << "\t" << v << std::endl;
+  for (size_t i = 0; i < data_.size(); ++i) {
+    for (auto&& e : data_[i]) {
+      e.second.Get(&v, &state_[i]);
+      if (v != 0) out << e.first << "\t" << v << std::endl;
+    }
   }
 #if USE_S3
   if (s3file(s3_file)) {
@@ -129,5 +444,36 @@ void KVMap<K,V,E,S>::WriteToFile(std::string file) {
 #endif // USE_S3
 }
 
+template <typename K, typename V, typename E, typename S, typename M>
+void KVMap<K,V,E,S,M>::WriteToBinaryFile(const std::string& file,
+                                          bool compress) {
+  if (!dirExists(getPath(file))) {
+    createDir(getPath(file));
+  }
+  // <key, the position of its k_ values in vals>, the entries with all values
+  // 0 are skipped
+  std::vector<std::pair<K, size_t>> entries;
+  std::vector<float> vals;
+  std::vector<V> v(k_);
+  for (size_t i = 0; i < data_.size(); ++i) {
+    for (auto&& e : data_[i]) {
+      e.second.Get(v.data(), &state_[i]);
+      bool zero = true;
+      for (int j = 0; j < k_; ++j) zero = zero && v[j] == 0;
+      if (zero) continue;
+      entries.push_back(std::make_pair(e.first, vals.size()));
+      for (int j = 0; j < k_; ++j) vals.push_back((float)v[j]);
+    }
+  }
+  std::sort(entries.begin(), entries.end());
+  SArray<K> key(entries.size());
+  SArray<float> val(entries.size() * k_);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    key[i] = entries[i].first;
+    memcpy(val.data() + i * k_, vals.data() + entries[i].second,
+           k_ * sizeof(float));
+  }
+  ModelFile<K, float>::Write(file, key, val, k_, compress);
+}
 
 }  // namespace PS
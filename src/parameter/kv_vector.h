@@ -27,6 +27,11 @@ namespace PS {
  * channels. For example, we can sent a pull request on channel 1 and 2 at same
  * time, then the pulled results will be store at channel 1 and 2,
  * respectively.
+ *
+ * With -num_replicas, a server forwards the pushes merged into its data
+ * directly, namely the ones with only keys, or with values when buffer_value
+ * is false, to its replicas. The changes made by the application itself are
+ * not replicated.
  */
 template <typename K, typename V>
 class KVVector : public Parameter {
@@ -44,7 +49,7 @@ class KVVector : public Parameter {
       Parameter(id), k_(k), buffer_value_(buffer_value) {
     CHECK_GT(k, 0);
   }
-  virtual ~KVVector() { }
+  virtual ~KVVector() { StopBackup(); }
 
   /// @brief n key-value pairs stored by arrays
   struct KVPairs {
@@ -68,9 +73,9 @@ class KVVector : public Parameter {
   };
 
   /// @brief Returns the buffered data on timestamp
-  Buffer buffer(int timestamp) { Lock l(mu_); return buffer_[timestamp]; }
+  Buffer buffer(int64 timestamp) { Lock l(mu_); return buffer_[timestamp]; }
 
-  void ClearBuffer(int timestamp) {
+  void ClearBuffer(int64 timestamp) {
     for (auto& v : buffer_[timestamp].values) v.clear();
   }
 
@@ -86,7 +91,7 @@ class KVVector : public Parameter {
    *
    * @return the timestamp
    */
-  int Push(const Task& request,
+  int64 Push(const Task& request,
            const SArray<K>& keys,
            const std::initializer_list<SArray<V>>& values = {},
            const Message::Callback& callback = Message::Callback());
@@ -100,29 +105,51 @@ class KVVector : public Parameter {
    *
    * @return the timestamp
    */
-  int Pull(const Task& request, const SArray<K>& keys,
+  int64 Pull(const Task& request, const SArray<K>& keys,
            const Message::Callback& callback = Message::Callback());
 
 
   virtual void Slice(const Message& request, const std::vector<Range<Key>>& krs,
                      std::vector<Message*>* msgs) {
+    if (SliceReplica(request, krs, msgs)) return;
     SliceKOFVMessage<K>(request, krs, msgs);
   }
   virtual void GetValue(Message* msg);
   virtual void SetValue(const Message* msg);
+  virtual void BackupValue(const Message* msg);
+  virtual void GetBackup(std::vector<Message*>* msgs);
+  virtual void SetReplica(const Message* msg);
+  virtual void Recover(Message* msg);
+  virtual void GetMigration(const Range<Key>& range, size_t batch_bytes,
+                            std::vector<Message*>* msgs);
+  virtual void SetMigration(const Message* msg);
+  virtual void EraseKeys(const Range<Key>& range);
   using Parameter::Push;
   using Parameter::Pull;
  protected:
+  // adds the pushed values "val" of "key" into "kv"
+  void AddValue(const SArray<K>& key, const SArray<V>& val, KVPairs* kv);
+  // merges "kv", whose keys are not in channel "chl", into this channel.
+  // returns the bytes recorded for the replicas
+  size_t Merge(int chl, const KVPairs& kv);
+
   int k_;  // value entry size
   std::unordered_map<int, KVPairs> data_;  // <channel, KVPairs>
 
   bool buffer_value_;
-  std::unordered_map<int, Buffer> buffer_;  // <channel, Buffer>
+  std::unordered_map<int64, Buffer> buffer_;  // <timestamp, Buffer>
 
   std::mutex mu_;  // protect the structure of data_ and buffer_
 
   // <channel, filter tail keys>
   std::unordered_map<int, FreqencyFilter<Key, uint8>> freq_filter_;
+
+  // the pushes since the last GetBackup, <channel, [(keys, values)]>. the
+  // values are empty if only keys are pushed
+  std::unordered_map<int, std::vector<std::pair<SArray<K>, SArray<V>>>> backup_;
+  std::mutex backup_mu_;
+  // <owner, <channel, replica>>, only accessed by the executor thread
+  std::unordered_map<NodeID, std::unordered_map<int, KVPairs>> replica_;
 };
 
 template <typename K, typename V>
@@ -173,16 +200,7 @@ void KVVector<K,V>::SetValue(const Message* msg) {
     if (!buffer_value_) {
       // write the received value into kv.value directly
       CHECK_EQ(i, 0) << " can only receive one value";
-      CHECK_EQ(recv_data.size(), recv_key.size() * k_);
-      if (kv.value.empty()) {
-        kv.value = SArray<V>(kv.key.size() * k_, 0);
-      }
-      CHECK_EQ(kv.key.size() * k_, kv.value.size());
-
-      size_t n = ParallelOrderedMatch(
-          recv_key, recv_data, kv.key, &kv.value, k_, AssignOpType::PLUS);
-      CHECK_EQ(n, recv_key.size() * k_);
-      VLOG(1) << "matched " << n << " keys";
+      AddValue(recv_key, recv_data, &kv);
     } else {
       // match the received value, then save it
       mu_.lock();
@@ -211,6 +229,176 @@ void KVVector<K,V>::SetValue(const Message* msg) {
   }
 }
 
+template <typename K, typename V>
+void KVVector<K,V>::AddValue(
+    const SArray<K>& key, const SArray<V>& val, KVPairs* kv) {
+  CHECK_EQ(val.size(), key.size() * k_);
+  if (kv->value.empty()) {
+    kv->value = SArray<V>(kv->key.size() * k_, 0);
+  }
+  CHECK_EQ(kv->key.size() * k_, kv->value.size());
+
+  size_t n = ParallelOrderedMatch(
+      key, val, kv->key, &kv->value, k_, AssignOpType::PLUS);
+  CHECK_EQ(n, key.size() * k_);
+  VLOG(1) << "matched " << n << " keys";
+}
+
+template <typename K, typename V>
+void KVVector<K,V>::BackupValue(const Message* msg) {
+  // only the pushes merged by SetValue
+  if (buffer_value_ || msg->task.param().has_tail_filter() ||
+      msg->key.empty() || msg->value.size() > 1) {
+    return;
+  }
+  SArray<K> key(msg->key);
+  SArray<V> val;
+  if (msg->value.size()) val = SArray<V>(msg->value[0]);
+  {
+    Lock l(backup_mu_);
+    backup_[msg->task.key_channel()].push_back(std::make_pair(key, val));
+  }
+  BackupAdded(key.size() * sizeof(K) + val.size() * sizeof(V));
+}
+
+template <typename K, typename V>
+void KVVector<K,V>::GetBackup(std::vector<Message*>* msgs) {
+  std::unordered_map<int, std::vector<std::pair<SArray<K>, SArray<V>>>> backup;
+  {
+    Lock l(backup_mu_);
+    backup.swap(backup_);
+  }
+  for (const auto& it : backup) {
+    // merge the consecutive pushes of the same kind into a single one
+    const auto& pushes = it.second;
+    for (size_t i = 0, j = 0; i < pushes.size(); i = j) {
+      bool key_only = pushes[i].second.empty();
+      SArray<K> key;
+      for (j = i; j < pushes.size() && pushes[j].second.empty() == key_only;
+           ++ j) {
+        key = key.SetUnion(pushes[j].first);
+      }
+      Message* msg = new Message();
+      msg->task.set_key_channel(it.first);
+      msg->set_key(key);
+      if (!key_only) {
+        SArray<V> val(key.size() * k_, 0);
+        for (size_t l = i; l < j; ++l) {
+          ParallelOrderedMatch(pushes[l].first, pushes[l].second, key, &val, k_,
+                               AssignOpType::PLUS);
+        }
+        msg->add_value(val);
+      }
+      msgs->push_back(msg);
+    }
+  }
+}
+
+template <typename K, typename V>
+void KVVector<K,V>::SetReplica(const Message* msg) {
+  SArray<K> key(msg->key);
+  auto& kv = replica_[msg->sender][msg->task.key_channel()];
+  if (msg->value.empty()) {
+    kv.key = kv.key.SetUnion(key);
+    kv.value.clear();
+  } else if (!kv.key.empty()) {
+    AddValue(key, SArray<V>(msg->value[0]), &kv);
+  }
+}
+
+template <typename K, typename V>
+void KVVector<K,V>::Recover(Message* msg) {
+  const NodeID& dead = msg->task.msg();
+  auto it = replica_.find(dead);
+  if (it == replica_.end()) {
+    LOG(WARNING) << MyNodeID() << ": no replica of " << dead;
+    return;
+  }
+  size_t bytes = 0;
+  for (const auto& r : it->second) {
+    bytes += Merge(r.first, r.second);
+    LOG(INFO) << MyNodeID() << ": recovered " << r.second.key.size()
+              << " keys of " << dead << " at channel " << r.first;
+  }
+  replica_.erase(it);
+  BackupAdded(bytes);
+}
+
+template <typename K, typename V>
+size_t KVVector<K,V>::Merge(int chl, const KVPairs& src) {
+  mu_.lock();
+  auto& kv = data_[chl];
+  mu_.unlock();
+  // the keys are disjoint
+  SArray<K> key = kv.key.SetUnion(src.key);
+  SArray<V> val;
+  if (!kv.value.empty() || !src.value.empty()) {
+    val = SArray<V>(key.size() * k_, 0);
+    if (!kv.value.empty()) ParallelOrderedMatch(kv.key, kv.value, key, &val, k_);
+    if (!src.value.empty()) {
+      ParallelOrderedMatch(src.key, src.value, key, &val, k_);
+    }
+  }
+  kv.key = key;
+  kv.value = val;
+  if (!IsReplicated()) return 0;
+
+  // my replicas do not have them yet, send all of this channel
+  Lock l(backup_mu_);
+  auto& backup = backup_[chl];
+  backup.push_back(std::make_pair(key, SArray<V>()));
+  if (!val.empty()) backup.push_back(std::make_pair(key, val));
+  return key.size() * sizeof(K) + val.size() * sizeof(V);
+}
+
+template <typename K, typename V>
+void KVVector<K,V>::GetMigration(const Range<Key>& range, size_t batch_bytes,
+                                 std::vector<Message*>* msgs) {
+  Lock l(mu_);
+  for (const auto& it : data_) {
+    const auto& kv = it.second;
+    SizeR pos = kv.key.FindRange(Range<K>(range.begin(), range.end()));
+    bool has_value = !kv.value.empty();
+    size_t batch = std::max<size_t>(
+        1, batch_bytes / (sizeof(K) + (has_value ? k_ * sizeof(V) : 0)));
+    for (size_t i = pos.begin(); i < pos.end(); i += batch) {
+      SizeR seg(i, std::min(i + batch, pos.end()));
+      Message* msg = new Message();
+      msg->task.set_key_channel(it.first);
+      msg->set_key(kv.key.Segment(seg));
+      if (has_value) msg->add_value(kv.value.Segment(seg * k_));
+      msgs->push_back(msg);
+    }
+  }
+}
+
+template <typename K, typename V>
+void KVVector<K,V>::SetMigration(const Message* msg) {
+  KVPairs kv;
+  kv.key = SArray<K>(msg->key);
+  if (msg->value.size()) kv.value = SArray<V>(msg->value[0]);
+  size_t bytes = Merge(msg->task.key_channel(), kv);
+  if (bytes) BackupAdded(bytes);
+}
+
+template <typename K, typename V>
+void KVVector<K,V>::EraseKeys(const Range<Key>& range) {
+  Lock l(mu_);
+  for (auto& it : data_) {
+    auto& kv = it.second;
+    SizeR pos = kv.key.FindRange(Range<K>(range.begin(), range.end()));
+    if (pos.empty()) continue;
+    SArray<K> key = kv.key.Segment(SizeR(0, pos.begin())).SetUnion(
+        kv.key.Segment(SizeR(pos.end(), kv.key.size())));
+    if (!kv.value.empty()) {
+      SArray<V> val(key.size() * k_);
+      ParallelOrderedMatch(kv.key, kv.value, key, &val, k_);
+      kv.value = val;
+    }
+    kv.key = key;
+  }
+}
+
 template <typename K, typename V>
 void KVVector<K,V>::GetValue(Message* msg) {
   // do check
@@ -242,7 +430,7 @@ void KVVector<K,V>::GetValue(Message* msg) {
 }
 
 template <typename K, typename V>
-int KVVector<K,V>::Push(const Task& request, const SArray<K>& keys,
+int64 KVVector<K,V>::Push(const Task& request, const SArray<K>& keys,
                         const std::initializer_list<SArray<V>>& values,
                         const Message::Callback& callback) {
   Message push(request, kServerGroup);
@@ -253,7 +441,7 @@ int KVVector<K,V>::Push(const Task& request, const SArray<K>& keys,
 }
 
 template <typename K, typename V>
-int KVVector<K,V>::Pull(const Task& request, const SArray<K>& keys,
+int64 KVVector<K,V>::Pull(const Task& request, const SArray<K>& keys,
                         const Message::Callback& callback) {
   Message pull(request, kServerGroup);
   pull.set_key(keys);
@@ -2,6 +2,16 @@
 #include "parameter/parameter.h"
 namespace PS {
 
+DECLARE_int32(num_replicas);
+DEFINE_int32(replica_delay, 100,
+  "a server forwards the changes of its data to the replicas every this "
+  "number of milliseconds, see -num_replicas");
+DEFINE_int32(replica_batch, 1<<20,
+  "or forwards them once more than this number of bytes are changed");
+DEFINE_int32(migrate_batch, 1<<22,
+  "the data moved to another server is sent in messages of about this number "
+  "of bytes");
+
 void Parameter::ProcessRequest(Message* request) {
   const auto& call = request->task.param();
   Message* response = nullptr;
@@ -11,25 +21,378 @@ void Parameter::ProcessRequest(Message* request) {
     response = new Message(*request);
   }
 
-  if (call.replica()) {
+  if (call.has_checkpoint()) {
+    CHECK_EQ(request->sender, MyNodeID());
+    RunCheckpoint(call.checkpoint());
+    if (request->callback) request->callback();
+  } else if (call.migrate()) {
+    // moving a key range
+    Range<Key> range(request->task.key_range());
+    if (request->sender != MyNodeID()) {
+      SetMigration(request);
+    } else if (request->task.msg().empty()) {
+      EraseKeys(range);
+      // the incremental checkpoints only have the existing entries
+      if (tracking_changes_) erased_.push_back(range);
+      // all nodes send the requests on range to its new owner now
+      Lock l(moved_mu_);
+      for (auto it = moved_.begin(); it != moved_.end(); ) {
+        it = it->first == range ? moved_.erase(it) : it + 1;
+      }
+    } else {
+      MigrateOut(range, request->task.msg(), request->callback);
+    }
+  } else if (call.replica()) {
     // a replication request
-    if (push) {
+    if (request->sender == MyNodeID()) {
+      // queued by myself to take over a dead server
+      Recover(request);
+    } else if (push) {
       SetReplica(request);
     } else {
       GetReplica(response);
     }
   } else {
     // a normal request
-    if (push) {
-      SetValue(request);
+    std::vector<MovedPart> parts;
+    if (!SliceMoved(*request, &parts)) {
+      if (push) {
+        SetValue(request);
+        if (IsReplicated()) BackupValue(request);
+      } else {
+        GetValue(response);
+      }
+    } else if (push) {
+      // only a part is mine
+      for (auto& p : parts) {
+        if (!p.owner.empty()) {
+          ForwardMoved(&p);
+          continue;
+        }
+        SetValue(p.msg.get());
+        if (IsReplicated()) BackupValue(p.msg.get());
+      }
     } else {
-      GetValue(response);
+      delete response;
+      response = nullptr;
+      PullMoved(request, &parts);
     }
   }
 
   if (response) Reply(request, response);
 }
 
+bool Parameter::IsReplicated() {
+  return FLAGS_num_replicas > 0 && IsServer();
+}
+
+void Parameter::MigrateKeys(const Range<Key>& range, const NodeID& recver,
+                            const std::function<void()>& done) {
+  Message* msg = new Message();
+  msg->task.mutable_param()->set_migrate(true);
+  msg->task.set_msg(recver);
+  range.To(msg->task.mutable_key_range());
+  msg->callback = done;
+  exec_.AcceptLocal(msg);
+}
+
+void Parameter::DropKeys(const Range<Key>& range) {
+  Message* msg = new Message();
+  msg->task.mutable_param()->set_migrate(true);
+  range.To(msg->task.mutable_key_range());
+  exec_.AcceptLocal(msg);
+}
+
+// the header of a checkpoint file
+static const uint32 kCheckpointMagic = 0x4b435350;  // "PSCK"
+static const uint32 kCheckpointVersion = 2;
+
+void Parameter::Checkpoint(const CheckpointCall& call) {
+  std::promise<void> done;
+  Message* msg = new Message();
+  *msg->task.mutable_param()->mutable_checkpoint() = call;
+  msg->callback = [&done]() { done.set_value(); };
+  exec_.AcceptLocal(msg);
+  done.get_future().wait();
+}
+
+std::string Parameter::CheckpointFile(const std::string& prefix) const {
+  return prefix + "-" + std::to_string(id()) + "-" + MyNodeID();
+}
+
+std::vector<std::string> Parameter::CheckpointFiles(const std::string& prefix) {
+  std::vector<std::string> files;
+  std::string dir = getPath(prefix);
+  if (!dirExists(dir)) return files;
+  std::string name = getFilename(prefix) + "-" + std::to_string(id()) + "-";
+  for (const auto& fn : readFilenamesInDirectory(dir)) {
+    if (fn.compare(0, name.size(), name) != 0) continue;
+    if (fn.size() > 4 && fn.substr(fn.size() - 4) == ".tmp") continue;
+    files.push_back(dir + "/" + fn);
+  }
+  return files;
+}
+
+void Parameter::RunCheckpoint(const CheckpointCall& call) {
+  auto tv = tic();
+  if (call.cmd() == CheckpointCall::SAVE) {
+    CHECK_EQ(call.prefix_size(), 1);
+    std::string file = CheckpointFile(call.prefix(0));
+    if (!dirExists(getPath(file))) createDir(getPath(file));
+    // write into a temporary file first, so a partial file is never read
+    std::string tmp = file + ".tmp";
+    std::unique_ptr<File> f(File::openOrDie(tmp, "w"));
+    uint32 header[3] = {kCheckpointMagic, kCheckpointVersion,
+                        (uint32)call.incremental()};
+    f->writeOrDie(header, sizeof(header));
+    // the key ranges erased since the last checkpoint, and then the data
+    if (!call.incremental()) erased_.clear();
+    uint64 num_erased = erased_.size();
+    f->writeOrDie(&num_erased, sizeof(num_erased));
+    for (const auto& r : erased_) {
+      uint64 range[2] = {r.begin(), r.end()};
+      f->writeOrDie(range, sizeof(range));
+    }
+    erased_.clear();
+    WriteCheckpoint(call.incremental(), f.get());
+    CHECK(f->flush() && f->close()) << "failed to write " << tmp;
+    CHECK_EQ(std::rename(tmp.c_str(), file.c_str()), 0)
+        << "failed to rename " << tmp;
+    tracking_changes_ = true;
+    LOG(INFO) << MyNodeID() << ": saved " << (call.incremental() ?
+        "incremental" : "full") << " checkpoint " << file << ", "
+              << File::size(file) << " bytes in " << toc(tv) << " sec";
+  } else if (call.cmd() == CheckpointCall::RESTORE) {
+    for (const auto& prefix : call.prefix()) {
+      // the files of all servers
+      auto files = CheckpointFiles(prefix);
+      // the erasures of all servers go first, a key erased by one server may
+      // be moved to another one at the same time
+      std::vector<std::unique_ptr<File>> fs;
+      for (const auto& fn : files) {
+        fs.push_back(std::unique_ptr<File>(File::openOrDie(fn, "r")));
+        File* f = fs.back().get();
+        uint32 header[3];
+        f->readOrDie(header, sizeof(header));
+        CHECK_EQ(header[0], kCheckpointMagic) << fn << " is not a checkpoint";
+        CHECK_EQ(header[1], kCheckpointVersion) << fn;
+        uint64 num_erased;
+        f->readOrDie(&num_erased, sizeof(num_erased));
+        for (uint64 i = 0; i < num_erased; ++i) {
+          uint64 range[2];
+          f->readOrDie(range, sizeof(range));
+          EraseKeys(Range<Key>(range[0], range[1]));
+        }
+      }
+      for (auto& f : fs) {
+        ReadCheckpoint(f.get());
+        f->close();
+      }
+      LOG(INFO) << MyNodeID() << ": restored from " << files.size()
+                << " files of " << prefix;
+    }
+    // the next incremental checkpoint is based on the restored one
+    tracking_changes_ = true;
+    LOG(INFO) << MyNodeID() << ": restored in " << toc(tv) << " sec";
+  } else if (call.cmd() == CheckpointCall::REMOVE) {
+    // also the ones of the servers no longer running
+    for (const auto& prefix : call.prefix()) {
+      for (const auto& fn : CheckpointFiles(prefix)) File::remove(fn);
+    }
+  }
+}
+
+void Parameter::MigrateOut(const Range<Key>& range, const NodeID& recver,
+                           const Message::Callback& done) {
+  // the pushes on this range received from now on are forwarded to recver
+  {
+    Lock l(moved_mu_);
+    moved_.push_back(std::make_pair(range, recver));
+  }
+  std::vector<Message*> msgs;
+  GetMigration(range, FLAGS_migrate_batch, &msgs);
+  VLOG(1) << MyNodeID() << ": move " << range.ToString() << " to " << recver
+          << " by " << msgs.size() << " messages";
+  if (msgs.empty()) {
+    if (done) done();
+    return;
+  }
+  auto left = std::make_shared<std::atomic<size_t>>(msgs.size());
+  for (auto msg : msgs) {
+    msg->recver = recver;
+    msg->task.mutable_param()->set_migrate(true);
+    msg->task.mutable_param()->set_push(true);
+    range.To(msg->task.mutable_key_range());
+    msg->callback = [left, done]() { if (-- *left == 0 && done) done(); };
+    Submit(msg);
+    delete msg;
+  }
+}
+
+bool Parameter::ProcessWhole(const Message& request) {
+  // a pull may need to wait for the moved parts, which a processing thread
+  // cannot do
+  if (request.task.param().push()) return false;
+  Lock l(moved_mu_);
+  return !moved_.empty();
+}
+
+bool Parameter::SliceMoved(const Message& request,
+                           std::vector<MovedPart>* parts) {
+  std::vector<std::pair<Range<Key>, NodeID>> moved;
+  {
+    Lock l(moved_mu_);
+    if (moved_.empty()) return false;
+    moved = moved_;
+  }
+  bool found = false;
+  parts->clear();
+  parts->push_back(MovedPart());
+  parts->back().msg = std::unique_ptr<Message>(new Message(request));
+  for (const auto& mv : moved) {
+    // divide the parts still mine into the parts before, in, and after the
+    // moved range
+    const auto& r = mv.first;
+    std::vector<Range<Key>> krs = {
+      Range<Key>(0, r.begin()), r, Range<Key>(r.end(), kMaxKey)};
+    std::vector<MovedPart> next;
+    for (auto& part : *parts) {
+      if (!part.owner.empty()) {
+        next.push_back(std::move(part));
+        continue;
+      }
+      const Message& m = *part.msg;
+      std::vector<Message*> sliced(krs.size());
+      for (auto& p : sliced) p = new Message(m.task);
+      Slice(m, krs, &sliced);
+      for (int i = 0; i < 3; ++i) {
+        MovedPart p;
+        p.msg = std::unique_ptr<Message>(sliced[i]);
+        if (!p.msg->valid || !p.msg->has_key()) continue;
+        p.msg->sender = m.sender;
+        if (i == 1) {
+          found = true;
+          p.range = r;
+          p.owner = mv.second;
+        }
+        next.push_back(std::move(p));
+      }
+    }
+    parts->swap(next);
+  }
+  return found;
+}
+
+int64 Parameter::ForwardMoved(MovedPart* part) {
+  Message* msg = part->msg.get();
+  msg->recver = part->owner;
+  msg->task.clear_time();
+  msg->task.clear_wait_time();
+  msg->task.clear_filter();
+  part->range.To(msg->task.mutable_key_range());
+  return Submit(msg);
+}
+
+void Parameter::PullMoved(Message* request, std::vector<MovedPart>* parts) {
+  auto pull = std::make_shared<MovedPull>();
+  pull->request = std::unique_ptr<Message>(new Message(*request));
+  pull->responses.resize(parts->size(), nullptr);
+  for (size_t i = 0; i < parts->size(); ++i) {
+    auto& p = (*parts)[i];
+    if (!p.owner.empty()) {
+      ++ pull->left;
+      continue;
+    }
+    Message* res = new Message(*p.msg);
+    GetValue(res);
+    pull->responses[i] = res;
+  }
+  // replied by PulledMoved. the responses are processed by the executor
+  // thread, which is running this function, so none of them arrives before
+  // it is added to moved_pulls_
+  request->finished = false;
+  for (size_t i = 0; i < parts->size(); ++i) {
+    auto& p = (*parts)[i];
+    if (p.owner.empty()) continue;
+    int64 ts = ForwardMoved(&p);
+    Lock l(moved_mu_);
+    moved_pulls_[ts] = std::make_pair(pull, i);
+  }
+}
+
+bool Parameter::PulledMoved(Message* response) {
+  std::shared_ptr<MovedPull> pull;
+  {
+    Lock l(moved_mu_);
+    auto it = moved_pulls_.find(response->task.time());
+    if (it == moved_pulls_.end()) return false;
+    pull = it->second.first;
+    pull->responses[it->second.second] = new Message(*response);
+    moved_pulls_.erase(it);
+    if (-- pull->left > 0) return true;
+  }
+  Message* request = pull->request.get();
+  Message* res = Executor::MergeResponses(pull->responses);
+  Reply(request, CHECK_NOTNULL(res));
+  FinishReceivedRequest(request->task.time(), request->sender);
+  return true;
+}
+
+void Parameter::BackupAdded(size_t bytes) {
+  bool full;
+  {
+    Lock l(backup_mu_);
+    if (backup_done_) return;
+    if (!backup_thread_) {
+      backup_thread_ = std::unique_ptr<std::thread>(
+          new std::thread(&Parameter::BackupLoop, this));
+    }
+    backup_bytes_ += bytes;
+    full = backup_bytes_ >= (size_t)FLAGS_replica_batch;
+  }
+  if (full) backup_cond_.notify_one();
+}
+
+void Parameter::StopBackup() {
+  {
+    Lock l(backup_mu_);
+    backup_done_ = true;
+  }
+  backup_cond_.notify_one();
+  if (backup_thread_) {
+    backup_thread_->join();
+    backup_thread_.reset();
+  }
+}
+
+void Parameter::BackupLoop() {
+  // the backups are not throttled, they are needed to recover from failures
+  Executor::NoThrottle();
+  auto delay = std::chrono::milliseconds(FLAGS_replica_delay);
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lk(backup_mu_);
+      backup_cond_.wait_for(lk, delay, [this] {
+          return backup_done_ || backup_bytes_ >= (size_t)FLAGS_replica_batch;
+        });
+      if (backup_done_) break;
+      if (backup_bytes_ == 0) continue;
+      backup_bytes_ = 0;
+    }
+    // forward them without waiting for the replies
+    std::vector<Message*> msgs;
+    GetBackup(&msgs);
+    for (auto msg : msgs) {
+      msg->recver = kReplicaGroup;
+      msg->task.mutable_param()->set_replica(true);
+      msg->task.mutable_param()->set_push(true);
+      MyKeyRange().To(msg->task.mutable_key_range());
+      Submit(msg);
+      delete msg;
+    }
+  }
+}
+
 void Parameter::ProcessResponse(Message* response) {
   const auto& call = response->task.param();
   bool push = call.push();
@@ -44,7 +407,7 @@ void Parameter::ProcessResponse(Message* response) {
     }
   } else {
     // a normal response
-    if (!push) SetValue(response);
+    if (!push && !PulledMoved(response)) SetValue(response);
   }
 }
 
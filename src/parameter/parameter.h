@@ -1,15 +1,16 @@
 #pragma once
 #include "system/customer.h"
 #include "parameter/proto/param.pb.h"
+#include "util/file.h"
 namespace PS {
 
 /// The base class of shared parameters
 class Parameter : public Customer {
  public:
   Parameter(int id) : Customer(id)  { }
-  virtual ~Parameter() { }
+  virtual ~Parameter() { StopBackup(); }
 
-  typedef std::initializer_list<int> Timestamps;
+  typedef std::initializer_list<int64> Timestamps;
   typedef ::google::protobuf::RepeatedPtrField<FilterConfig> Filters;
   /**
    * @brief Creats a request task
@@ -23,35 +24,70 @@ class Parameter : public Customer {
    * @return A Task
    */
   static Task Request(int channel,
-                      int ts = Message::kInvalidTime,
+                      int64 ts = Message::kInvalidTime,
                       const Timestamps& wait = {},
                       const Filters& filters = Filters(),
                       const Range<Key>& key_range = Range<Key>::All()) {
     Task req; req.set_request(true);
     req.set_key_channel(channel);
     if (ts > Message::kInvalidTime) req.set_time(ts);
-    for (int t : wait) req.add_wait_time(t);
+    for (int64 t : wait) req.add_wait_time(t);
     for (const auto& f : filters) req.add_filter()->CopyFrom(f);
     key_range.To(req.mutable_key_range());
     return req;
   }
 
   /// @brief Submit a push message to msg->recver
-  inline int Push(Message* msg) {
+  inline int64 Push(Message* msg) {
     msg->task.mutable_param()->set_push(true);
     return Submit(msg);
   }
 
   /// @brief Submit a pull message to msg->recver
-  inline int Pull(Message* msg) {
+  inline int64 Pull(Message* msg) {
     msg->task.mutable_param()->set_push(false);
     return Submit(msg);
   }
 
   virtual void WriteToFile(std::string file) { }
 
+  /// @brief Writes the nonzero entries sorted by keys into a binary model
+  /// file, see ModelFile. Values are stored as float
+  virtual void WriteToBinaryFile(const std::string& file, bool compress) { }
+
+  /// @brief Copies a replication request into every part, because all the
+  /// receivers keep the replica of the same key range. Returns false if
+  /// "request" is not a replication request
+  static bool SliceReplica(const Message& request,
+                           const std::vector<Range<Key>>& krs,
+                           std::vector<Message*>* msgs) {
+    if (!request.task.param().replica()) return false;
+    for (auto m : *msgs) *m = request;
+    return true;
+  }
+
   virtual void ProcessRequest(Message* request);
   virtual void ProcessResponse(Message* response);
+  virtual bool ProcessWhole(const Message& request);
+
+  virtual void MigrateKeys(const Range<Key>& range, const NodeID& recver,
+                           const std::function<void()>& done);
+  virtual void DropKeys(const Range<Key>& range);
+
+  /**
+   * @brief Runs a checkpoint command on a server, and blocks until it is done.
+   *
+   * The data are saved into "<prefix>-<customer id>-<node id>" in binary,
+   * including the full state of each entry. The command is queued after the
+   * requests received so far, so a save sees all of them and none of the later
+   * ones. RESTORE reads the files of all servers with the given prefixes, in
+   * order, namely a full checkpoint and then the incremental ones after it, and
+   * keeps the keys in my key range. The key ranges dropped after moving them
+   * to another server are recorded, so they are erased from the restored data
+   * by the incremental checkpoints. It should be called from a thread other
+   * than the executor thread of this object, e.g. in the app.
+   */
+  void Checkpoint(const CheckpointCall& call);
  protected:
 
   /// @brief Fill "msg" with the values it requests, e.g.,
@@ -71,9 +107,107 @@ class Parameter : public Customer {
   /// ask for the dead's replica node for the data
   virtual void GetReplica(Message* msg) { }
 
-  /// @brief a new server node fill its own datastructure via the the replica data from
-  /// the dead's replica node
+  /// @brief take over the key range of the dead server msg->task.msg() by
+  /// merging its replica into my data, see Executor::ReplaceNode
   virtual void Recover(Message* msg) { }
+
+  /// @brief the push request "msg" from a worker has been applied by SetValue,
+  /// record the changes for my replicas and then call BackupAdded
+  virtual void BackupValue(const Message* msg) { }
+
+  /// @brief move the changes recorded by BackupValue into "msgs", which are
+  /// forwarded to my replicas and then merged by SetReplica
+  virtual void GetBackup(std::vector<Message*>* msgs) { }
+
+  /// @brief move the data in "range" into "msgs", each one has about
+  /// "batch_bytes" bytes and sorted keys. they are sent to the new owner of
+  /// the range and then merged by SetMigration
+  virtual void GetMigration(const Range<Key>& range, size_t batch_bytes,
+                            std::vector<Message*>* msgs) { }
+
+  /// @brief merge the data moved from another server into my data
+  virtual void SetMigration(const Message* msg) { }
+
+  /// @brief remove the data in "range", which are moved to another server,
+  /// or erased by a restored checkpoint
+  virtual void EraseKeys(const Range<Key>& range) { }
+
+  /// @brief write my data into "file", or only the entries changed since the
+  /// last WriteCheckpoint if "incremental". the changes should be recorded
+  /// once tracking_changes() is true. only KVMap, namely the async SGD server,
+  /// implements it now
+  virtual void WriteCheckpoint(bool incremental, File* file) { }
+
+  /// @brief merge the data in "file" written by WriteCheckpoint into my data.
+  /// the entries out of my key range are ignored
+  virtual void ReadCheckpoint(File* file) { }
+
+  /// @brief returns true if the changes are recorded for the incremental
+  /// checkpoints, namely there is a full checkpoint
+  bool tracking_changes() const { return tracking_changes_; }
+
+  /// @brief returns true if the data of this node are replicated
+  bool IsReplicated();
+
+  /// @brief "bytes" of changes are recorded by BackupValue. they are forwarded
+  /// every -replica_delay ms, or once more than -replica_batch bytes are
+  /// recorded
+  void BackupAdded(size_t bytes);
+
+  /// @brief stop forwarding the backups. it should be called in the destructor
+  /// of a derived class which implements GetBackup
+  void StopBackup();
+
+ private:
+  // runs "call" in the executor thread
+  void RunCheckpoint(const CheckpointCall& call);
+  // my file and the files of all servers with "prefix"
+  std::string CheckpointFile(const std::string& prefix) const;
+  std::vector<std::string> CheckpointFiles(const std::string& prefix);
+  std::atomic<bool> tracking_changes_{false};
+  // the key ranges erased since the last checkpoint, see DropKeys
+  std::vector<Range<Key>> erased_;
+
+  // sends the data in "range" to "recver", runs "done" once it has them
+  void MigrateOut(const Range<Key>& range, const NodeID& recver,
+                  const Message::Callback& done);
+  // a part of a request. if its keys are moved, the moved range and the
+  // server it is moved to, otherwise owner is empty
+  struct MovedPart {
+    std::unique_ptr<Message> msg;
+    Range<Key> range;
+    NodeID owner;
+  };
+  // slices "request" by the moved key ranges into parts ordered by key.
+  // returns false if no key is moved
+  bool SliceMoved(const Message& request, std::vector<MovedPart>* parts);
+  // sends a moved part to its new owner, returns the timestamp
+  int64 ForwardMoved(MovedPart* part);
+  // replies a pull "request" once the moved parts are pulled from their new
+  // owners, so a worker still sending to me by the old key ranges gets the
+  // current values rather than the defaults of the dropped keys
+  void PullMoved(Message* request, std::vector<MovedPart>* parts);
+  // returns true if "response" is of a pull sent by PullMoved
+  bool PulledMoved(Message* response);
+  // <key range, the server it is moved to>, until the data are dropped
+  std::vector<std::pair<Range<Key>, NodeID>> moved_;
+  // the pulls waiting for moved parts
+  struct MovedPull {
+    std::unique_ptr<Message> request;
+    std::vector<Message*> responses;
+    int left = 0;
+  };
+  // <the timestamp of a forwarded pull, (the pull, the index of the part)>
+  std::unordered_map<int64, std::pair<std::shared_ptr<MovedPull>, size_t>>
+  moved_pulls_;
+  std::mutex moved_mu_;
+
+  void BackupLoop();
+  std::unique_ptr<std::thread> backup_thread_;
+  std::mutex backup_mu_;
+  std::condition_variable backup_cond_;
+  size_t backup_bytes_ = 0;
+  bool backup_done_ = false;
 };
 
 }  // namespace PS
@@ -14,11 +14,15 @@ class NodeAssigner {
   }
   ~NodeAssigner() { }
 
+  // a server beyond the first num_servers gets an empty key range, it then
+  // splits the key range of another server, see Split
   void assign(Node* node) {
     Range<Key> kr = key_range_;
     int rank = 0;
     if (node->role() == Node::SERVER) {
-      kr = key_range_.EvenDivide(num_servers_, server_rank_);
+      kr = server_rank_ < num_servers_ ?
+           key_range_.EvenDivide(num_servers_, server_rank_) :
+           Range<Key>(key_range_.end(), key_range_.end());
       rank = server_rank_ ++;
     } else if (node->role() == Node::WORKER) {
       rank = worker_rank_ ++;
@@ -27,8 +31,121 @@ class NodeAssigner {
     kr.To(node->mutable_key());
   }
 
-  void remove(const Node& node) {
-    // TODO
+  // the new server "node" takes the upper half of the largest key range in
+  // "servers", whose owner is returned in "target" with the lower half
+  static void Split(const std::vector<Node>& servers, Node* node, Node* target) {
+    CHECK(!servers.empty());
+    auto size = [](const Node& n) {
+      Range<Key> r(n.key()); return r.empty() ? 0 : r.end() - r.begin(); };
+    *target = servers[0];
+    for (const auto& s : servers) if (size(s) > size(*target)) *target = s;
+    Range<Key> r(target->key());
+    Key mid = r.begin() + (r.end() - r.begin()) / 2;
+    Range<Key>(r.begin(), mid).To(target->mutable_key());
+    Range<Key>(mid, r.end()).To(node->mutable_key());
+  }
+
+  // the key range of server "node" is merged into its neighbor in "servers",
+  // which is returned in "target". the key range of "node" becomes empty
+  static void Merge(const std::vector<Node>& servers, Node* node, Node* target) {
+    Range<Key> r(node->key());
+    bool found = false;
+    for (const auto& s : servers) {
+      Range<Key> t(s.key());
+      if (s.id() == node->id() || t.empty()) continue;
+      if (t.end() == r.begin() || t.begin() == r.end()) {
+        *target = s; found = true;
+        if (t.begin() == r.end()) break;  // prefer the next one
+      }
+    }
+    CHECK(found) << "no neighbor of " << node->ShortDebugString();
+    r.SetUnion(Range<Key>(target->key())).To(target->mutable_key());
+    Range<Key>(r.begin(), r.begin()).To(node->mutable_key());
+  }
+
+  // -- load-aware partition --
+  // the keys are not uniform over the key range, e.g. hashed feature ids of a
+  // few feature groups, so the even partition may give a server several times
+  // the keys of the others
+
+  // samples "keys" with rate 1/"rate". a key is kept if its hash is small, so a
+  // key is sampled either on all workers or on none of them. the sampled
+  // unique keys are returned with their number of occurrences
+  typedef std::vector<std::pair<Key, uint32>> KeySample;
+  static void SampleKeys(const Key* keys, size_t n, int rate, KeySample* sample) {
+    CHECK_GT(rate, 0);
+    uint64 thr = kuint64max / rate;
+    for (size_t i = 0; i < n; ++i) {
+      // the multiplicative hash, 2^64 / golden ratio
+      if (keys[i] * 0x9E3779B97F4A7C15ULL <= thr) {
+        sample->push_back(std::make_pair(keys[i], 1));
+      }
+    }
+    MergeSample(sample);
+  }
+
+  // sorts "sample" and merges the same keys. the weight of a key is its number
+  // of occurrences if "by_count" is false, otherwise 1
+  static void MergeSample(KeySample* sample, bool by_count = false) {
+    auto& s = *sample;
+    std::sort(s.begin(), s.end(), [](const std::pair<Key, uint32>& a,
+                                     const std::pair<Key, uint32>& b) {
+                return a.first < b.first; });
+    size_t j = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+      if (j > 0 && s[j-1].first == s[i].first) {
+        s[j-1].second += s[i].second;
+      } else {
+        s[j++] = s[i];
+      }
+    }
+    s.resize(j);
+    if (by_count) for (auto& it : s) it.second = 1;
+  }
+
+  // divides "range" into "n" parts with about the same weight of "sample",
+  // which is sorted. returns the n+1 boundaries
+  static std::vector<Key> Partition(
+      const KeySample& sample, const Range<Key>& range, int n) {
+    std::vector<Key> bound(n+1);
+    bound[0] = range.begin(); bound[n] = range.end();
+    double total = 0;
+    for (const auto& it : sample) total += it.second;
+    double sum = 0;
+    size_t j = 0;
+    for (int i = 1; i < n; ++i) {
+      // part i-1 ends before the first key whose preceding weight reaches its
+      // share
+      while (j < sample.size() && sum + sample[j].second <= total * i / n) {
+        sum += sample[j++].second;
+      }
+      Key b = j < sample.size() ? sample[j].first : range.end();
+      bound[i] = std::min(std::max(b, bound[i-1]), range.end());
+    }
+    // fall back to the even partition if a part is empty, e.g. few samples
+    for (int i = 0; i < n; ++i) {
+      if (bound[i] >= bound[i+1]) {
+        for (int k = 0; k < n; ++k) bound[k] = range.EvenDivide(n, k).begin();
+        break;
+      }
+    }
+    return bound;
+  }
+
+  // the max weight of a part over the mean, where the parts are defined by the
+  // n+1 boundaries "bound"
+  static double Imbalance(const KeySample& sample, const std::vector<Key>& bound) {
+    int n = (int)bound.size() - 1;
+    CHECK_GT(n, 0);
+    std::vector<double> w(n);
+    double total = 0;
+    for (const auto& it : sample) {
+      int i = std::upper_bound(bound.begin(), bound.end(), it.first)
+              - bound.begin() - 1;
+      w[std::min(std::max(i, 0), n-1)] += it.second;
+      total += it.second;
+    }
+    return total == 0 ? 1 : *std::max_element(w.begin(), w.end()) / (total / n);
   }
  protected:
   int num_servers_ = 0;
@@ -3,6 +3,7 @@
 #include "system/message.h"
 #include "system/postoffice.h"
 #include "system/executor.h"
+#include "util/future.h"
 
 namespace PS {
 /**
@@ -61,7 +62,7 @@ class Customer {
    *
    * Sample usage: send a request to all worker nodes and wait until finished:
    *   Task task; task.mutable_sgd()->set_cmd(SGDCall::UPDATE_MODEL);
-   *   int ts = Submit(task, kWorkerGroup);
+   *   int64 ts = Submit(task, kWorkerGroup);
    *   Wait(ts);
    *   Foo();
    *
@@ -71,7 +72,7 @@ class Customer {
    *
    * @return the timestamp of this request.
    */
-  inline int Submit(const Task& request, const NodeID& recver) {
+  inline int64 Submit(const Task& request, const NodeID& recver) {
     Message msg(request, recver);
     return Submit(&msg);
   }
@@ -89,10 +90,24 @@ class Customer {
    *
    * @return the timestamp of this request.
    */
-  inline int Submit(Message* request) {
+  inline int64 Submit(Message* request) {
     return exec_.Submit(request);
   }
 
+  /**
+   * @brief The non-blocking version of Submit.
+   *
+   * Submit blocks if there are too much data waiting to be sent to a
+   * receiver, see -max_pending_bytes. This one does not send the request but
+   * returns Message::kInvalidTime in that case.
+   *
+   * @return the timestamp of this request, or Message::kInvalidTime if it
+   * would block
+   */
+  inline int64 TrySubmit(Message* request) {
+    return exec_.Submit(request, false);
+  }
+
   /**
    * @brief Waits until a submitted request is finished
    *
@@ -103,10 +118,47 @@ class Customer {
    *
    * @param timestamp the timestamp of this request
    */
-  inline void Wait(int timestamp) {
+  inline void Wait(int64 timestamp) {
     exec_.WaitSentReq(timestamp);
   }
 
+  /**
+   * @brief Returns true if Wait(timestamp) would not block
+   */
+  inline bool IsFinished(int64 timestamp) {
+    return exec_.IsSentReqFinished(timestamp);
+  }
+
+  /**
+   * @brief Returns a future which is fulfilled once Wait(timestamp) would
+   * return, namely the request is finished and its callback has run.
+   *
+   * The continuations of the future, see Future::Then, run in the thread
+   * running the callbacks, or immediately if it is already finished.
+   */
+  Future WhenFinished(int64 timestamp) {
+    Future f;
+    exec_.Then(timestamp, [f]() { f.Set(); });
+    return f;
+  }
+
+  /**
+   * @brief Returns a future which is fulfilled once all requests in
+   * "timestamps" are finished
+   */
+  Future WhenAll(const std::vector<int64>& timestamps) {
+    std::vector<Future> fs;
+    for (int64 t : timestamps) fs.push_back(WhenFinished(t));
+    return Future::WhenAll(fs);
+  }
+
+  /**
+   * @brief Submits a request, and returns the future of its completion
+   */
+  Future SubmitAsync(Message* request) {
+    return WhenFinished(Submit(request));
+  }
+
   /**
    * @brief Slices a message into multiple parts.
    *
@@ -163,7 +215,7 @@ class Customer {
    * @param timestamp
    * @param sender
    */
-  inline void WaitReceivedRequest(int timestamp, const NodeID& sender) {
+  inline void WaitReceivedRequest(int64 timestamp, const NodeID& sender) {
     exec_.WaitRecvReq(timestamp, sender);
   }
 
@@ -194,7 +246,7 @@ class Customer {
    * @param timestamp
    * @param sender
    */
-  inline void FinishReceivedRequest(int timestamp, const NodeID& sender) {
+  inline void FinishReceivedRequest(int64 timestamp, const NodeID& sender) {
     exec_.FinishRecvReq(timestamp, sender);
   }
 
@@ -206,7 +258,7 @@ class Customer {
    *
    * @return
    */
-  inline int NumDoneReceivedRequest(int timestamp, const NodeID& sender) {
+  inline int NumDoneReceivedRequest(int64 timestamp, const NodeID& sender) {
     return exec_.QueryRecvReq(timestamp, sender);
   }
 
@@ -233,6 +285,85 @@ class Customer {
     exec_.Reply(request, response);
   }
 
+  /**
+   * @brief Processes the received requests by "num_threads" threads rather than
+   * the single thread of the executor. It should be called before any request
+   * is received.
+   *
+   * The key range of this node is evenly divided into num_threads parts. A
+   * request is sliced into parts by Slice, and the i-th part is processed by
+   * ProcessRequest in the i-th thread, see ProcessThreadID. So the requests
+   * touching the same key are still processed in order, while ProcessRequest
+   * must be thread safe for disjoint key ranges. The replies of the parts,
+   * which must be sent within ProcessRequest, are concatenated by key into a
+   * single response. A request without key is processed after all previous
+   * requests are done.
+   */
+  virtual void ProcessInParallel(int num_threads) {
+    exec_.ProcessInParallel(num_threads);
+  }
+
+  /**
+   * @brief Returns true if "request" is not sliced by ProcessInParallel. It is
+   * processed by ProcessRequest in the executor thread after all previous
+   * requests are done, like a request without key, so it may touch the keys
+   * of all threads and reply later by marking itself as not finished.
+   */
+  virtual bool ProcessWhole(const Message& request) { return false; }
+
+  /**
+   * @brief Returns the key range processed by each processing thread, see
+   * ProcessInParallel. They are fixed on the first call, which is at the
+   * latest when the first request with keys arrives, from the key range of
+   * this node then. So they may differ from an even division of the current
+   * key range, e.g. after a server takes over the range of a dead one.
+   */
+  const std::vector<Range<Key>>& ProcessRanges() {
+    return exec_.ProcessRanges();
+  }
+
+  /**
+   * @brief Moves the data of this server in "range" to server "recver", and
+   * calls "done" once recver has them. The requests on "range" received later
+   * should be forwarded to recver. It is called by the system when the key
+   * ranges of servers change, see Manager::MigrateKeys. The default keeps no
+   * data by key.
+   */
+  virtual void MigrateKeys(const Range<Key>& range, const NodeID& recver,
+                           const std::function<void()>& done) { done(); }
+
+  /**
+   * @brief Drops the data in "range", which has been moved to another server
+   * by MigrateKeys and all nodes know it.
+   */
+  virtual void DropKeys(const Range<Key>& range) { }
+
+  /**
+   * @brief Runs the callbacks of the submitted requests by a pool of
+   * "num_threads" threads, so a heavy callback does not block the processing
+   * of other responses. The callbacks may then run concurrently. 0 means
+   * running them one by one in the thread processing the responses. The
+   * default is -num_callback_threads.
+   *
+   * Wait(ts) returns after the callback of request ts is finished.
+   */
+  void SetCallbackThreads(int num_threads) {
+    exec_.SetCallbackThreads(num_threads);
+  }
+
+  /**
+   * @brief Returns the index of the processing thread calling it, in [0,
+   * num_threads), or -1 if called by any other thread
+   */
+  static int ProcessThreadID() { return Executor::process_thread_id(); }
+
+  /**
+   * @brief Returns the latency statistics in microseconds of the requests this
+   * customer sent and received. They are also printed at exit with
+   * -print_latency.
+   */
+  string LatencyReport() { return exec_.LatencyReport(); }
+
   /**
    * @brief  Returns the unique ID of this customer
    */
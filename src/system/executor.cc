@@ -3,8 +3,19 @@
 #include <thread>
 namespace PS {
 
+DECLARE_bool(print_latency);
+DECLARE_int32(num_replicas);
+DEFINE_int32(num_callback_threads, 0,
+             "the number of threads a customer uses to run the callbacks of "
+             "its requests. 0 means running them in the thread processing the "
+             "responses");
+
+thread_local int Executor::process_thread_id_ = -1;
+thread_local bool Executor::no_throttle_ = false;
+
 Executor::Executor(Customer& obj) : obj_(obj), sys_(Postoffice::instance()) {
   my_node_ = Postoffice::instance().manager().van().my_node();
+  num_replicas_ = FLAGS_num_replicas;
   // insert virtual group nodes
   for (auto id : GroupIDs()) {
     Node node;
@@ -12,12 +23,17 @@ Executor::Executor(Customer& obj) : obj_(obj), sys_(Postoffice::instance()) {
     node.set_id(id);
     AddNode(node);
   }
+  SetCallbackThreads(FLAGS_num_callback_threads);
 
   thread_ = new std::thread(&Executor::Run, this);
 }
 
 Executor::~Executor() {
   if (done_) return;
+  if (FLAGS_print_latency) {
+    LOG(INFO) << my_node_.id() << " customer " << obj_.id() << " latency (us)\n"
+              << LatencyReport();
+  }
   done_ = true;
 
   // wake thread_
@@ -26,9 +42,24 @@ Executor::~Executor() {
 
   CHECK_NOTNULL(thread_)->join();
   delete thread_;
+
+  { Lock l(proc_mu_); }
+  proc_cond_.notify_all();
+  for (auto t : proc_threads_) { t->join(); delete t; }
+
+  // runs the queued callbacks
+  callback_pool_.reset();
 }
 
-bool Executor::CheckFinished(RemoteNode* rnode, int timestamp, bool sent) {
+void Executor::SetCallbackThreads(int num_threads) {
+  // the callbacks already queued are finished first
+  callback_pool_.reset();
+  if (num_threads <= 0) return;
+  callback_pool_.reset(new ThreadPool(num_threads));
+  callback_pool_->startWorkers();
+}
+
+bool Executor::CheckFinished(RemoteNode* rnode, int64 timestamp, bool sent) {
   CHECK(rnode);
   if (timestamp < 0) return true;
   auto& tracker = sent ? rnode->sent_req_tracker : rnode->recv_req_tracker;
@@ -38,13 +69,51 @@ bool Executor::CheckFinished(RemoteNode* rnode, int timestamp, bool sent) {
       auto& r_tracker = sent ? r->sent_req_tracker : r->recv_req_tracker;
       if (r->alive && !r_tracker.IsFinished(timestamp)) return false;
       // well, set this group node as been finished
-      r_tracker.Finish(timestamp);
+      FinishTimestamp(r, timestamp, sent);
     }
     return true;
   }
   return false;
 }
-int Executor::NumFinished(RemoteNode* rnode, int timestamp, bool sent) {
+bool Executor::FinishTimestamp(RemoteNode* rnode, int64 timestamp, bool sent) {
+  auto& tracker = sent ? rnode->sent_req_tracker : rnode->recv_req_tracker;
+  int64 low = timestamp - tracker.max_window() + 1;
+  if (low > tracker.watermark()) {
+    // the unfinished timestamps below "low" will be dropped
+    if (sent) {
+      for (const auto& it : sent_reqs_) {
+        if (it.first >= low || it.second.done) continue;
+        const auto& group = GetRNode(it.second.recver)->group;
+        if (std::find(group.begin(), group.end(), rnode) == group.end() ||
+            tracker.IsFinished(it.first)) {
+          continue;
+        }
+        LOG(FATAL) << obj_.id() << ": request " << it.first << " sent to "
+                   << rnode->node.id() << " is not answered while "
+                   << tracker.max_window() << " newer ones are";
+      }
+    } else {
+      for (int64 t : rnode->unfinished_reqs) {
+        CHECK_GE(t, low) << obj_.id() << ": request " << t << " from "
+                         << rnode->node.id() << " is not finished while "
+                         << tracker.max_window() << " newer ones are";
+      }
+    }
+  }
+  int64 old_low = tracker.watermark();
+  if (!tracker.Finish(timestamp)) return false;
+  VLOG(1) << obj_.id() << ": timestamps below " << tracker.watermark()
+          << " of " << rnode->node.id() << " are skipped";
+  auto waiters = sent ? &sent_waiters_ : &recv_waiters_;
+  for (auto& it : *waiters) {
+    if (it.first >= old_low && it.first < tracker.watermark()) {
+      it.second->cond.notify_all();
+    }
+  }
+  return true;
+}
+
+int Executor::NumFinished(RemoteNode* rnode, int64 timestamp, bool sent) {
   CHECK(rnode);
   if (timestamp < 0 || !rnode->alive) return 0;
   auto& tracker = sent ? rnode->sent_req_tracker : rnode->recv_req_tracker;
@@ -60,57 +129,144 @@ int Executor::NumFinished(RemoteNode* rnode, int timestamp, bool sent) {
   }
 }
 
-void Executor::WaitSentReq(int timestamp) {
+void Executor::WaitSentReq(int64 timestamp) {
   std::unique_lock<std::mutex> lk(node_mu_);
   VLOG(1) << obj_.id() << ": wait sent request " << timestamp;
-  const NodeID& recver = sent_reqs_[timestamp].recver;
-  CHECK(recver.size());
-  auto rnode = GetRNode(recver);
-  sent_req_cond_.wait(lk, [this, rnode, timestamp] {
-      return CheckFinished(rnode, timestamp, true);
+  WaitFor(lk, &sent_waiters_, timestamp, [this, timestamp] {
+      auto it = sent_reqs_.find(timestamp);
+      if (it == sent_reqs_.end()) return true;
+      return CheckFinished(GetRNode(it->second.recver), timestamp, true) &&
+          !it->second.callback_pending;
     });
 }
 
-void Executor::WaitRecvReq(int timestamp, const NodeID& sender) {
+void Executor::WaitRecvReq(int64 timestamp, const NodeID& sender) {
   std::unique_lock<std::mutex> lk(node_mu_);
   VLOG(1) << obj_.id() << ": wait request "
           << timestamp << " from " << sender;
   auto rnode = GetRNode(sender);
-  recv_req_cond_.wait(lk, [this, rnode, timestamp] {
+  WaitFor(lk, &recv_waiters_, timestamp, [this, rnode, timestamp] {
       return CheckFinished(rnode, timestamp, false);
     });
 }
 
-int Executor::QueryRecvReq(int timestamp, const NodeID& sender) {
+void Executor::WaitFor(std::unique_lock<std::mutex>& lk, Waiters* waiters,
+                       int64 timestamp, const std::function<bool()>& finished) {
+  if (finished()) return;
+  auto& w = (*waiters)[timestamp];
+  if (!w) w = std::make_shared<Waiter>();
+  auto waiter = w;
+  ++ waiter->num;
+  while (!finished()) {
+    waiter->cond.wait(lk);
+    ++ num_wakeups_;
+  }
+  if (-- waiter->num == 0) waiters->erase(timestamp);
+}
+
+void Executor::Notify(Waiters* waiters, int64 timestamp) {
+  if (timestamp == Message::kInvalidTime) {
+    for (auto& it : *waiters) it.second->cond.notify_all();
+    return;
+  }
+  ++ num_notifies_;
+  auto it = waiters->find(timestamp);
+  if (it != waiters->end()) it->second->cond.notify_all();
+}
+
+int Executor::QueryRecvReq(int64 timestamp, const NodeID& sender) {
   Lock l(node_mu_);
   return NumFinished(GetRNode(sender), timestamp, false);
 }
 
-void Executor::FinishRecvReq(int timestamp, const NodeID& sender) {
+void Executor::FinishRecvReq(int64 timestamp, const NodeID& sender) {
   std::unique_lock<std::mutex> lk(node_mu_);
   VLOG(1) << obj_.id() << ": finish request "
           << timestamp << " from " << sender;
   auto rnode = GetRNode(sender);
-  rnode->recv_req_tracker.Finish(timestamp);
+  rnode->unfinished_reqs.erase(timestamp);
+  bool dropped = FinishTimestamp(rnode, timestamp, false);
   if (rnode->node.role() == Node::GROUP) {
     for (auto r : rnode->group) {
-      r->recv_req_tracker.Finish(timestamp);
+      r->unfinished_reqs.erase(timestamp);
+      dropped |= FinishTimestamp(r, timestamp, false);
     }
   }
+  Notify(&recv_waiters_, timestamp);
   lk.unlock();
-  recv_req_cond_.notify_all();
 
-  { Lock lk(msg_mu_); }
-  dag_cond_.notify_all();
+  // wake the messages depending on this request, or on the dropped ones
+  bool woken = false;
+  {
+    Lock l(msg_mu_);
+    Lock l2(node_mu_);
+    for (auto r : rnode->group) {
+      woken |= Wake(timestamp, r);
+      if (!dropped) continue;
+      auto it = waiting_msgs_.find(r->node.id());
+      if (it == waiting_msgs_.end()) continue;
+      std::vector<int64> ts;
+      for (const auto& w : it->second) {
+        if (r->recv_req_tracker.IsFinished(w.first)) ts.push_back(w.first);
+      }
+      for (int64 t : ts) woken |= Wake(t, r);
+    }
+  }
+  if (woken) dag_cond_.notify_one();
 }
 
+void Executor::Schedule(Message* msg, RemoteNode* rnode) {
+  // only requests have dependencies. the messages from a dead node are dropped
+  // by PickActiveMsg
+  if (msg->task.request() && rnode->alive) {
+    for (int i = 0; i < msg->task.wait_time_size(); ++i) {
+      int64 wait_time = msg->task.wait_time(i);
+      if (wait_time <= Message::kInvalidTime) continue;
+      if (!rnode->recv_req_tracker.IsFinished(wait_time)) {
+        waiting_msgs_[msg->sender][wait_time].push_back(msg);
+        ++ num_waiting_msgs_;
+        return;
+      }
+    }
+  }
+  ready_msgs_.push_back(msg);
+}
+
+bool Executor::Wake(int64 timestamp, RemoteNode* rnode) {
+  auto it = waiting_msgs_.find(rnode->node.id());
+  if (it == waiting_msgs_.end()) return false;
+  auto jt = it->second.find(timestamp);
+  if (jt == it->second.end()) return false;
+  std::vector<Message*> msgs;
+  msgs.swap(jt->second);
+  it->second.erase(jt);
+  num_waiting_msgs_ -= msgs.size();
+  // they may wait for other requests
+  for (auto msg : msgs) Schedule(msg, rnode);
+  return true;
+}
 
-int Executor::Submit(Message* msg) {
+int64 Executor::Submit(Message* msg, bool block) {
   CHECK(msg); CHECK(msg->recver.size());
-  Lock l(node_mu_);
+
+  // wait if the sending queues of the receivers are full. do it before locking
+  // node_mu_, otherwise the responses cannot be processed. control requests
+  // and the threads processing messages are never throttled
+  if (!msg->task.control() && !no_throttle_) {
+    std::vector<NodeID> recvers;
+    {
+      Lock l(node_mu_);
+      for (auto r : GetRNode(msg->recver)->group) {
+        if (r->alive) recvers.push_back(r->node.id());
+      }
+    }
+    if (!sys_.WaitSendQueue(recvers, block)) return Message::kInvalidTime;
+  }
+
+  std::unique_lock<std::mutex> lk(node_mu_);
 
   // timestamp and other flags
-  int ts = msg->task.has_time() ? msg->task.time() : time_ + 1;
+  int64 ts = msg->task.has_time() ? msg->task.time() : time_ + 1;
   // CHECK_LT(time_, ts) << my_node_.id() << " has a newer timestamp";
   msg->task.set_time(ts);
   msg->task.set_request(true);
@@ -120,6 +276,7 @@ int Executor::Submit(Message* msg) {
   time_ = ts;
   auto& req_info = sent_reqs_[ts];
   req_info.recver = msg->recver;
+  req_info.submit_time = Histogram::Now();
   if (msg->callback) {
     req_info.callback = msg->callback;
   }
@@ -132,17 +289,35 @@ int Executor::Submit(Message* msg) {
   CHECK_EQ(msgs.size(), rnode->group.size());
 
   // send them one by one
+  bool queued = false;
   for (int i = 0; i < msgs.size(); ++i) {
     RemoteNode* r = CHECK_NOTNULL(rnode->group[i]);
     Message* m = CHECK_NOTNULL(msgs[i]);
     if (!m->valid) {
       // do not sent, just mark it as done
-      r->sent_req_tracker.Finish(ts);
+      FinishTimestamp(r, ts, true);
+      delete m;
       continue;
     }
     r->EncodeMessage(m);
     m->recver = r->node.id();
+    m->submit_time = req_info.submit_time;
     sys_.Queue(m);
+    queued = true;
+  }
+  if (queued) return ts;
+
+  // no response will come, so the request is finished right now
+  if (rnode->node.role() == Node::GROUP) FinishTimestamp(rnode, ts, true);
+  auto info = &req_info;
+  info->done = true;
+  info->callback_pending = true;
+  bool async = callback_pool_ && (info->callback || !info->thens.empty());
+  lk.unlock();
+  if (async) {
+    callback_pool_->add([this, info, ts]() { RunCallbacks(info, ts); });
+  } else {
+    RunCallbacks(info, ts);
   }
   return ts;
 }
@@ -151,12 +326,30 @@ void Executor::Reply(Message* request, Message* response) {
   const auto& req = CHECK_NOTNULL(request)->task;
   if (!req.request()) return;
 
+  if (!proc_threads_.empty()) {
+    // the reply of a part, which will be merged by FinishPart
+    Lock l(proc_mu_);
+    auto it = proc_parts_.find(request);
+    if (it != proc_parts_.end()) {
+      auto& res = it->second.first->responses[it->second.second];
+      CHECK(res == nullptr) << "a part is replied twice";
+      res = CHECK_NOTNULL(response);
+      request->replied = true;
+      return;
+    }
+  }
+
   auto& res = CHECK_NOTNULL(response)->task;
   res.set_request(false);
   if (req.has_control()) res.set_control(req.control());
   if (req.has_customer_id()) res.set_customer_id(req.customer_id());
   res.set_time(req.time());
 
+  uint64 now = Histogram::Now();
+  response->submit_time = now;
+  if (request->recv_time) res.set_process_time(now - request->recv_time);
+  if (request->pick_time) process_.Add(now - request->pick_time);
+
   response->recver = request->sender;
   node_mu_.lock();
   GetRNode(response->recver)->EncodeMessage(response);
@@ -169,10 +362,9 @@ void Executor::Reply(Message* request, Message* response) {
 bool Executor::PickActiveMsg() {
   std::unique_lock<std::mutex> lk(msg_mu_);
   // VLOG(1) << obj_.id() << ": try to pick a message";
-  auto it = recv_msgs_.begin();
-  while (it != recv_msgs_.end()) {
-    bool process = true;
-    Message* msg = *it; CHECK(msg); CHECK(!msg->task.control());
+  while (!ready_msgs_.empty()) {
+    Message* msg = ready_msgs_.front(); CHECK(msg); CHECK(!msg->task.control());
+    ready_msgs_.pop_front();
 
     // check if the remote node is still alive.
     Lock l(node_mu_);
@@ -180,51 +372,50 @@ bool Executor::PickActiveMsg() {
     if (!rnode->alive) {
       LOG(WARNING) << my_node_.id() << ": rnode " << msg->sender <<
           " is not alive, ignore received message: " << msg->ShortDebugString();
-      it = recv_msgs_.erase(it);
       delete msg;
       continue;
     }
     // check if double receiving
     bool req = msg->task.request();
-    int ts = msg->task.time();
+    int64 ts = msg->task.time();
     if ((req && rnode->recv_req_tracker.IsFinished(ts)) ||
         (!req && rnode->sent_req_tracker.IsFinished(ts))) {
-      LOG(WARNING) << my_node_.id() << ": received message twice. ignore: " <<
-          msg->ShortDebugString();
-      it = recv_msgs_.erase(it);
+      // a resent request, whose reply may be lost
+      if (req && sys_.manager().ResendReply(*msg)) {
+        VLOG(1) << my_node_.id() << ": resend the reply of " <<
+            msg->ShortDebugString();
+      } else {
+        LOG(WARNING) << my_node_.id() << ": received message twice. ignore: " <<
+            msg->ShortDebugString();
+      }
       delete msg;
       continue;
     }
-
-    // check for dependency constraint. only needed for request message.
-    if (req) {
-      for (int i = 0; i < msg->task.wait_time_size(); ++i) {
-        int wait_time = msg->task.wait_time(i);
-        if (wait_time <= Message::kInvalidTime) continue;
-        if (!rnode->recv_req_tracker.IsFinished(wait_time)) {
-          process = false;
-          ++ it;
-          break;
-        }
-      }
-    }
-    if (process) {
-      VLOG(1) << obj_.id() << ": pick the "
-              << std::distance(recv_msgs_.begin(), it) << "-th messge in ["
-              << recv_msgs_.size() << "] from " << msg->sender
-              << ": " << msg->ShortDebugString();
-
-      active_msg_ = std::shared_ptr<Message>(msg);
-      recv_msgs_.erase(it);
-      rnode->DecodeMessage(active_msg_.get());
-      return true;
+    if (req && !rnode->unfinished_reqs.insert(ts).second) {
+      // resent while the original one is queued, being processed, or deferred.
+      // the reply of the original one will be sent once it is finished
+      LOG(WARNING) << my_node_.id() << ": received an unfinished request "
+                   "twice. ignore: " << msg->ShortDebugString();
+      delete msg;
+      continue;
     }
+
+    // the dependencies have been checked by Schedule
+    VLOG(1) << obj_.id() << ": pick a message from " << msg->sender << ", ["
+            << ready_msgs_.size() << "] ready and [" << num_waiting_msgs_
+            << "] waiting messages left: " << msg->ShortDebugString();
+
+    active_msg_ = std::shared_ptr<Message>(msg);
+    msg->pick_time = Histogram::Now();
+    if (msg->recv_time) wait_.Add(msg->pick_time - msg->recv_time);
+    rnode->DecodeMessage(active_msg_.get());
+    return true;
   }
 
   // sleep until received a new message or another message been marked as
   // finished.
-  VLOG(1) << obj_.id() << ": pick nothing. msg buffer size "
-          << recv_msgs_.size();
+  VLOG(1) << obj_.id() << ": pick nothing. [" << num_waiting_msgs_
+          << "] messages are waiting";
   dag_cond_.wait(lk);
   return false;
 }
@@ -232,9 +423,17 @@ bool Executor::PickActiveMsg() {
 void Executor::ProcessActiveMsg() {
   // ask the customer to process the picked message, and do post-processing
   bool req = active_msg_->task.request();
-  int ts = active_msg_->task.time();
+  int64 ts = active_msg_->task.time();
   if (req) {
     last_request_ = active_msg_;
+    if (active_msg_->has_key()) received_keys_ = true;
+    if (!proc_threads_.empty()) {
+      if (SplitActiveMsg()) return;
+      // a request without key, such as a command, may touch all keys. wait
+      // until all queued parts are processed
+      std::unique_lock<std::mutex> lk(proc_mu_);
+      proc_idle_cond_.wait(lk, [this] { return num_proc_parts_ == 0; });
+    }
     obj_.ProcessRequest(active_msg_.get());
 
     if (active_msg_->finished) {
@@ -247,16 +446,28 @@ void Executor::ProcessActiveMsg() {
     }
   } else {
     last_response_ = active_msg_;
-    obj_.ProcessResponse(active_msg_.get());
+    // an invalid response has no data, see Manager::ResendLoop
+    if (active_msg_->valid) obj_.ProcessResponse(active_msg_.get());
 
     std::unique_lock<std::mutex> lk(node_mu_);
     // mark as finished
     auto rnode = GetRNode(active_msg_->sender);
-    rnode->sent_req_tracker.Finish(ts);
+    FinishTimestamp(rnode, ts, true);
 
     // check if the callback is ready to run
     auto it = sent_reqs_.find(ts);
-    CHECK(it != sent_reqs_.end());
+    if (it == sent_reqs_.end()) {
+      // already finished, e.g. a late response from the replacement of a
+      // dead node
+      return;
+    }
+
+    uint64 submit = it->second.submit_time, recv = active_msg_->recv_time;
+    if (submit && recv > submit) {
+      rnode->rtt.Add(recv - submit);
+      uint64 remote = active_msg_->task.process_time();
+      if (recv - submit > remote) rnode->network.Add(recv - submit - remote);
+    }
     const NodeID& orig_recver = it->second.recver;
     if (orig_recver != active_msg_->sender) {
       auto onode = GetRNode(orig_recver);
@@ -268,52 +479,395 @@ void Executor::ProcessActiveMsg() {
             return;
           }
         }
-        onode->sent_req_tracker.Finish(ts);
+        FinishTimestamp(onode, ts, true);
       } else {
         // the orig_recver should be dead, and active_msgs_->sender is the
         // replacement of this dead node. Just run callback
       }
     }
+    // run the callbacks in the pool, or right now
+    auto info = &it->second;
+    info->done = true;
+    info->callback_pending = true;
+    bool async = callback_pool_ && (info->callback || !info->thens.empty());
     lk.unlock();
-
-    if (it->second.callback) {
-      // run the callback, and then empty it
-      it->second.callback();
-      it->second.callback = Message::Callback();
+    if (async) {
+      callback_pool_->add([this, info, ts]() { RunCallbacks(info, ts); });
+    } else {
+      RunCallbacks(info, ts);
     }
+  }
+}
 
-    sent_req_cond_.notify_all();
+void Executor::RunCallbacks(ReqInfo* info, int64 ts) {
+  std::unique_lock<std::mutex> lk(node_mu_);
+  while (true) {
+    // run the callback and the continuations, and then empty them. more
+    // continuations may be added meanwhile
+    Message::Callback callback;
+    std::vector<Message::Callback> thens;
+    callback.swap(info->callback);
+    thens.swap(info->thens);
+    if (!callback && thens.empty()) break;
+    lk.unlock();
+    if (callback) callback();
+    for (auto& f : thens) f();
+    lk.lock();
   }
+  // Wait(ts) returns after the callbacks are finished
+  info->callback_pending = false;
+  sent_reqs_.erase(ts);
+  Notify(&sent_waiters_, ts);
+}
+
+void Executor::Then(int64 timestamp, const Message::Callback& callback) {
+  std::unique_lock<std::mutex> lk(node_mu_);
+  auto it = sent_reqs_.find(timestamp);
+  if (it == sent_reqs_.end()) {
+    lk.unlock();
+    callback();
+    return;
+  }
+  auto& info = it->second;
+  // a request may be finished without response, e.g. the receiver is dead
+  if ((info.done || CheckFinished(GetRNode(info.recver), timestamp, true)) &&
+      !info.callback_pending) {
+    lk.unlock();
+    callback();
+  } else {
+    info.thens.push_back(callback);
+  }
+}
+
+bool Executor::IsSentReqFinished(int64 timestamp) {
+  Lock l(node_mu_);
+  auto it = sent_reqs_.find(timestamp);
+  if (it == sent_reqs_.end()) return true;
+  return CheckFinished(GetRNode(it->second.recver), timestamp, true) &&
+      !it->second.callback_pending;
 }
 
 void Executor::Accept(Message* msg) {
   {
     Lock l(msg_mu_);
-    recv_msgs_.push_back(msg);
+    Lock l2(node_mu_);
+    auto it = nodes_.find(msg->sender);
+    if (it == nodes_.end()) {
+      // let PickActiveMsg report it
+      ready_msgs_.push_back(msg);
+    } else {
+      Schedule(msg, &it->second);
+    }
     // VLOG(1) << obj_.id() << ": accept " << msg->ShortDebugString();
   }
   dag_cond_.notify_one();
 }
 
 
+void Executor::ProcessInParallel(int num_threads) {
+  CHECK(proc_threads_.empty()) << "can only be called once";
+  {
+    Lock l(proc_mu_);
+    CHECK(proc_ranges_.empty()) << "the key ranges are fixed already";
+  }
+  if (num_threads <= 1) return;
+  proc_queues_.resize(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    proc_threads_.push_back(new std::thread(&Executor::ProcessLoop, this, i));
+  }
+}
+
+const std::vector<Range<Key>>& Executor::ProcessRanges() {
+  Range<Key> range;
+  {
+    Lock l(node_mu_);
+    range = Range<Key>(my_node_.key());
+  }
+  Lock l(proc_mu_);
+  if (proc_ranges_.empty()) {
+    // fixed once, so the keys are always assigned to the same thread. the
+    // first and the last ranges are extended to the whole key space, for the
+    // keys taken over from a dead server or moved from another one
+    int n = std::max<int>(1, proc_threads_.size());
+    for (int i = 0; i < n; ++i) proc_ranges_.push_back(range.EvenDivide(n, i));
+    proc_ranges_.front() = Range<Key>(0, proc_ranges_.front().end());
+    proc_ranges_.back() = Range<Key>(proc_ranges_.back().begin(), kMaxKey);
+  }
+  return proc_ranges_;
+}
+
+bool Executor::SplitActiveMsg() {
+  auto msg = active_msg_;
+  // the replication messages are keyed by the key ranges of other servers
+  if (!msg->has_key() || msg->task.param().replica()) return false;
+  if (obj_.ProcessWhole(*msg)) return false;
+  int n = proc_threads_.size();
+  std::vector<Message*> parts(n);
+  for (auto& p : parts) p = new Message(msg->task);
+  obj_.Slice(*msg, ProcessRanges(), &parts);
+
+  std::shared_ptr<SplitRequest> split(new SplitRequest());
+  split->request = msg;
+  split->responses.resize(n, nullptr);
+  split->unfinished = n;
+  {
+    Lock l(proc_mu_);
+    for (int i = 0; i < n; ++i) {
+      Message* p = parts[i];
+      p->sender = msg->sender;
+      p->recv_time = msg->recv_time;
+      p->pick_time = msg->pick_time;
+      proc_parts_[p] = std::make_pair(split, i);
+      proc_queues_[i].push_back(p);
+    }
+    num_proc_parts_ += n;
+  }
+  proc_cond_.notify_all();
+  return true;
+}
+
+void Executor::ProcessLoop(int i) {
+  process_thread_id_ = i;
+  no_throttle_ = true;
+  while (true) {
+    Message* part = nullptr;
+    {
+      std::unique_lock<std::mutex> lk(proc_mu_);
+      proc_cond_.wait(lk, [this, i] {
+          return done_ || !proc_queues_[i].empty(); });
+      if (done_) break;
+      part = proc_queues_[i].front();
+      proc_queues_[i].pop_front();
+    }
+    // an invalid part has no key in this range
+    if (part->valid) obj_.ProcessRequest(part);
+    FinishPart(part);
+  }
+}
+
+void Executor::FinishPart(Message* part) {
+  std::shared_ptr<SplitRequest> split;
+  bool last = false;
+  {
+    Lock l(proc_mu_);
+    auto it = proc_parts_.find(part);
+    CHECK(it != proc_parts_.end());
+    split = it->second.first;
+    proc_parts_.erase(it);
+    if (!part->finished) split->finished = false;
+    last = -- split->unfinished == 0;
+  }
+  delete part;
+
+  if (last) {
+    // the same as ProcessActiveMsg does for a request
+    Message* msg = split->request.get();
+    Message* res = MergeResponses(split->responses);
+    if (res) Reply(msg, res);
+    int64 ts = msg->task.time();
+    if (split->finished) {
+      FinishRecvReq(ts, msg->sender);
+      if (!msg->replied) obj_.Reply(msg);
+    }
+  }
+
+  bool idle = false;
+  {
+    Lock l(proc_mu_);
+    idle = -- num_proc_parts_ == 0;
+  }
+  if (idle) proc_idle_cond_.notify_all();
+}
+
+Message* Executor::MergeResponses(const std::vector<Message*>& responses) {
+  // the parts without data, e.g. an invalid part, are skipped
+  Message* first = nullptr;
+  for (auto r : responses) {
+    if (r && (!first || (!first->has_data() && r->has_data()))) first = r;
+  }
+  if (!first) return nullptr;
+  Message* merged = new Message(first->task);
+  if (first->has_data()) {
+    // the parts are ordered by key, so just concatenate the keys and values
+    size_t key_bytes = 0;
+    std::vector<size_t> val_bytes(first->value.size());
+    for (auto r : responses) {
+      if (!r || !r->has_data()) continue;
+      CHECK_EQ(r->value.size(), val_bytes.size());
+      key_bytes += r->key.size();
+      for (size_t j = 0; j < val_bytes.size(); ++j) {
+        val_bytes[j] += r->value[j].size();
+      }
+    }
+    merged->key.resize(key_bytes);
+    for (size_t b : val_bytes) merged->value.push_back(SArray<char>(b));
+    key_bytes = 0;
+    std::fill(val_bytes.begin(), val_bytes.end(), 0);
+    for (auto r : responses) {
+      if (!r || !r->has_data()) continue;
+      memcpy(merged->key.data() + key_bytes, r->key.data(), r->key.size());
+      key_bytes += r->key.size();
+      for (size_t j = 0; j < val_bytes.size(); ++j) {
+        memcpy(merged->value[j].data() + val_bytes[j], r->value[j].data(),
+               r->value[j].size());
+        val_bytes[j] += r->value[j].size();
+      }
+    }
+  }
+  for (auto r : responses) delete r;
+  return merged;
+}
+
+string Executor::LatencyReport() {
+  std::stringstream ss;
+  ss << "  wait in queue: " << wait_.ToString() << "\n"
+     << "  process: " << process_.ToString() << "\n";
+  Lock l(node_mu_);
+  if (num_notifies_) {
+    ss << "  waiter wakeups per finished request: "
+       << (double)num_wakeups_ / num_notifies_ << "\n";
+  }
+  for (auto& it : nodes_) {
+    auto& r = it.second;
+    if (r.rtt.count() == 0) continue;
+    ss << "  " << it.first << " rtt: " << r.rtt.ToString() << "\n"
+       << "  " << it.first << " network: " << r.network.ToString() << "\n";
+  }
+  return ss.str();
+}
+
 void Executor::ReplaceNode(const Node& old_node, const Node& new_node) {
-  // TODO
+  bool me;
+  {
+    // at once, so a request is never sliced without the key range of old_node
+    Lock l(node_mu_);
+    RemoveNodeLocked(old_node);
+    AddNodeLocked(new_node);
+    me = new_node.id() == my_node_.id();
+  }
+  DropWaitingMsgs(old_node.id());
+  if (!me) return;
+
+  // take over the key range of the dead node, see Parameter::Recover
+  Message* msg = new Message();
+  msg->task.mutable_param()->set_replica(true);
+  msg->task.set_msg(old_node.id());
+  *msg->task.mutable_key_range() = old_node.key();
+  AcceptLocal(msg);
+}
+
+void Executor::AcceptLocal(Message* msg) {
+  msg->sender = my_node_.id();
+  msg->replied = true;
+  msg->task.set_request(true);
+  msg->task.set_customer_id(obj_.id());
+  {
+    Lock l(node_mu_);
+    int64 ts = GetRNode(my_node_.id())->recv_req_tracker.watermark();
+    last_local_time_ = std::max(ts, last_local_time_ + 1);
+    msg->task.set_time(last_local_time_);
+  }
+  Accept(msg);
+}
+
+std::vector<int> Executor::ReplicaRanks(int rank, int num_servers,
+                                        int num_replicas) {
+  std::vector<int> ranks;
+  for (int i = rank + 1; i < num_servers; ++i) {
+    if ((int)ranks.size() == num_replicas) return ranks;
+    ranks.push_back(i);
+  }
+  for (int i = rank - 1; i >= 0; --i) {
+    if ((int)ranks.size() == num_replicas) return ranks;
+    ranks.push_back(i);
+  }
+  return ranks;
+}
+
+void Executor::UpdateReplicaGroups() {
+  if (my_node_.role() != Node::SERVER || num_replicas_ <= 0) return;
+  auto& replicas = nodes_[kReplicaGroup];
+  auto& owners = nodes_[kOwnerGroup];
+  replicas.group.clear(); replicas.keys.clear();
+  owners.group.clear(); owners.keys.clear();
+
+  const auto& servers = nodes_[kServerGroup];
+  int n = servers.group.size();
+  int me = -1;
+  for (int i = 0; i < n; ++i) {
+    if (servers.group[i]->node.id() == my_node_.id()) me = i;
+  }
+  if (me < 0) return;
+  Range<Key> my_range(my_node_.key());
+  for (int i : ReplicaRanks(me, n, num_replicas_)) {
+    // a replica keeps my key range
+    replicas.group.push_back(servers.group[i]);
+    replicas.keys.push_back(my_range);
+  }
+  for (int i = 0; i < n; ++i) {
+    if (i == me) continue;
+    for (int j : ReplicaRanks(i, n, num_replicas_)) {
+      if (j != me) continue;
+      owners.group.push_back(servers.group[i]);
+      owners.keys.push_back(servers.keys[i]);
+    }
+  }
 }
 
 void Executor::RemoveNode(const Node& node) {
+  {
+    Lock l(node_mu_);
+    if (!RemoveNodeLocked(node)) return;
+  }
+  DropWaitingMsgs(node.id());
+}
+
+bool Executor::RemoveNodeLocked(const Node& node) {
   VLOG(1) << obj_.id() << "remove node: " << node.ShortDebugString();
   auto id = node.id();
-  if (nodes_.find(id) == nodes_.end()) return;
+  if (nodes_.find(id) == nodes_.end()) return false;
   auto r = GetRNode(id);
   for (const NodeID& gid : GroupIDs()) {
     nodes_[gid].RemoveGroupNode(r);
   }
   // do not remove r from nodes_
   r->alive = false;
+  UpdateReplicaGroups();
+
+  // the requests sent to or received from r are considered as finished now
+  Notify(&sent_waiters_, Message::kInvalidTime);
+  Notify(&recv_waiters_, Message::kInvalidTime);
+  return true;
+}
+
+void Executor::DropWaitingMsgs(const NodeID& id) {
+  // the messages waiting for "id" will never be ready, let PickActiveMsg drop
+  // them
+  {
+    Lock l(msg_mu_);
+    auto it = waiting_msgs_.find(id);
+    if (it != waiting_msgs_.end()) {
+      for (auto& w : it->second) {
+        num_waiting_msgs_ -= w.second.size();
+        for (auto msg : w.second) ready_msgs_.push_back(msg);
+      }
+      waiting_msgs_.erase(it);
+    }
+  }
+  dag_cond_.notify_one();
 }
 
 void Executor::AddNode(const Node& node) {
   Lock l(node_mu_);
+  AddNodeLocked(node);
+}
+
+void Executor::UpdateNodes(const std::vector<Node>& nodes) {
+  Lock l(node_mu_);
+  for (const auto& node : nodes) AddNodeLocked(node);
+}
+
+void Executor::AddNodeLocked(const Node& node) {
   VLOG(1) << obj_.id() << "add node: " << node.ShortDebugString();
   // add "node"
   if (node.id() == my_node_.id()) {
@@ -323,7 +877,8 @@ void Executor::AddNode(const Node& node) {
   if (nodes_.find(id) != nodes_.end()) {
     // update
     auto r = GetRNode(id);
-    CHECK(r->alive);
+    // a dead node replaced by itself, see ReplaceNode, is alive again
+    r->alive = true;
     r->node = node;
     for (const NodeID& gid : GroupIDs()) {
       nodes_[gid].RemoveGroupNode(r);
@@ -339,7 +894,8 @@ void Executor::AddNode(const Node& node) {
   if (role != Node::GROUP) {
     nodes_[id].AddGroupNode(w); nodes_[kLiveGroup].AddGroupNode(w);
   }
-  if (role == Node::SERVER) {
+  // a server with empty key range is removed, see Manager::RemoveServer
+  if (role == Node::SERVER && !Range<Key>(node.key()).empty()) {
     nodes_[kServerGroup].AddGroupNode(w); nodes_[kCompGroup].AddGroupNode(w);
   }
   if (role == Node::WORKER) {
@@ -347,31 +903,7 @@ void Executor::AddNode(const Node& node) {
   }
 
   // update replica group and owner group if necessary
-  if (node.role() != Node::SERVER || my_node_.role() != Node::SERVER) return;
-  if (num_replicas_ <= 0) return;
-
-  const auto& servers = nodes_[kServerGroup];
-  for (int i = 0; i < servers.group.size(); ++i) {
-    auto s = servers.group[i];
-    if (s->node.id() != my_node_.id()) continue;
-
-    // the replica group is just before me
-    auto& replicas = nodes_[kReplicaGroup];
-    replicas.group.clear(); replicas.keys.clear();
-    for (int j = std::max(i-num_replicas_, 0); j < i; ++ j) {
-      replicas.group.push_back(servers.group[j]);
-      replicas.keys.push_back(servers.keys[j]);
-    }
-
-    // the owner group is just after me
-    auto& owners = nodes_[kOwnerGroup];
-    owners.group.clear(); owners.keys.clear();
-    for (int j = std::max(i-num_replicas_, 0); j < i; ++ j) {
-      owners.group.push_back(servers.group[j]);
-      owners.keys.push_back(servers.keys[j]);
-    }
-    break;
-  }
+  if (node.role() == Node::SERVER) UpdateReplicaGroups();
 }
 
 } // namespace PS
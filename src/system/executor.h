@@ -1,6 +1,7 @@
 #pragma once
 #include "system/remote_node.h"
 #include "system/message.h"
+#include "util/threadpool.h"
 namespace PS {
 
 const static NodeID kGroupPrefix  = "all_";
@@ -26,28 +27,73 @@ class Executor {
 
   // -- communication and synchronization --
   // see comments in customer.h
-  int Submit(Message* request);
+  int64 Submit(Message* request, bool block = true);
   void Reply(Message* request, Message* response);
 
   void Accept(Message* msg);
-  void WaitSentReq(int timestamp);
-  void WaitRecvReq(int timestamp, const NodeID& sender);
-  void FinishRecvReq(int timestamp, const NodeID& sender);
-  int QueryRecvReq(int timestamp, const NodeID& sender);
+  // queues a request from this node itself, which is processed in order with
+  // the received requests. it is not replied
+  void AcceptLocal(Message* msg);
+  void WaitSentReq(int64 timestamp);
+  // runs "callback" once WaitSentReq(timestamp) would return
+  void Then(int64 timestamp, const Message::Callback& callback);
+  // returns true if WaitSentReq(timestamp) would not block
+  bool IsSentReqFinished(int64 timestamp);
+  void WaitRecvReq(int64 timestamp, const NodeID& sender);
+  void FinishRecvReq(int64 timestamp, const NodeID& sender);
+  int QueryRecvReq(int64 timestamp, const NodeID& sender);
 
   // the last received request
   inline std::shared_ptr<Message> last_request() { return last_request_; }
   // the last received response
   inline std::shared_ptr<Message> last_response() { return last_response_; }
 
-  int time() { Lock l(node_mu_); return time_; }
+  int64 time() { Lock l(node_mu_); return time_; }
+  // true if a request with keys has been received
+  bool received_keys() { return received_keys_; }
+
+  // the latency statistics
+  string LatencyReport();
+
+  // see Customer::SetCallbackThreads
+  void SetCallbackThreads(int num_threads);
+
+  // -- parallel processing, see Customer::ProcessInParallel --
+  void ProcessInParallel(int num_threads);
+  // see Customer::ProcessRanges
+  const std::vector<Range<Key>>& ProcessRanges();
+  // the index of the processing thread running this function, or -1 if it is
+  // not one of them
+  static int process_thread_id() { return process_thread_id_; }
+  // concatenates the replies of the parts of a request, which are ordered by
+  // key, into a single one. takes the ownership of "responses"
+  static Message* MergeResponses(const std::vector<Message*>& responses);
+
+  // Submit from the calling thread is never throttled. it is for the threads
+  // a node relies on to drain the sending queues, e.g. the one processing the
+  // responses, which must not wait for the queues themselves
+  static void NoThrottle() { no_throttle_ = true; }
+
   // node management
   void AddNode(const Node& node);
+  // adds or updates "nodes" at once, so a request is never sliced by a
+  // partially updated group, e.g. when a key range is moved between servers
+  void UpdateNodes(const std::vector<Node>& nodes);
   void RemoveNode(const Node& node);
+  // "new_node" takes over the key range of the dead "old_node"
   void ReplaceNode(const Node& old_node, const Node& new_node);
+
+  // -- replication, see -num_replicas --
+  // the key range of a server is replicated on the next num_replicas servers
+  // ordered by key ranges, or the previous ones for the last servers. returns
+  // the ranks of the replicas of server "rank". so the first replica is
+  // always next to the server, and can take over its key range
+  static std::vector<int> ReplicaRanks(int rank, int num_servers,
+                                       int num_replicas);
  private:
   // Runs the DAG engine
   void Run() {
+    no_throttle_ = true;
     while (!done_) {
       if (PickActiveMsg()) ProcessActiveMsg();
     }
@@ -57,27 +103,97 @@ class Executor {
   bool PickActiveMsg();
   void ProcessActiveMsg();
 
+  // -- parallel processing --
+  // a request is sliced into parts by the key ranges in proc_ranges_, and the
+  // i-th part is processed by the i-th processing thread. so the requests on
+  // the same key are processed in order, while the parts of a request run
+  // concurrently. the replies of the parts are merged into a single one
+  struct SplitRequest {
+    std::shared_ptr<Message> request;
+    std::vector<Message*> responses;  // the reply of each part, or nullptr
+    int unfinished = 0;               // the number of parts not processed
+    bool finished = true;             // false if any part is not finished
+  };
+  // slices active_msg_ and queues the parts. returns false if active_msg_ has
+  // no key or is processed as a whole, see Customer::ProcessWhole. it is
+  // processed after all queued parts are done
+  bool SplitActiveMsg();
+  void ProcessLoop(int i);
+  void FinishPart(Message* part);
+
+  std::vector<std::thread*> proc_threads_;
+  std::vector<std::deque<Message*>> proc_queues_;
+  std::vector<Range<Key>> proc_ranges_;
+  // <part, (the request it belongs to, the index of the part)>
+  std::unordered_map<Message*, std::pair<std::shared_ptr<SplitRequest>, int>>
+  proc_parts_;
+  size_t num_proc_parts_ = 0;  // the number of parts not processed
+  std::mutex proc_mu_;
+  std::condition_variable proc_cond_;
+  std::condition_variable proc_idle_cond_;
+  static thread_local int process_thread_id_;
+  static thread_local bool no_throttle_;
+
   // -- received messages --
-  std::list<Message*> recv_msgs_;
+  // a received request may depend on other requests from the same sender, see
+  // Task.wait_time. a message is indexed by the first unfinished request it
+  // waits for, and is moved into ready_msgs_ once all of them are finished. so
+  // picking a message is O(1) no matter how many messages are waiting
+  std::deque<Message*> ready_msgs_;
+  // <sender, <timestamp, messages waiting for this timestamp>>
+  std::unordered_map<NodeID, std::unordered_map<int64, std::vector<Message*>>>
+  waiting_msgs_;
+  size_t num_waiting_msgs_ = 0;
+  // protects the above. lock it before node_mu_ if both are needed
   std::mutex msg_mu_;
+  // puts "msg" from "rnode" into either waiting_msgs_ or ready_msgs_. requires
+  // both msg_mu_ and node_mu_
+  void Schedule(Message* msg, RemoteNode* rnode);
+  // reschedules the messages waiting for "timestamp" from "rnode". returns
+  // true if any. requires both msg_mu_ and node_mu_
+  bool Wake(int64 timestamp, RemoteNode* rnode);
   // the message is going to be processed or the last one be processed
   std::shared_ptr<Message> active_msg_, last_request_, last_response_;
   std::condition_variable dag_cond_;
 
   // -- remote nodes --
   std::mutex node_mu_;
-  std::condition_variable recv_req_cond_;
-  std::condition_variable sent_req_cond_;
   std::unordered_map<NodeID, RemoteNode> nodes_;
 
+  // the threads blocked by WaitSentReq or WaitRecvReq are registered by the
+  // timestamp, so finishing a timestamp only wakes the ones waiting for it
+  struct Waiter {
+    std::condition_variable cond;
+    int num = 0;  // the number of waiting threads
+  };
+  typedef std::unordered_map<int64, std::shared_ptr<Waiter>> Waiters;
+  Waiters sent_waiters_, recv_waiters_;
+  // blocks until "finished" returns true. requires "lk" on node_mu_
+  void WaitFor(std::unique_lock<std::mutex>& lk, Waiters* waiters,
+               int64 timestamp, const std::function<bool()>& finished);
+  // wakes the waiters of "timestamp", or all if it is kInvalidTime. requires
+  // node_mu_
+  void Notify(Waiters* waiters, int64 timestamp);
+  // for statistics: how many times a waiter is woken, and how many
+  // timestamps are finished
+  size_t num_wakeups_ = 0;
+  size_t num_notifies_ = 0;
+
   inline RemoteNode* GetRNode(const NodeID& node_id) {
     auto it = nodes_.find(node_id);
     CHECK(it != nodes_.end()) << "node [" << node_id << "] doesn't exist";
     return &(it->second);
   }
 
-  inline bool CheckFinished(RemoteNode* rnode, int timestamp, bool sent);
-  inline int NumFinished(RemoteNode* rnode, int timestamp, bool sent);
+  inline bool CheckFinished(RemoteNode* rnode, int64 timestamp, bool sent);
+  inline int NumFinished(RemoteNode* rnode, int64 timestamp, bool sent);
+  // marks "timestamp" as finished in the sent or received request tracker of
+  // "rnode". the tracker may drop the older unfinished timestamps out of its
+  // window, which is fine for the skipped ones, e.g. the requests sent to
+  // other nodes, but fails if a request to or from "rnode" is still in
+  // progress. returns true if some timestamps are dropped, the waiters of the
+  // dropped ones are woken then. requires node_mu_
+  bool FinishTimestamp(RemoteNode* rnode, int64 timestamp, bool sent);
 
   std::vector<NodeID> GroupIDs() {
    std::vector<NodeID> ids = {
@@ -89,14 +205,47 @@ class Executor {
   Postoffice& sys_;
   Node my_node_;
   int num_replicas_ = 0;  // number of replicas for a server node
+  // requires node_mu_
+  void AddNodeLocked(const Node& node);
+  // returns false if "node" is unknown. requires node_mu_
+  bool RemoveNodeLocked(const Node& node);
+  // releases the received messages waiting for the dead node "id"
+  void DropWaitingMsgs(const NodeID& id);
+  // updates kReplicaGroup and kOwnerGroup. requires node_mu_
+  void UpdateReplicaGroups();
+  // the timestamp of the last request queued by this node itself, see
+  // ReplaceNode
+  int64 last_local_time_ = Message::kInvalidTime;
 
-  int time_ = Message::kInvalidTime;  // current timestamp
+  // current timestamp
+  int64 time_ = Message::kInvalidTime;
   struct ReqInfo {
     NodeID recver;
     Message::Callback callback;
+    uint64 submit_time;
+    // run after the callback, see Then
+    std::vector<Message::Callback> thens;
+    // true once all responses are received
+    bool done = false;
+    // true if the callbacks are not finished yet after done
+    bool callback_pending = false;
   };
-  // <timestamp, (receiver, callback)>
-  std::unordered_map<int, ReqInfo> sent_reqs_;
+  // runs the callback and the continuations of a finished request
+  void RunCallbacks(ReqInfo* info, int64 ts);
+
+  // runs the callbacks if not null, otherwise they run in the executor thread
+  std::unique_ptr<ThreadPool> callback_pool_;
+
+  // latencies of received requests. wait: from being received to being
+  // picked. process: from being picked to being replied
+  Histogram wait_;
+  Histogram process_;
+  // <timestamp, (receiver, callback)>. a request is erased once finished and
+  // its callbacks are done, so a submitted one not found here is finished
+  std::unordered_map<int64, ReqInfo> sent_reqs_;
+
+  // set by the executor thread, read by the manager
+  std::atomic<bool> received_keys_{false};
 
   // the processing thread
   bool done_ = false;
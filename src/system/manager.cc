@@ -1,6 +1,7 @@
 #include "system/manager.h"
 #include "system/postoffice.h"
 #include "system/customer.h"
+#include "util/resource_usage.h"
 namespace PS {
 
 DECLARE_int32(num_servers);
@@ -11,11 +12,45 @@ DECLARE_int32(report_interval);
 DEFINE_string(app_conf, "", "the string configuration of app");
 DEFINE_string(app_file, "", "the configuration file of app");
 
+DEFINE_int32(resend_timeout, 0,
+  "resend a request if its response is not received in this number of "
+  "milliseconds, which doubles for each retry. 0 disables resending");
+DEFINE_int32(resend_max_retries, 10,
+  "a request is given up after being resent this number of times, and then "
+  "finished without a response");
+DEFINE_int32(reply_cache_mb, 64,
+  "the size in MB of the recent replies kept for answering resent requests");
+
+DEFINE_int32(register_timeout, 60,
+  "the scheduler waits at most this number of seconds for all the workers and "
+  "servers to register, and then broadcasts the node table at once. nodes "
+  "registered later are added one batch at a time");
+
+DEFINE_string(key_partition, "even",
+  "how the scheduler partitions the key range over servers. \"even\" divides "
+  "it evenly, \"key\" balances the number of unique keys, and \"push\" "
+  "balances the number of pushed keys, the latter two are estimated by the keys "
+  "sampled at workers, see Manager::BalanceKeyRanges. only the BCD learners "
+  "sample the keys now");
+DEFINE_int32(key_sample_rate, 1000,
+  "workers sample 1/n of the keys for -key_partition");
+
 DEFINE_uint64(key_start, 0, "global key range");
 DEFINE_uint64(key_end, kuint64max, "global key range");
 
 Manager::Manager() {}
 Manager::~Manager() {
+  if (resend_thread_) {
+    {
+      Lock l(resend_mu_);
+      resend_done_ = true;
+    }
+    resend_cond_.notify_all();
+    resend_thread_->join();
+    ResendStatistic();
+  }
+  for (auto& it : pending_reqs_) delete it.second.msg;
+  for (auto& it : replies_) delete it.second;
   for (auto& it : customers_) {
     if (it.second.second) delete it.second.first;
   }
@@ -25,7 +60,12 @@ Manager::~Manager() {
 
 void Manager::Init(char* argv0) {
   env_.Init(argv0);
-  van_.Init();
+  van_ = std::unique_ptr<Van>(Van::Create());
+  van_->Init();
+  if (FLAGS_resend_timeout > 0) {
+    resend_thread_ = std::unique_ptr<std::thread>(
+        new std::thread(&Manager::ResendLoop, this));
+  }
 
   if (IsScheduler()) {
     if (!FLAGS_logtostderr) {
@@ -33,6 +73,8 @@ void Manager::Init(char* argv0) {
              FLAGS_log_dir.c_str(), basename(argv0));
     }
 
+    CHECK(FLAGS_num_replicas == 0 || FLAGS_num_replicas < FLAGS_num_servers)
+        << "need more servers than -num_replicas";
     node_assigner_ = new NodeAssigner(
         FLAGS_num_servers, Range<Key>(FLAGS_key_start, FLAGS_key_end));
     // create the app
@@ -44,12 +86,12 @@ void Manager::Init(char* argv0) {
     CreateApp(app_conf_);
 
     // add my node into app_
-    AddNode(van_.my_node());
+    AddNode(van_->my_node());
   } else {
     // request the app config from the scheduler
     Task task = NewControlTask(Control::REQUEST_APP);
-    *task.mutable_ctrl()->add_node() = van_.my_node();
-    SendTask(van_.scheduler(), task);
+    *task.mutable_ctrl()->add_node() = van_->my_node();
+    SendTask(van_->scheduler(), task);
   }
 }
 
@@ -58,9 +100,32 @@ void Manager::Run() {
   // while run() is called by the main thread, so here should be a thread
   // synchronization.
 
+  if (IsScheduler()) {
+    // wait the workers and servers to register, then tell them all nodes at
+    // once rather than one by one, which needs O(N^2) messages
+    size_t n = FLAGS_num_workers + FLAGS_num_servers;
+    auto tv = tic();
+    {
+      std::unique_lock<std::mutex> lk(nodes_mu_);
+      if (!nodes_cond_.wait_for(
+              lk, std::chrono::seconds(FLAGS_register_timeout),
+              [this, n] { return new_nodes_.size() >= n; })) {
+        LOG(WARNING) << "only " << new_nodes_.size() << " of " << n
+                     << " nodes registered in " << FLAGS_register_timeout
+                     << " sec";
+      }
+      bootstrapped_ = true;
+    }
+    AddNewNodes();
+    VLOG(1) << "bootstrapped in " << toc(tv) << " sec";
+  }
+
   // wait my node info is updated
-  while (!is_my_node_inited_) usleep(500);
-  if (van_.my_node().role() == Node::WORKER) {
+  {
+    std::unique_lock<std::mutex> lk(nodes_mu_);
+    nodes_cond_.wait(lk, [this] { return is_my_node_inited_; });
+  }
+  if (van_->my_node().role() == Node::WORKER) {
     WaitServersReady();
   }
   VLOG(1) << "run app..";
@@ -70,21 +135,25 @@ void Manager::Run() {
 void Manager::Stop() {
   if (IsScheduler()) {
     // wait all other nodes are ready for exit
-    while (num_active_nodes_ > 1) usleep(500);
-    // broadcast the terminate signal
+    {
+      std::unique_lock<std::mutex> lk(nodes_mu_);
+      nodes_cond_.wait(lk, [this] { return num_active_nodes_ <= 1; });
+    }
+    // broadcast the terminate signal. the sending threads flush them before
+    // exit, see ~Postoffice
     in_exit_ = true;
     for (const auto& it : nodes_) {
       Task task = NewControlTask(Control::EXIT);
       SendTask(it.second, task);
     }
-    usleep(800);
     LOG(INFO) << "System stopped";
   } else {
     Task task = NewControlTask(Control::READY_TO_EXIT);
-    SendTask(van_.scheduler(), task);
+    SendTask(van_->scheduler(), task);
 
     // run as a daemon until received the termination message
-    while (!done_) usleep(500);
+    std::unique_lock<std::mutex> lk(nodes_mu_);
+    nodes_cond_.wait(lk, [this] { return done_; });
   }
 }
 
@@ -106,7 +175,7 @@ bool Manager::Process(Message* msg) {
         CHECK(IsScheduler());
         // need to connect to this node before sending reply message
         CHECK_EQ(ctrl.node_size(), 1);
-        CHECK(van_.Connect(ctrl.node(0)));
+        CHECK(van_->Connect(ctrl.node(0)));
         reply.mutable_ctrl()->set_cmd(Control::REQUEST_APP);
         reply.set_msg(app_conf_);
         break;
@@ -116,9 +185,22 @@ bool Manager::Process(Message* msg) {
         CHECK_EQ(ctrl.node_size(), 1);
         Node sender = ctrl.node(0);
         CHECK_NOTNULL(node_assigner_)->assign(&sender);
-        AddNode(sender);
+        bool bootstrapped;
+        {
+          Lock l(nodes_mu_);
+          new_nodes_.push_back(sender);
+          bootstrapped = bootstrapped_;
+        }
+        nodes_cond_.notify_all();
+        if (bootstrapped) AddNewNodes();
         break;
       }
+      case Control::SAMPLE_KEYS: {
+        CHECK(IsScheduler());
+        // replied after the key range is partitioned
+        AddKeySample(*msg);
+        return true;
+      }
       case Control::REPORT_PERF: {
         CHECK(IsScheduler());
         // TODO
@@ -126,17 +208,46 @@ bool Manager::Process(Message* msg) {
       }
       case Control::READY_TO_EXIT: {
         CHECK(IsScheduler());
-        -- num_active_nodes_;
+        {
+          Lock l(nodes_mu_);
+          -- num_active_nodes_;
+        }
+        nodes_cond_.notify_all();
         break;
       }
-      case Control::ADD_NODE:
-      case Control::UPDATE_NODE: {
+      case Control::ADD_NODE: {
         for (int i = 0; i < ctrl.node_size(); ++i) {
           AddNode(ctrl.node(i));
         } break;
       }
+      case Control::UPDATE_NODE: {
+        std::vector<Node> nodes(ctrl.node().begin(), ctrl.node().end());
+        CheckKeysKept(nodes);
+        UpdateNodes(nodes);
+        // the scheduler counts the replies of a move, see FinishMigration
+        *reply.mutable_ctrl() = ctrl;
+        break;
+      }
+      case Control::DROP_KEYS: {
+        // the moved key ranges are known by all nodes now
+        std::vector<Range<Key>> moved;
+        {
+          Lock l(nodes_mu_);
+          moved.swap(moved_ranges_);
+        }
+        for (const auto& r : moved) {
+          for (auto& it : customers_) it.second.first->DropKeys(r);
+        }
+        break;
+      }
+      case Control::MIGRATE: {
+        CHECK_EQ(ctrl.node_size(), 2);
+        MoveKeys(ctrl.node(0), ctrl.node(1));
+        break;
+      }
       case Control::REPLACE_NODE: {
-        // TODO
+        CHECK_EQ(ctrl.node_size(), 2);
+        ReplaceNode(ctrl.node(0), ctrl.node(1));
         break;
       }
       case Control::REMOVE_NODE: {
@@ -145,20 +256,39 @@ bool Manager::Process(Message* msg) {
         } break;
       }
       case Control::EXIT: {
-        done_ = true;
+        {
+          Lock l(nodes_mu_);
+          done_ = true;
+        }
+        nodes_cond_.notify_all();
         return false;
       }
     }
     SendTask(msg->sender, reply);
   } else {
     if (!task.has_ctrl()) return true;
-    if (task.ctrl().cmd() == Control::REQUEST_APP) {
+    if (task.ctrl().cmd() == Control::MIGRATE) {
+      CHECK(IsScheduler());
+      FinishMigration(task.ctrl().node(0), task.ctrl().node(1));
+    } else if (task.ctrl().cmd() == Control::SAMPLE_KEYS) {
+      {
+        Lock l(nodes_mu_);
+        ++ num_key_partitions_;
+      }
+      nodes_cond_.notify_all();
+    } else if (task.ctrl().cmd() == Control::UPDATE_NODE) {
+      CHECK(IsScheduler());
+      const auto& ctrl = task.ctrl();
+      if (ctrl.node_size() == 2) {
+        AckMigration(msg->sender, ctrl.node(0).id(), ctrl.node(1).id());
+      }
+    } else if (task.ctrl().cmd() == Control::REQUEST_APP) {
       CHECK(task.has_msg());
       CreateApp(task.msg());
       // app is created, now we can ask the scheduler to broadcast this node to others
       Task task = NewControlTask(Control::REGISTER_NODE);
-      *task.mutable_ctrl()->add_node() = van_.my_node();
-      SendTask(van_.scheduler(), task);
+      *task.mutable_ctrl()->add_node() = van_->my_node();
+      SendTask(van_->scheduler(), task);
     }
   }
   return true;
@@ -170,7 +300,7 @@ void Manager::AddNode(const Node& node) {
   if (nodes_.find(node.id()) == nodes_.end()) {
     if (!IsScheduler()) {
       // the scheduler has already connect this node when processing REQUEST_APP
-      CHECK(van_.Connect(node));
+      CHECK(van_->Connect(node));
     }
     if (node.role() == Node::WORKER) ++ num_workers_;
     if (node.role() == Node::SERVER) ++ num_servers_;
@@ -184,58 +314,382 @@ void Manager::AddNode(const Node& node) {
     it.second.first->executor()->AddNode(node);
   }
 
-  if (IsScheduler() && node.id() != van_.my_node().id()) {
-    // send all existing nodes info to sender
-    Task add_node = NewControlTask(Control::ADD_NODE);
-    for (const auto& it : nodes_) {
-      *add_node.mutable_ctrl()->add_node() = it.second;
+  if (node.id() == van_->my_node().id()) {
+    Lock l(nodes_mu_);
+    is_my_node_inited_ = true;
+  }
+  nodes_cond_.notify_all();
+  VLOG(1) << "add node: " << node.ShortDebugString();
+}
+
+
+void Manager::AddNewNodes() {
+  // serialize the callers, so a node is told about the others before they are
+  // told about it
+  Lock l(add_nodes_mu_);
+  std::vector<Node> added;
+  {
+    Lock l2(nodes_mu_);
+    added.swap(new_nodes_);
+  }
+  // a server registered with an empty key range splits the range of another
+  // one, which is done after the data are moved, see StartMigration
+  {
+    Lock l2(migrate_mu_);
+    for (const auto& node : added) {
+      if (node.role() == Node::SERVER && Range<Key>(node.key()).empty()) {
+        migrations_.push_back(std::make_pair(node, false));
+      }
+    }
+  }
+  added.erase(std::remove_if(added.begin(), added.end(), [](const Node& n) {
+        return n.role() == Node::SERVER && Range<Key>(n.key()).empty(); }),
+    added.end());
+  if (added.empty()) { StartMigration(); return; }
+  for (const auto& node : added) AddNode(node);
+
+  std::vector<Node> all;
+  {
+    Lock l2(nodes_mu_);
+    for (const auto& it : nodes_) all.push_back(it.second);
+  }
+  std::unordered_set<NodeID> is_added;
+  for (const auto& node : added) is_added.insert(node.id());
+
+  // send all nodes to the added ones, and the added ones to the others
+  Task to_added = NewControlTask(Control::ADD_NODE);
+  for (const auto& node : all) *to_added.mutable_ctrl()->add_node() = node;
+  Task to_others = NewControlTask(Control::ADD_NODE);
+  for (const auto& node : added) *to_others.mutable_ctrl()->add_node() = node;
+  int num_msgs = 0;
+  for (const auto& node : all) {
+    if (node.id() == van_->my_node().id()) continue;
+    SendTask(node, is_added.count(node.id()) ? to_added : to_others);
+    ++ num_msgs;
+  }
+  VLOG(1) << "added " << added.size() << " nodes by " << num_msgs
+          << " messages";
+  StartMigration();
+}
+
+void Manager::UpdateNodes(const std::vector<Node>& nodes) {
+  bool update_me = false;
+  nodes_mu_.lock();
+  for (const auto& node : nodes) {
+    if (nodes_.find(node.id()) == nodes_.end()) {
+      if (!IsScheduler()) CHECK(van_->Connect(node));
+      if (node.role() == Node::WORKER) ++ num_workers_;
+      if (node.role() == Node::SERVER) ++ num_servers_;
+      ++ num_active_nodes_;
+    }
+    nodes_[node.id()] = node;
+    if (node.id() == van_->my_node().id()) update_me = true;
+  }
+  nodes_mu_.unlock();
+  nodes_cond_.notify_all();
+
+  // update my key range
+  if (update_me) {
+    for (const auto& node : nodes) {
+      if (node.id() == van_->my_node().id()) CHECK(van_->Connect(node));
     }
-    SendTask(node, add_node);
+  }
+  for (auto& it : customers_) {
+    it.second.first->executor()->UpdateNodes(nodes);
+  }
+  VLOG(1) << "update " << nodes.size() << " nodes";
+}
+
+bool Manager::balance_key_ranges() {
+  CHECK(FLAGS_key_partition == "even" || FLAGS_key_partition == "key" ||
+        FLAGS_key_partition == "push")
+      << "unknown -key_partition " << FLAGS_key_partition;
+  return FLAGS_key_partition != "even";
+}
+
+void Manager::SampleKeys(
+    const SArray<Key>& keys, NodeAssigner::KeySample* sample) {
+  if (!balance_key_ranges()) return;
+  NodeAssigner::SampleKeys(keys.data(), keys.size(), FLAGS_key_sample_rate,
+                           sample);
+}
+
+void Manager::BalanceKeyRanges(const NodeAssigner::KeySample& sample) {
+  if (!balance_key_ranges()) return;
+  CHECK_EQ(van_->my_node().role(), Node::WORKER);
+  SArray<Key> key(sample.size());
+  SArray<uint32> cnt(sample.size());
+  for (size_t i = 0; i < sample.size(); ++i) {
+    key[i] = sample[i].first; cnt[i] = sample[i].second;
+  }
+  int partitions;
+  {
+    Lock l(nodes_mu_);
+    partitions = num_key_partitions_;
+  }
+  Message* msg = new Message(NewControlTask(Control::SAMPLE_KEYS));
+  msg->recver = van_->scheduler().id();
+  msg->set_key(key);
+  msg->add_value(cnt);
+  Postoffice::instance().Queue(msg);
+
+  std::unique_lock<std::mutex> lk(nodes_mu_);
+  nodes_cond_.wait(lk, [this, partitions] {
+      return num_key_partitions_ > partitions; });
+}
+
+void Manager::AddKeySample(const Message& msg) {
+  SArray<Key> key(msg.key);
+  CHECK_EQ(msg.value.size(), 1);
+  SArray<uint32> cnt(msg.value[0]);
+  CHECK_EQ(key.size(), cnt.size());
+  for (size_t i = 0; i < key.size(); ++i) {
+    key_sample_.push_back(std::make_pair(key[i], cnt[i]));
+  }
+  key_samplers_.push_back(std::make_pair(msg.sender, msg.task.time()));
+  if ((int)key_samplers_.size() < FLAGS_num_workers) return;
+
+  // all workers are sampled
+  NodeAssigner::KeySample sample;
+  sample.swap(key_sample_);
+  std::vector<std::pair<NodeID, int64>> samplers;
+  samplers.swap(key_samplers_);
+  NodeAssigner::MergeSample(&sample, FLAGS_key_partition == "key");
 
-    // broadcast this new sender info
+  std::vector<Node> servers, others;
+  {
+    Lock l(nodes_mu_);
     for (const auto& it : nodes_) {
-      if (it.first == van_.my_node().id() || it.first == node.id()) {
-        continue;
+      if (it.first == van_->my_node().id()) continue;
+      others.push_back(it.second);
+      if (it.second.role() == Node::SERVER &&
+          !Range<Key>(it.second.key()).empty()) {
+        servers.push_back(it.second);
       }
-      Task add_new_node = NewControlTask(Control::ADD_NODE);
-      *add_new_node.mutable_ctrl()->add_node() = node;
-      SendTask(it.second, add_new_node);
     }
   }
+  CHECK(!servers.empty());
+  std::sort(servers.begin(), servers.end(), [](const Node& a, const Node& b) {
+      return a.key().begin() < b.key().begin(); });
+  int n = servers.size();
+  std::vector<Key> old_bound;
+  for (const auto& s : servers) old_bound.push_back(s.key().begin());
+  old_bound.push_back(servers.back().key().end());
+  auto bound = NodeAssigner::Partition(
+      sample, Range<Key>(old_bound.front(), old_bound.back()), n);
+  LOG(INFO) << "partition the key range by " << sample.size()
+            << " sampled keys, the max " << FLAGS_key_partition
+            << " load over the mean is "
+            << NodeAssigner::Imbalance(sample, old_bound) << " => "
+            << NodeAssigner::Imbalance(sample, bound);
+  for (int i = 0; i < n; ++i) {
+    Range<Key>(bound[i], bound[i+1]).To(servers[i].mutable_key());
+  }
 
-  if (node.id() == van_.my_node().id()) is_my_node_inited_ = true;
-  VLOG(1) << "add node: " << node.ShortDebugString();
+  UpdateNodes(servers);
+  Task update = NewControlTask(Control::UPDATE_NODE);
+  for (const auto& s : servers) *update.mutable_ctrl()->add_node() = s;
+  for (const auto& node : others) SendTask(node, update);
+
+  // a worker gets the reply after the update, which is sent earlier by the
+  // same connection
+  for (const auto& s : samplers) {
+    Task reply;
+    reply.set_control(true);
+    reply.set_request(false);
+    reply.set_time(s.second);
+    reply.mutable_ctrl()->set_cmd(Control::SAMPLE_KEYS);
+    SendTask(s.first, reply);
+  }
+}
+
+void Manager::CheckKeysKept(const std::vector<Node>& nodes) {
+  Range<Key> old_range(van_->my_node().key());
+  for (const auto& node : nodes) {
+    if (node.id() != van_->my_node().id()) continue;
+    // a move has updated my key range already when the update arrives, see
+    // MoveKeys, and the server taking over a range only gets keys
+    Range<Key> new_range(node.key());
+    if (old_range.empty() || new_range.SetIntersection(old_range) == old_range) {
+      continue;
+    }
+    // BalanceKeyRanges updates the key ranges without moving any data
+    for (auto& it : customers_) {
+      CHECK(!it.second.first->executor()->received_keys())
+          << "the key range of " << node.id() << " changes from "
+          << old_range.ToString() << " to " << new_range.ToString()
+          << " after it received keys, which are lost. call "
+          << "Manager::BalanceKeyRanges before pushing any key";
+    }
+  }
+}
+
+void Manager::RemoveServer(const NodeID& node_id) {
+  CHECK(IsScheduler());
+  Node node;
+  {
+    Lock l(nodes_mu_);
+    auto it = nodes_.find(node_id);
+    CHECK(it != nodes_.end()) << node_id << " does not exist";
+    CHECK_EQ(it->second.role(), Node::SERVER);
+    node = it->second;
+  }
+  {
+    Lock l(migrate_mu_);
+    migrations_.push_back(std::make_pair(node, true));
+  }
+  StartMigration();
+}
+
+void Manager::StartMigration() {
+  std::pair<Node, bool> next;
+  {
+    Lock l(migrate_mu_);
+    if (migrating_ || migrations_.empty()) return;
+    next = migrations_.front();
+    migrations_.pop_front();
+    migrating_ = true;
+  }
+  std::vector<Node> all, servers;
+  {
+    Lock l(nodes_mu_);
+    for (const auto& it : nodes_) {
+      all.push_back(it.second);
+      if (it.second.role() == Node::SERVER) servers.push_back(it.second);
+    }
+  }
+  // "from" moves a part of its key range to "to"
+  Node from, to;
+  if (next.second) {
+    from = next.first;
+    for (const auto& s : servers) if (s.id() == from.id()) from = s;
+    NodeAssigner::Merge(servers, &from, &to);
+  } else {
+    to = next.first;
+    NodeAssigner::Split(servers, &to, &from);
+    // the new server gets all nodes, with the key ranges after moving. the
+    // others know it after the data is moved
+    Task add_node = NewControlTask(Control::ADD_NODE);
+    for (const auto& node : all) {
+      *add_node.mutable_ctrl()->add_node() = node.id() == from.id() ? from : node;
+    }
+    *add_node.mutable_ctrl()->add_node() = to;
+    SendTask(to, add_node);
+  }
+  LOG(INFO) << "move keys from " << from.id() << " to " << to.id() << ", "
+            << from.id() << ": " << Range<Key>(from.key()).ToString() << ", "
+            << to.id() << ": " << Range<Key>(to.key()).ToString();
+  Task migrate = NewControlTask(Control::MIGRATE);
+  *migrate.mutable_ctrl()->add_node() = from;
+  *migrate.mutable_ctrl()->add_node() = to;
+  SendTask(from, migrate);
 }
 
+void Manager::MoveKeys(const Node& from, const Node& to) {
+  // the range moved out of my key range, which is a prefix or a suffix
+  Range<Key> old_range(van_->my_node().key()), new_range(from.key());
+  Range<Key> moved = new_range.empty() ? old_range :
+                     new_range.begin() == old_range.begin() ?
+                     Range<Key>(new_range.end(), old_range.end()) :
+                     Range<Key>(old_range.begin(), new_range.begin());
+  UpdateNodes({from, to});
+  {
+    Lock l(nodes_mu_);
+    moved_ranges_.push_back(moved);
+  }
+
+  // tell the scheduler after all customers are done
+  auto left = std::make_shared<std::atomic<size_t>>(customers_.size() + 1);
+  NodeID scheduler = van_->scheduler().id();
+  auto done = [this, left, from, to, scheduler]() {
+    if (-- *left) return;
+    Task res;
+    res.set_control(true);
+    res.set_request(false);
+    res.mutable_ctrl()->set_cmd(Control::MIGRATE);
+    *res.mutable_ctrl()->add_node() = from;
+    *res.mutable_ctrl()->add_node() = to;
+    SendTask(scheduler, res);
+  };
+  for (auto& it : customers_) it.second.first->MigrateKeys(moved, to.id(), done);
+  done();
+}
+
+void Manager::FinishMigration(const Node& from, const Node& to) {
+  // tell all nodes
+  UpdateNodes({from, to});
+  Task update = NewControlTask(Control::UPDATE_NODE);
+  *update.mutable_ctrl()->add_node() = from;
+  *update.mutable_ctrl()->add_node() = to;
+  std::vector<Node> others;
+  {
+    Lock l(nodes_mu_);
+    for (const auto& it : nodes_) {
+      if (it.first != van_->my_node().id()) others.push_back(it.second);
+    }
+  }
+  {
+    Lock l(migrate_mu_);
+    migrated_ = std::make_pair(from.id(), to.id());
+    update_acks_.clear();
+    for (const auto& node : others) update_acks_.insert(node.id());
+  }
+  for (const auto& node : others) SendTask(node, update);
+  LOG(INFO) << "moved keys from " << from.id() << " to " << to.id();
+}
+
+void Manager::AckMigration(const NodeID& node, const NodeID& from,
+                           const NodeID& to) {
+  {
+    Lock l(migrate_mu_);
+    if (!migrating_ || migrated_ != std::make_pair(from, to)) return;
+    if (!update_acks_.erase(node) || !update_acks_.empty()) return;
+  }
+  // all nodes route by the new key ranges now, and sent the requests by the
+  // old ones before their replies. so "from" can drop the moved data and stop
+  // forwarding. the next move starts after it, so a range moved back to
+  // "from" is never dropped
+  SendTask(from, NewControlTask(Control::DROP_KEYS));
+  {
+    Lock l(migrate_mu_);
+    migrating_ = false;
+  }
+  StartMigration();
+}
 
 void Manager::RemoveNode(const NodeID& node_id) {
   nodes_mu_.lock();
   auto it = nodes_.find(node_id);
-  if (it == nodes_.end()) return;
+  if (it == nodes_.end()) { nodes_mu_.unlock(); return; }
   Node node = it->second;
-  // van_.disconnect(node);
+  // van_->disconnect(node);
   if (node.role() == Node::WORKER) -- num_workers_;
   if (node.role() == Node::SERVER) -- num_servers_;
   -- num_active_nodes_;
   nodes_.erase(it);
   nodes_mu_.unlock();
-
-  // TODO use *replace* for server
-  // TODO remove from customers
-  // remove from customers
-  // for (auto& it : customers_) {
-  //   it.second.first->exec().removeNode(node);
-  // }
+  nodes_cond_.notify_all();
+  Postoffice::instance().RemoveReceiver(node_id);
 
   // remove from app
   for (auto& it : customers_) {
     it.second.first->executor()->RemoveNode(node);
   }
 
+  if (IsScheduler()) {
+    // a dead node never replies the UPDATE_NODE of a move
+    std::pair<NodeID, NodeID> migrated;
+    {
+      Lock l(migrate_mu_);
+      migrated = migrated_;
+    }
+    AckMigration(node_id, migrated.first, migrated.second);
+  }
+
   // broadcast
-  if (IsScheduler() && node.id() != van_.my_node().id()) {
+  if (IsScheduler() && node.id() != van_->my_node().id()) {
     for (const auto& it : nodes_) {
-      if (it.first == van_.my_node().id() || it.first == node.id()) {
+      if (it.first == van_->my_node().id() || it.first == node.id()) {
         continue;
       }
       Task remove_node = NewControlTask(Control::REMOVE_NODE);
@@ -247,6 +701,74 @@ void Manager::RemoveNode(const NodeID& node_id) {
   VLOG(1) << "remove node: " << node.ShortDebugString();
 }
 
+void Manager::ReplaceNode(const Node& old_node, const Node& new_node) {
+  nodes_mu_.lock();
+  auto it = nodes_.find(old_node.id());
+  if (it == nodes_.end()) { nodes_mu_.unlock(); return; }
+  if (old_node.role() == Node::WORKER) -- num_workers_;
+  if (old_node.role() == Node::SERVER) -- num_servers_;
+  -- num_active_nodes_;
+  nodes_.erase(it);
+  nodes_[new_node.id()] = new_node;
+  nodes_mu_.unlock();
+  nodes_cond_.notify_all();
+  if (old_node.id() != new_node.id()) {
+    Postoffice::instance().RemoveReceiver(old_node.id());
+  }
+
+  // update my key range
+  if (new_node.id() == van_->my_node().id()) CHECK(van_->Connect(new_node));
+
+  for (auto& it : customers_) {
+    it.second.first->executor()->ReplaceNode(old_node, new_node);
+  }
+
+  // broadcast
+  if (IsScheduler()) {
+    Task replace = NewControlTask(Control::REPLACE_NODE);
+    *replace.mutable_ctrl()->add_node() = old_node;
+    *replace.mutable_ctrl()->add_node() = new_node;
+    std::vector<Node> others;
+    {
+      Lock l(nodes_mu_);
+      for (const auto& it : nodes_) {
+        if (it.first != van_->my_node().id()) others.push_back(it.second);
+      }
+    }
+    for (const auto& node : others) SendTask(node, replace);
+  }
+  LOG(INFO) << new_node.id() << " takes over the key range of "
+            << old_node.id() << ", now " << new_node.key().ShortDebugString();
+}
+
+bool Manager::FindReplacement(const NodeID& node_id, Node* old_node,
+                              Node* new_node) {
+  if (FLAGS_num_replicas <= 0) return false;
+  Lock l(nodes_mu_);
+  auto it = nodes_.find(node_id);
+  if (it == nodes_.end() || it->second.role() != Node::SERVER) return false;
+  *old_node = it->second;
+
+  // the servers ordered by key ranges
+  std::vector<Node> servers;
+  for (const auto& it : nodes_) {
+    if (it.second.role() == Node::SERVER) servers.push_back(it.second);
+  }
+  std::sort(servers.begin(), servers.end(), [](const Node& a, const Node& b) {
+      return a.key().begin() < b.key().begin(); });
+  int rank = 0;
+  while (servers[rank].id() != node_id) ++ rank;
+
+  // the first replica is next to it, so it can extend its key range
+  auto replicas = Executor::ReplicaRanks(
+      rank, servers.size(), FLAGS_num_replicas);
+  if (replicas.empty()) return false;
+  *new_node = servers[replicas[0]];
+  Range<Key> a(old_node->key()), b(new_node->key());
+  a.SetUnion(b).To(new_node->mutable_key());
+  return true;
+}
+
 void Manager::NodeDisconnected(const NodeID node_id) {
   // alreay in shutting down?
   if (in_exit_) return;
@@ -256,14 +778,26 @@ void Manager::NodeDisconnected(const NodeID node_id) {
 
   if (IsScheduler()) {
     LOG(INFO) << node_id << " is disconnected";
-    RemoveNode(node_id);
+    // a dead server is replaced by its replica if possible
+    Node old_node, new_node;
+    if (FindReplacement(node_id, &old_node, &new_node)) {
+      ReplaceNode(old_node, new_node);
+    } else {
+      RemoveNode(node_id);
+    }
+  } else if (node_id != van_->scheduler().id()) {
+    // the scheduler will tell us how to handle it
+    return;
   } else {
-    // sleep a while, in case this node is already in terminating
-    for (int i = 0; i < 1000; ++i) {
-      usleep(1000);
-      if (done_) return;
+    // wait a while, in case this node is already in terminating
+    {
+      std::unique_lock<std::mutex> lk(nodes_mu_);
+      if (nodes_cond_.wait_for(lk, std::chrono::seconds(1),
+                               [this] { return done_; })) {
+        return;
+      }
     }
-    LOG(ERROR) << van_.my_node().id() << ": the scheduler is died, killing myself";
+    LOG(ERROR) << van_->my_node().id() << ": the scheduler is died, killing myself";
     string kill = "kill -9 " + std::to_string(getpid());
     system(kill.c_str());
   }
@@ -273,8 +807,8 @@ Task Manager::NewControlTask(Control::Command cmd) {
   Task task;
   task.set_control(true);
   task.set_request(true);
-  task.set_time(IsScheduler() ? time_ * 2 : time_ * 2 + 1);
-  ++ time_;
+  int t = time_ ++;
+  task.set_time(IsScheduler() ? t * 2 : t * 2 + 1);
   task.mutable_ctrl()->set_cmd(cmd);
   return task;
 }
@@ -292,14 +826,185 @@ void Manager::CreateApp(const string& conf) {
 }
 
 void Manager::WaitServersReady() {
-  while (num_servers_ < FLAGS_num_servers) {
-    usleep(500);
-  }
+  std::unique_lock<std::mutex> lk(nodes_mu_);
+  nodes_cond_.wait(lk, [this] { return num_servers_ >= FLAGS_num_servers; });
 }
 void Manager::WaitWorkersReady() {
-  while (num_workers_ < FLAGS_num_workers) {
-    usleep(500);
+  std::unique_lock<std::mutex> lk(nodes_mu_);
+  nodes_cond_.wait(lk, [this] { return num_workers_ >= FLAGS_num_workers; });
+}
+
+// reliable delivery
+void Manager::AddRequest(Message* msg) {
+  if (FLAGS_resend_timeout <= 0 || msg->task.control()) {
+    delete msg; return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  Lock l(resend_mu_);
+  auto& req = pending_reqs_[ToKey(msg->recver, msg->task)];
+  if (req.finished) {
+    // the response arrived before
+    if (req.num_resent) {
+      resent_latency_ += std::chrono::duration<double>(
+          now - req.first_sent).count();
+    }
+    pending_reqs_.erase(ToKey(msg->recver, msg->task));
+    delete msg;
+    return;
+  }
+  if (!req.msg) {
+    req.msg = msg;
+    req.first_sent = now;
+    ++ num_reqs_;
+  }
+  CHECK_EQ(req.msg, msg);
+  req.last_sent = now;
+  req.queued = false;
+}
+
+void Manager::AddResponse(Message* msg) {
+  if (FLAGS_resend_timeout <= 0 || msg->task.control()) return;
+  auto key = ToKey(msg->sender, msg->task);
+  Lock l(resend_mu_);
+  auto it = pending_reqs_.find(key);
+  if (it == pending_reqs_.end()) {
+    // it may arrive before AddRequest is called, or be duplicated. the
+    // latter is removed by ResendLoop later
+    auto& req = pending_reqs_[key];
+    req.finished = true;
+    req.first_sent = std::chrono::steady_clock::now();
+    return;
+  }
+  auto& req = it->second;
+  if (req.finished) return;
+  req.finished = true;
+  if (req.queued) return;  // will be deleted by AddRequest
+  if (req.num_resent) {
+    resent_latency_ += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - req.first_sent).count();
   }
+  delete req.msg;
+  pending_reqs_.erase(it);
+}
+
+void Manager::AddReply(Message* msg) {
+  if (FLAGS_resend_timeout <= 0 || FLAGS_reply_cache_mb <= 0 ||
+      msg->task.control() || !msg->task.has_customer_id()) {
+    delete msg; return;
+  }
+  auto key = ToKey(msg->recver, msg->task);
+  Lock l(resend_mu_);
+  auto& reply = replies_[key];
+  if (reply) {
+    // it is a resent reply
+    delete msg;
+    return;
+  }
+  reply = msg;
+  reply_order_.push_back(key);
+  reply_bytes_ += msg->mem_size();
+  size_t max_bytes = (size_t)FLAGS_reply_cache_mb << 20;
+  while (reply_bytes_ > max_bytes && reply_order_.size() > 1) {
+    auto it = replies_.find(reply_order_.front());
+    reply_bytes_ -= it->second->mem_size();
+    delete it->second;
+    replies_.erase(it);
+    reply_order_.pop_front();
+  }
+}
+
+bool Manager::ResendReply(const Message& request) {
+  Message* msg;
+  {
+    Lock l(resend_mu_);
+    auto it = replies_.find(ToKey(request.sender, request.task));
+    if (it == replies_.end()) return false;
+    msg = new Message(*it->second);
+    ++ num_resent_replies_;
+  }
+  Postoffice::instance().Queue(msg);
+  return true;
+}
+
+void Manager::ResendLoop() {
+  auto timeout = std::chrono::milliseconds(FLAGS_resend_timeout);
+  std::unique_lock<std::mutex> lk(resend_mu_);
+  while (!resend_done_) {
+    resend_cond_.wait_for(lk, timeout / 2);
+    if (resend_done_) break;
+
+    std::vector<Message*> resend, failed;
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = pending_reqs_.begin(); it != pending_reqs_.end(); ) {
+      auto& req = it->second;
+      if (!req.msg) {
+        // a duplicated response
+        if (now - req.first_sent > timeout * 10) {
+          it = pending_reqs_.erase(it);
+          continue;
+        }
+      } else if (!req.queued && !req.finished && now - req.last_sent >
+                 timeout * (1 << std::min(req.num_resent, 6))) {
+        nodes_mu_.lock();
+        bool alive = nodes_.find(req.msg->recver) != nodes_.end();
+        nodes_mu_.unlock();
+        if (!alive) {
+          // the executor will handle the dead node
+          delete req.msg;
+          it = pending_reqs_.erase(it);
+          continue;
+        }
+        if (req.num_resent >= FLAGS_resend_max_retries) {
+          // give up, finish it in the executor by an invalid response
+          LOG(WARNING) << van_->my_node().id() << ": no response from "
+                       << req.msg->recver << " after " << req.num_resent
+                       << " retries: " << req.msg->ShortDebugString();
+          Message* res = new Message();
+          res->task.set_request(false);
+          res->task.set_customer_id(req.msg->task.customer_id());
+          res->task.set_time(req.msg->task.time());
+          res->sender = req.msg->recver;
+          res->recver = van_->my_node().id();
+          res->valid = false;
+          failed.push_back(res);
+          ++ num_failed_;
+          delete req.msg;
+          it = pending_reqs_.erase(it);
+          continue;
+        }
+        if (req.num_resent == 0) ++ num_resent_reqs_;
+        ++ req.num_resent;
+        ++ num_resent_;
+        req.queued = true;
+        resend.push_back(req.msg);
+      }
+      ++ it;
+    }
+
+    if (resend.empty() && failed.empty()) continue;
+    VLOG(1) << "resend " << resend.size() << " requests";
+    lk.unlock();
+    for (auto msg : resend) Postoffice::instance().Queue(msg);
+    for (auto msg : failed) {
+      auto obj = customer(msg->task.customer_id());
+      if (obj) {
+        obj->executor()->Accept(msg);
+      } else {
+        delete msg;
+      }
+    }
+    lk.lock();
+  }
+}
+
+void Manager::ResendStatistic() {
+  Lock l(resend_mu_);
+  LOG(INFO) << van_->my_node().id() << " sent " << num_reqs_
+            << " requests, resent " << num_resent_reqs_ << " of them "
+            << num_resent_ << " times, average latency of the resent requests "
+            << (num_resent_reqs_ ? resent_latency_ / num_resent_reqs_ : 0)
+            << " sec, resent " << num_resent_replies_ << " replies, gave up "
+            << num_failed_ << " requests";
 }
 
 // customers
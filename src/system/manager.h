@@ -21,8 +21,38 @@ class Manager {
   bool Process(Message* msg);
 
   // manage nodes
+  // adds a node into this node. see AddNewNodes for the scheduler
   void AddNode(const Node& node);
   void RemoveNode(const NodeID& node_id);
+  // "new_node" takes over the key range of the dead server "old_node"
+  void ReplaceNode(const Node& old_node, const Node& new_node);
+  // adds or updates "nodes" at once
+  void UpdateNodes(const std::vector<Node>& nodes);
+
+  // -- elastic servers --
+  // a server registered after the first -num_servers ones splits the largest
+  // key range. the data are moved by Customer::MigrateKeys while requests keep
+  // flowing, and then all nodes learn the new key ranges at once. the old
+  // owner forwards the requests on the moved range until all nodes have
+  // replied, and then drops its copy. see NodeAssigner::Split
+
+  // merges the key range of server "node_id" into its neighbor. the server
+  // then has no keys but keeps running until the system stops. only
+  // available at the scheduler
+  void RemoveServer(const NodeID& node_id);
+
+  // -- load-aware partition, see -key_partition --
+  // returns true if the key range is partitioned by the sampled keys
+  bool balance_key_ranges();
+  // samples "keys" by -key_sample_rate, appends them into "sample"
+  void SampleKeys(const SArray<Key>& keys, NodeAssigner::KeySample* sample);
+  // every worker calls it with its sampled keys before any key is pushed to
+  // servers, e.g. during preprocessing. the scheduler then partitions the key
+  // range by the samples of all workers and updates the servers. blocks until
+  // the key ranges are updated. no data are moved, so a server fails if it
+  // has received keys then. only the BCD learners call it now
+  void BalanceKeyRanges(const NodeAssigner::KeySample& sample);
+
   // detect that *node_id* is disconnected
   void NodeDisconnected(const NodeID node_id);
   // add a function handler which will be called in *nodeDisconnected*
@@ -44,16 +74,30 @@ class Manager {
   int num_workers() { return num_workers_; }
   int num_servers() { return num_servers_; }
 
-  // manage message TODO
-  void AddRequest(Message* msg) { delete msg; }
-  void AddResponse(Message* msg) { }
+  // -- reliable delivery --
+  // a request is resent if its response is not received in -resend_timeout
+  // ms, and the receiver replies a duplicated request by the cached reply.
+  // after -resend_max_retries, the request is finished by an invalid response
+  // without data. control messages are not included
+
+  // takes the ownership of a sent request
+  void AddRequest(Message* msg);
+  // the response of a request is received
+  void AddResponse(Message* msg);
+  // takes the ownership of a sent reply
+  void AddReply(Message* msg);
+  // sends the cached reply again for a duplicated request. returns false if
+  // the reply is not cached
+  bool ResendReply(const Message& request);
+  // the number of resent requests
+  size_t num_resent() { Lock l(resend_mu_); return num_resent_; }
 
   // accessors
-  Van& van() { return van_; }
+  Van& van() { return *van_; }
   App* app() { return app_; }
 
  private:
-  bool IsScheduler() { return van_.my_node().role() == Node::SCHEDULER; }
+  bool IsScheduler() { return van_->my_node().role() == Node::SCHEDULER; }
   Task NewControlTask(Control::Command cmd);
   void SendTask(const NodeID& recver, const Task& task);
   void SendTask(const Node& recver, const Task& task) {
@@ -69,12 +113,55 @@ class Manager {
   // nodes
   std::map<NodeID, Node> nodes_;
   std::mutex nodes_mu_;
+  // notified when the following node states or done_ change
+  std::condition_variable nodes_cond_;
   int num_workers_ = 0;
   int num_servers_ = 0;
   int num_active_nodes_ = 0;
   std::vector<NodeFailureHandler> node_failure_handlers_;
   bool is_my_node_inited_ = false;
 
+  // the scheduler moves keys between two servers at a time. <the server, true
+  // if removing it, otherwise adding it>
+  void StartMigration();
+  void FinishMigration(const Node& from, const Node& to);
+  // "node" replied the UPDATE_NODE of the move from "from" to "to"
+  void AckMigration(const NodeID& node, const NodeID& from, const NodeID& to);
+  std::deque<std::pair<Node, bool>> migrations_;
+  bool migrating_ = false;
+  // <from, to> of the last move, and the nodes not replied its UPDATE_NODE
+  std::pair<NodeID, NodeID> migrated_;
+  std::set<NodeID> update_acks_;
+  std::mutex migrate_mu_;
+  // a server moves the keys out of "from" to server "to", where "from" is
+  // itself after moving
+  void MoveKeys(const Node& from, const Node& to);
+  // the key ranges moved out of this server, dropped by DROP_KEYS
+  std::vector<Range<Key>> moved_ranges_;
+
+  // the sampled keys received by the scheduler, and <worker, the timestamp of
+  // its request> to reply after partitioning
+  void AddKeySample(const Message& msg);
+  NodeAssigner::KeySample key_sample_;
+  std::vector<std::pair<NodeID, int64>> key_samplers_;
+  // the number of partitions received by a worker, guarded by nodes_mu_
+  int num_key_partitions_ = 0;
+  // fails if my key range loses keys by "nodes" after a customer received
+  // keys, which are not moved
+  void CheckKeysKept(const std::vector<Node>& nodes);
+
+  // finds the replica taking over the key range of the dead server
+  // "node_id", see -num_replicas. only available at the scheduler node
+  bool FindReplacement(const NodeID& node_id, Node* old_node, Node* new_node);
+
+  // only available at the scheduler node. registered nodes are kept in
+  // new_nodes_ until all nodes are registered (bootstrapped_), and then
+  // AddNewNodes adds them and broadcasts them in batch
+  void AddNewNodes();
+  std::vector<Node> new_nodes_;
+  bool bootstrapped_ = false;
+  std::mutex add_nodes_mu_;
+
   // only available at the scheduler node
   NodeAssigner* node_assigner_ = nullptr;
 
@@ -82,11 +169,46 @@ class Manager {
   // format: <id, <obj_ptr, is_deletable>>
   std::map<int, std::pair<Customer*, bool>> customers_;
 
+  // reliable delivery
+  // <receiver (sender) of the request, customer_id, time>
+  typedef std::tuple<NodeID, int, int64> MsgKey;
+  static MsgKey ToKey(const NodeID& node, const Task& task) {
+    return MsgKey(node, task.customer_id(), task.time());
+  }
+  struct PendingRequest {
+    Message* msg = nullptr;
+    std::chrono::steady_clock::time_point first_sent, last_sent;
+    int num_resent = 0;
+    // true if it is in the sending queue
+    bool queued = false;
+    // true if the response has been received
+    bool finished = false;
+  };
+  void ResendLoop();
+  void ResendStatistic();
+  std::map<MsgKey, PendingRequest> pending_reqs_;
+  // the recent replies
+  std::map<MsgKey, Message*> replies_;
+  std::deque<MsgKey> reply_order_;
+  size_t reply_bytes_ = 0;
+  std::mutex resend_mu_;
+  std::condition_variable resend_cond_;
+  std::unique_ptr<std::thread> resend_thread_;
+  bool resend_done_ = false;
+  size_t num_reqs_ = 0;
+  size_t num_resent_ = 0;
+  size_t num_resent_reqs_ = 0;
+  size_t num_resent_replies_ = 0;
+  size_t num_failed_ = 0;
+  // the total time from the first sending to the response receiving of the
+  // resent requests
+  double resent_latency_ = 0;
+
   bool done_ = false;
   bool in_exit_ = false;
-  int time_ = 0;
+  std::atomic<int> time_{0};
 
-  Van van_;
+  std::unique_ptr<Van> van_;
   Env env_;
 
   DISALLOW_COPY_AND_ASSIGN(Manager);
@@ -49,9 +49,16 @@ struct Message {
   bool finished  = true;   // true if the request associated with this message
                            // has been finished.
   bool valid     = true;   // an invalid message will not be sent, but be marked
-                           // as finished
+                           // as finished. an invalid response only finishes
+                           // the request
   bool terminate = false;  // used to stop the sending thread in Postoffice.
 
+  // timestamps in microseconds for the latency statistics, see Histogram::Now.
+  // 0 means not set
+  uint64 submit_time = 0;  // submitted or replied by the customer
+  uint64 recv_time = 0;    // received by the van
+  uint64 pick_time = 0;    // picked by the executor to process
+
   typedef std::function<void()> Callback;
   Callback callback;       // the callback when the associated request is finished
 
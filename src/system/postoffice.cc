@@ -1,6 +1,7 @@
 #include "system/postoffice.h"
 #include "system/customer.h"
 #include "util/file.h"
+#include "util/resource_usage.h"
 // #include <omp.h>
 
 namespace PS {
@@ -10,16 +11,61 @@ DEFINE_int32(report_interval, 0,
   "in every report_interval seconds. "
   "default: 0; if set to 0, heartbeat is disabled");
 
+DEFINE_int32(num_recv_threads, 1,
+  "the number of threads decoding and processing received messages. "
+  "the scheduler always uses 1");
+
+DEFINE_int32(num_send_threads, 2,
+  "the number of threads sending messages");
+DEFINE_int32(small_msg_size, 4096,
+  "messages with at most these bytes of data are sent before the larger ones");
+
+DEFINE_uint64(max_pending_bytes, 0,
+  "Customer::Submit blocks if more than these bytes of data are waiting to be "
+  "sent to a node. 0 means unlimited. control messages and replies are not "
+  "blocked");
+DEFINE_int32(coalesce_us, 0,
+  "buffer the small data messages to the same node and customer for at most "
+  "this number of microseconds, and then send them as a single message. "
+  "0 disables it");
+DEFINE_int32(coalesce_bytes, 1<<16,
+  "send the buffered small messages once they have these bytes of data");
+
+DEFINE_bool(print_latency, false,
+  "print the latency statistics of messages at exit");
+
 DECLARE_string(interface);
 
+// the bytes of data sent with a message
+static size_t DataSize(const Message& msg) {
+  size_t size = msg.key.size();
+  for (const auto& v : msg.value) size += v.size();
+  return size;
+}
+
+// the data of coalesced messages are 8-byte aligned
+static size_t Align(size_t size) { return (size + 7) & ~(size_t)7; }
+
 Postoffice::Postoffice() { }
 
 Postoffice::~Postoffice() {
   if (recv_thread_) recv_thread_->join();
-  if (send_thread_) {
-    Message* stop = new Message(); stop->terminate = true; Queue(stop);
-    send_thread_->join();
+  if (flush_thread_) {
+    {
+      Lock l(batch_mu_);
+      flush_done_ = true;
+      batch_cond_.notify_all();
+    }
+    flush_thread_->join();
+  }
+  {
+    Lock l(send_mu_);
+    send_done_ = true;
+    send_cond_.notify_all();
+    send_room_cond_.notify_all();
   }
+  for (auto& t : send_threads_) t.join();
+  SendStatistic();
 }
 
 void Postoffice::Run(int* argc, char*** argv) {
@@ -35,34 +81,166 @@ void Postoffice::Run(int* argc, char*** argv) {
   // start the I/O threads
   recv_thread_ =
       std::unique_ptr<std::thread>(new std::thread(&Postoffice::Recv, this));
-  send_thread_ =
-      std::unique_ptr<std::thread>(new std::thread(&Postoffice::Send, this));
+  if (FLAGS_coalesce_us > 0) {
+    flush_thread_ = std::unique_ptr<std::thread>(
+        new std::thread(&Postoffice::FlushLoop, this));
+  }
+  CHECK_GT(FLAGS_num_send_threads, 0);
+  for (int i = 0; i < FLAGS_num_send_threads; ++i) {
+    send_threads_.push_back(std::thread(&Postoffice::Send, this));
+  }
 
   manager_.Run();
 }
 
 void Postoffice::Send() {
-  Message* msg;
   while (true) {
-    sending_queue_.wait_and_pop(msg);
-    if (msg->terminate) break;
+    // take a message from the first ready queue
+    Message* msg;
+    NodeID id;
+    SendQueue* queue;
+    {
+      std::unique_lock<std::mutex> lk(send_mu_);
+      send_cond_.wait(lk, [this] {
+          return send_done_ || !urgent_ready_.empty() || !bulk_ready_.empty();
+        });
+      auto& ready = urgent_ready_.empty() ? bulk_ready_ : urgent_ready_;
+      if (ready.empty()) break;  // done, and all messages are sent
+      id = ready.front(); ready.pop_front();
+      queue = &send_queues_[id];
+      queue->ready = SendQueue::kNone;
+      auto& q = queue->ctrl.empty() ? queue->data : queue->ctrl;
+      msg = q.front(); q.pop_front();
+      queue->busy = true;
+      queue->bytes -= DataSize(*msg);
+      if (send_room_waiters_) send_room_cond_.notify_all();
+    }
+
+    queue->queue_time.AddSince(msg->submit_time);
     size_t send_bytes = 0;
     manager_.van().Send(msg, &send_bytes);
     if (FLAGS_report_interval > 0) {
       perf_monitor_.increaseOutBytes(send_bytes);
     }
-    if (msg->task.request()) {
-      // a request "msg" is safe to be deleted only if the response is received
-      manager_.AddRequest(msg);
-    } else {
-      delete msg;
+    Sent(msg);
+
+    // put the queue back
+    Lock l(send_mu_);
+    queue->busy = false;
+    ++ queue->num_sent;
+    Ready(id, queue);
+  }
+}
+
+void Postoffice::Sent(Message* msg) {
+  if (msg->task.request()) {
+    // a request "msg" is safe to be deleted only if the response is received
+    manager_.AddRequest(msg);
+  } else {
+    manager_.AddReply(msg);
+  }
+}
+
+void Postoffice::Enqueue(Message* msg) {
+  Lock l(send_mu_);
+  auto& queue = send_queues_[msg->recver];
+  if (msg->task.control()) {
+    queue.ctrl.push_back(msg);
+  } else {
+    queue.data.push_back(msg);
+  }
+  queue.bytes += DataSize(*msg);
+  queue.max_depth = std::max(queue.max_depth, queue.depth());
+  queue.max_bytes = std::max(queue.max_bytes, queue.bytes);
+  Ready(msg->recver, &queue);
+}
+
+void Postoffice::Ready(const NodeID& id, SendQueue* queue) {
+  if (queue->busy || queue->depth() == 0) return;
+  bool urgent = !queue->ctrl.empty() ||
+                DataSize(*queue->data.front()) <= FLAGS_small_msg_size;
+  if (queue->ready == SendQueue::kUrgent) return;
+  if (queue->ready == SendQueue::kBulk) {
+    if (!urgent) return;
+    bulk_ready_.erase(std::find(bulk_ready_.begin(), bulk_ready_.end(), id));
+  }
+  if (urgent) {
+    urgent_ready_.push_back(id);
+    queue->ready = SendQueue::kUrgent;
+  } else {
+    bulk_ready_.push_back(id);
+    queue->ready = SendQueue::kBulk;
+  }
+  send_cond_.notify_one();
+}
+
+bool Postoffice::WaitSendQueue(const std::vector<NodeID>& recvers, bool block) {
+  if (FLAGS_max_pending_bytes == 0) return true;
+  std::unique_lock<std::mutex> lk(send_mu_);
+  SendQueue* full = nullptr;
+  auto has_room = [this, &recvers, &full]() {
+    for (const auto& id : recvers) {
+      if (dead_recvers_.count(id)) continue;
+      auto it = send_queues_.find(id);
+      if (it != send_queues_.end() &&
+          it->second.bytes >= FLAGS_max_pending_bytes) {
+        full = &it->second;
+        return false;
+      }
     }
+    return true;
+  };
+  if (has_room()) return true;
+  ++ full->num_blocked;
+  if (!block) return false;
+
+  auto tv = hwtic();
+  ++ send_room_waiters_;
+  send_room_cond_.wait(lk, [this, &has_room] {
+      return send_done_ || has_room();
+    });
+  -- send_room_waiters_;
+  send_blocked_time_ += hwtoc(tv);
+  return true;
+}
+
+void Postoffice::RemoveReceiver(const NodeID& id) {
+  Lock l(send_mu_);
+  dead_recvers_.insert(id);
+  if (send_room_waiters_) send_room_cond_.notify_all();
+}
+
+string Postoffice::LatencyReport() {
+  std::stringstream ss;
+  Lock l(send_mu_);
+  for (const auto& it : send_queues_) {
+    ss << "  " << it.first << ": " << it.second.queue_time.ToString() << "\n";
+  }
+  return ss.str();
+}
+
+void Postoffice::SendStatistic() {
+  for (const auto& it : send_queues_) {
+    const auto& q = it.second;
+    VLOG(1) << "sending queue to " << it.first << ": sent " << q.num_sent
+            << " messages, max depth " << q.max_depth
+            << ", max pending " << q.max_bytes << " bytes, blocked "
+            << q.num_blocked << " times";
+  }
+  if (FLAGS_print_latency) {
+    LOG(INFO) << manager_.van().my_node().id()
+              << " sending queue latency (us)\n" << LatencyReport();
+  }
+  if (send_blocked_time_ > 0) {
+    LOG(INFO) << manager_.van().my_node().id() << " blocked "
+              << send_blocked_time_ << " sec for sending queues";
   }
 }
 
 void Postoffice::Queue(Message* msg) {
+  if (Coalesce(msg)) return;
   if (!msg->task.has_more()) {
-    sending_queue_.push(msg);
+    Enqueue(msg);
   } else {
     // do pack
     CHECK(msg->task.request());
@@ -80,39 +258,180 @@ void Postoffice::Queue(Message* msg) {
       for (auto m : value) {
         m->task.clear_more();
         *pack_msg->task.add_task() = m->task;
-        delete m;
+        Sent(m);
       }
       value.clear();
-      sending_queue_.push(pack_msg);
+      Enqueue(pack_msg);
+    }
+  }
+}
+
+bool Postoffice::Coalesce(Message* msg) {
+  if (FLAGS_coalesce_us <= 0 || msg->task.control()) return false;
+  BatchKey key(msg->recver, msg->task.customer_id());
+  bool small = !msg->task.has_more() &&
+               DataSize(*msg) <= (size_t)FLAGS_small_msg_size;
+  Lock l(batch_mu_);
+  auto it = batches_.find(key);
+  if (!small) {
+    // send the buffered ones first to keep the order
+    if (it != batches_.end()) Flush(key, &it->second);
+    return false;
+  }
+  auto& batch = batches_[key];
+  if (batch.msgs.empty()) {
+    batch.deadline = std::chrono::steady_clock::now() +
+                     std::chrono::microseconds(FLAGS_coalesce_us);
+    batch_cond_.notify_one();
+  }
+  batch.msgs.push_back(msg);
+  batch.bytes += Align(msg->key.size());
+  for (const auto& v : msg->value) batch.bytes += Align(v.size());
+  if (batch.bytes >= (size_t)FLAGS_coalesce_bytes) Flush(key, &batch);
+  return true;
+}
+
+void Postoffice::Flush(const BatchKey& key, Batch* batch) {
+  if (batch->msgs.empty()) return;
+  if (batch->msgs.size() == 1) {
+    Enqueue(batch->msgs[0]);
+  } else {
+    Message* pack_msg = new Message();
+    pack_msg->recver = key.first;
+    SArray<char> data(batch->bytes);
+    size_t pos = 0;
+    for (auto m : batch->msgs) {
+      Task* task = pack_msg->task.add_task();
+      *task = m->task;
+      task->set_has_key(!m->key.empty());
+      std::vector<SArray<char>> arrays;
+      if (!m->key.empty()) arrays.push_back(m->key);
+      for (const auto& v : m->value) arrays.push_back(v);
+      for (const auto& a : arrays) {
+        task->add_data_size(a.size());
+        memcpy(data.data() + pos, a.data(), a.size());
+        pos += Align(a.size());
+      }
+      Sent(m);
+    }
+    CHECK_EQ(pos, batch->bytes);
+    if (pos) pack_msg->value.push_back(data);
+    Enqueue(pack_msg);
+  }
+  batch->msgs.clear();
+  batch->bytes = 0;
+}
+
+void Postoffice::FlushLoop() {
+  std::unique_lock<std::mutex> lk(batch_mu_);
+  while (!flush_done_) {
+    auto now = std::chrono::steady_clock::now();
+    auto next = now + std::chrono::seconds(1);
+    for (auto& it : batches_) {
+      auto& batch = it.second;
+      if (batch.msgs.empty()) continue;
+      if (batch.deadline <= now) {
+        Flush(it.first, &batch);
+      } else {
+        next = std::min(next, batch.deadline);
+      }
     }
+    batch_cond_.wait_until(lk, next);
   }
+  for (auto& it : batches_) Flush(it.first, &it.second);
 }
 
 void Postoffice::Recv() {
+  auto& van = manager_.van();
+  int n = FLAGS_num_recv_threads;
+  if (van.my_node().role() == Node::SCHEDULER) n = 1;
+  CHECK_GT(n, 0);
+  if (n > 1) {
+    for (int i = 0; i < n; ++i) {
+      recv_shard_queues_.push_back(std::unique_ptr<ThreadsafeQueue<Message*>>(
+          new ThreadsafeQueue<Message*>()));
+    }
+    for (int i = 0; i < n; ++i) {
+      recv_shard_threads_.push_back(
+          std::thread(&Postoffice::RecvShard, this, i));
+    }
+  }
+  std::hash<NodeID> hash;
+
   while (true) {
     // receive a message
     Message* msg = new Message();
     size_t recv_bytes = 0;
-    CHECK(manager_.van().Recv(msg, &recv_bytes));
+    CHECK(van.Recv(msg, &recv_bytes, false));
     if (FLAGS_report_interval > 0) {
       perf_monitor_.increaseInBytes(recv_bytes);
     }
 
-    if (msg->task.task_size()) {
-      // packed task
-      CHECK(!msg->has_data());
-      for (int i = 0; i < msg->task.task_size(); ++i) {
-        Message* unpack_msg = new Message();
-        unpack_msg->recver = msg->recver;
-        unpack_msg->sender = msg->sender;
-        unpack_msg->task = msg->task.task(i);
-        if (!Process(unpack_msg)) break;
-      }
-      delete msg;
+    // messages from the scheduler are processed by this thread directly, so
+    // control commands such as ADD_NODE are applied before the messages
+    // received after them are dispatched
+    if (n == 1 || msg->sender == van.scheduler().id()) {
+      van.Decode(msg);
+      if (!Dispatch(msg)) break;
     } else {
-      if (!Process(msg)) break;
+      recv_shard_queues_[hash(msg->sender) % n]->push(msg);
+    }
+  }
+
+  // stop the shards
+  for (auto& q : recv_shard_queues_) {
+    Message* stop = new Message(); stop->terminate = true; q->push(stop);
+  }
+  for (auto& t : recv_shard_threads_) t.join();
+}
+
+void Postoffice::RecvShard(int i) {
+  auto& queue = *recv_shard_queues_[i];
+  Message* msg;
+  while (true) {
+    queue.wait_and_pop(msg);
+    if (msg->terminate) break;
+    manager_.van().Decode(msg);
+    Dispatch(msg);
+  }
+  delete msg;
+}
+
+bool Postoffice::Dispatch(Message* msg) {
+  if (msg->task.task_size()) {
+    // packed task. the data of coalesced tasks are in a single value
+    CHECK(msg->key.empty());
+    SArray<char> data;
+    if (!msg->value.empty()) {
+      CHECK_EQ(msg->value.size(), 1);
+      data = msg->value[0];
     }
+    size_t pos = 0;
+    for (int i = 0; i < msg->task.task_size(); ++i) {
+      Message* unpack_msg = new Message();
+      unpack_msg->recver = msg->recver;
+      unpack_msg->sender = msg->sender;
+      unpack_msg->recv_time = msg->recv_time;
+      unpack_msg->task = msg->task.task(i);
+      const Task& task = unpack_msg->task;
+      for (int j = 0; j < task.data_size_size(); ++j) {
+        size_t size = task.data_size(j);
+        SArray<char> a = data.Segment(SizeR(pos, pos + size));
+        if (j == 0 && task.has_key()) {
+          unpack_msg->key = a;
+        } else {
+          unpack_msg->value.push_back(a);
+        }
+        pos += Align(size);
+      }
+      unpack_msg->task.clear_data_size();
+      if (!Process(unpack_msg)) { delete msg; return false; }
+    }
+    CHECK_EQ(pos, data.size());
+    delete msg;
+    return true;
   }
+  return Process(msg);
 }
 
 bool Postoffice::Process(Message* msg) {
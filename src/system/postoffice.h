@@ -4,6 +4,7 @@
 #include "util/threadsafe_queue.h"
 #include "system/manager.h"
 #include "system/heartbeat_info.h"
+#include "util/histogram.h"
 namespace PS {
 
 class Postoffice {
@@ -29,17 +30,95 @@ class Postoffice {
    */
   void Queue(Message* msg);
 
+  /**
+   * @brief Waits until the sending queue of each node in "recvers" has less
+   * than -max_pending_bytes bytes data. It is used by Customer::Submit to
+   * throttle a fast sender.
+   *
+   * @param block if false, returns false immediately if some queue is full
+   * @return true if there is room
+   */
+  bool WaitSendQueue(const std::vector<NodeID>& recvers, bool block);
+
+  /**
+   * @brief Tells WaitSendQueue that node "id" is dead, so its queue, which may
+   * never be drained, is not waited for anymore.
+   */
+  void RemoveReceiver(const NodeID& id);
+
+  /**
+   * @brief Returns the total time in seconds blocked by WaitSendQueue
+   */
+  double send_blocked_time() { Lock l(send_mu_); return send_blocked_time_; }
+
+  /**
+   * @brief Returns the latency statistics in microseconds of the sending
+   * queues, namely the time between submitting and sending a message
+   */
+  string LatencyReport();
+
   Manager& manager() { return manager_; }
   HeartbeatInfo& pm() { return perf_monitor_; }
 
  private:
   Postoffice();
+  // the sending thread
   void Send();
+  // push "msg" into the sending queue of its receiver
+  void Enqueue(Message* msg);
+  // gives "msg" to the manager once it is sent, or packed into another message
+  void Sent(Message* msg);
+  // log the sending queue counters
+  void SendStatistic();
   void Recv();
+  // decodes and processes the messages assigned to the i-th receiving thread
+  void RecvShard(int i);
+  // returns false if it is the terminate signal
+  bool Dispatch(Message* msg);
   bool Process(Message* msg);
   std::unique_ptr<std::thread> recv_thread_;
-  std::unique_ptr<std::thread> send_thread_;
-  ThreadsafeQueue<Message*> sending_queue_;
+  // messages from the same sender always go to the same shard to keep the
+  // order
+  std::vector<std::thread> recv_shard_threads_;
+  std::vector<std::unique_ptr<ThreadsafeQueue<Message*>>> recv_shard_queues_;
+
+  // the sending queue of a receiver. a sending thread takes one message from a
+  // ready queue each time, so a slow receiver does not block the others. at
+  // most one thread sends to a receiver at the same time, so messages to the
+  // same receiver are sent in order, except that control messages go first.
+  struct SendQueue {
+    std::deque<Message*> ctrl;
+    std::deque<Message*> data;
+    // true if a thread is sending a message of this queue
+    bool busy = false;
+    // which ready list it is in
+    enum { kNone, kUrgent, kBulk } ready = kNone;
+    size_t bytes = 0;
+    // counters
+    size_t num_sent = 0;
+    size_t num_blocked = 0;
+    size_t max_depth = 0;
+    size_t max_bytes = 0;
+    Histogram queue_time;
+    size_t depth() const { return ctrl.size() + data.size(); }
+  };
+  // append "id" to a ready list if it is not busy and not empty, or move it
+  // to the urgent list if a control message arrives
+  void Ready(const NodeID& id, SendQueue* queue);
+  std::vector<std::thread> send_threads_;
+  std::unordered_map<NodeID, SendQueue> send_queues_;
+  // receivers whose first message is a control or small message
+  std::deque<NodeID> urgent_ready_;
+  // the rest receivers having messages to send
+  std::deque<NodeID> bulk_ready_;
+  bool send_done_ = false;
+  std::mutex send_mu_;
+  std::condition_variable send_cond_;
+  // for WaitSendQueue
+  std::condition_variable send_room_cond_;
+  int send_room_waiters_ = 0;
+  double send_blocked_time_ = 0;
+  std::unordered_set<NodeID> dead_recvers_;
 
   Manager manager_;
   HeartbeatInfo perf_monitor_;
@@ -48,6 +127,26 @@ class Postoffice {
   std::map<std::pair<NodeID, int>, std::vector<Message*>> pack_;
   std::mutex pack_mu_;
 
+  // small messages to the same <recver, customer_id> are buffered for a while
+  // and then sent as a single message
+  struct Batch {
+    std::vector<Message*> msgs;
+    size_t bytes = 0;
+    std::chrono::steady_clock::time_point deadline;
+  };
+  typedef std::pair<NodeID, int> BatchKey;
+  // returns true if "msg" is buffered
+  bool Coalesce(Message* msg);
+  // sends the buffered messages
+  void Flush(const BatchKey& key, Batch* batch);
+  // flushes the batches reaching the deadline
+  void FlushLoop();
+  std::map<BatchKey, Batch> batches_;
+  bool flush_done_ = false;
+  std::mutex batch_mu_;
+  std::condition_variable batch_cond_;
+  std::unique_ptr<std::thread> flush_thread_;
+
   DISALLOW_COPY_AND_ASSIGN(Postoffice);
 };
 
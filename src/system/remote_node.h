@@ -4,33 +4,13 @@
 #include "system/van.h"
 #include "system/postoffice.h"
 #include "filter/filter.h"
+#include "util/histogram.h"
+#include "system/request_tracker.h"
 namespace PS {
 
 // The presentation of a remote node used by Executor. It's not thread
 // safe, do not use them directly.
 
-// Track a request by its timestamp.
-class RequestTracker {
- public:
-  RequestTracker() { }
-  ~RequestTracker() { }
-
-  // Returns true if timestamp "ts" is marked as finished.
-  bool IsFinished(int ts) {
-    return ts < 0 || (((int)data_.size() > ts) && data_[ts]);
-  }
-
-  // Mark timestamp "ts" as finished.
-  void Finish(int ts) {
-    CHECK_GE(ts, 0);
-    CHECK_LT(ts, 1000000);
-    if ((int)data_.size() <= ts) data_.resize(ts*2+5);
-    data_[ts] = true;
-  }
- private:
-  std::vector<bool> data_;
-};
-
 // A remote node
 struct RemoteNode {
  public:
@@ -48,6 +28,9 @@ struct RemoteNode {
   // timestamp tracker
   RequestTracker sent_req_tracker;
   RequestTracker recv_req_tracker;
+  // the received requests which are picked but not finished yet, e.g. being
+  // processed or deferred by the application. a resent one of them is dropped
+  std::unordered_set<int64> unfinished_reqs;
 
   // node group info. if "node" is a node group, then "group" contains all node
   // pointer in this group. otherwise, group contains "this"
@@ -57,6 +40,11 @@ struct RemoteNode {
   // keys[i] is the key range of group[i]
   std::vector<Range<Key>> keys;
 
+  // latencies of the requests sent to this node. rtt: from submitting to
+  // receiving the response. network: rtt minus the time spent at this node
+  Histogram rtt;
+  Histogram network;
+
  private:
   Filter* FindFilterOrCreate(const FilterConfig& conf);
   // key: filter_type
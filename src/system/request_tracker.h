@@ -0,0 +1,104 @@
+#pragma once
+#include "util/common.h"
+namespace PS {
+
+/**
+ * @brief Tracks the finished requests by their timestamps.
+ *
+ * All timestamps below the low watermark are finished, and only a sliding
+ * window of bits above it is kept, so the memory does not grow with the number
+ * of requests. If the window would exceed "max_window", e.g. a timestamp is
+ * skipped and never finished, the watermark is moved forward and the skipped
+ * ones are considered as finished. Finish tells when it happens, so the caller
+ * can check if a request it is still waiting for is dropped. Not thread safe.
+ */
+class RequestTracker {
+ public:
+  explicit RequestTracker(int64 max_window = 1 << 20)
+      : max_window_(max_window) {
+    CHECK_GT(max_window, 0);
+  }
+  ~RequestTracker() { }
+
+  // Returns true if timestamp "ts" is marked as finished.
+  bool IsFinished(int64 ts) const {
+    if (ts < low_) return true;
+    if (ts >= high_) return false;
+    return Get(ts);
+  }
+
+  // Mark timestamp "ts" as finished. Returns true if some unfinished
+  // timestamps are dropped out of the window, namely they are below the
+  // watermark now.
+  bool Finish(int64 ts) {
+    CHECK_GE(ts, 0);
+    if (ts < low_) return false;
+    bool dropped = false;
+    if (ts - low_ >= max_window_) {
+      MoveWatermark(ts - max_window_ + 1);
+      dropped = true;
+    }
+    Reserve(ts - low_ + 1);
+    Set(ts, true);
+    if (ts >= high_) high_ = ts + 1;
+    // move the watermark over the finished ones
+    while (low_ < high_ && Get(low_)) {
+      Set(low_, false);
+      ++ low_;
+    }
+    return dropped;
+  }
+
+  // All timestamps below it are finished
+  int64 watermark() const { return low_; }
+
+  int64 max_window() const { return max_window_; }
+
+  // The number of bits allocated
+  size_t capacity() const { return bits_.size() * 64; }
+
+ private:
+  bool Get(int64 ts) const {
+    uint64 i = ts & mask_;
+    return (bits_[i >> 6] >> (i & 63)) & 1;
+  }
+  void Set(int64 ts, bool v) {
+    uint64 i = ts & mask_;
+    if (v) {
+      bits_[i >> 6] |= (uint64)1 << (i & 63);
+    } else {
+      bits_[i >> 6] &= ~((uint64)1 << (i & 63));
+    }
+  }
+
+  // moves the watermark to "low", clears the bits below it
+  void MoveWatermark(int64 low) {
+    for (int64 t = low_; t < std::min(low, high_); ++t) Set(t, false);
+    low_ = low;
+    if (high_ < low_) high_ = low_;
+  }
+
+  // makes the window hold at least n bits
+  void Reserve(int64 n) {
+    if (n <= (int64)capacity()) return;
+    size_t cap = 64;
+    while ((int64)cap < n) cap *= 2;
+    std::vector<uint64> old(cap / 64, 0);
+    old.swap(bits_);
+    uint64 old_mask = mask_;
+    mask_ = cap - 1;
+    for (int64 t = low_; t < high_; ++t) {
+      uint64 i = t & old_mask;
+      if ((old[i >> 6] >> (i & 63)) & 1) Set(t, true);
+    }
+  }
+
+  int64 max_window_;
+  // the window [low_, high_), bit "ts & mask_" is for timestamp ts
+  int64 low_ = 0;
+  int64 high_ = 0;
+  std::vector<uint64> bits_;
+  uint64 mask_ = 0;
+};
+
+} // namespace PS
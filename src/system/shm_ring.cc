@@ -0,0 +1,150 @@
+#include "system/shm_ring.h"
+#include "util/shared_array_inl.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+namespace PS {
+
+std::shared_ptr<ShmRing> ShmRing::Create(const string& name, size_t size) {
+  size = size / kAlign * kAlign + sizeof(Header);
+  shm_unlink(name.c_str());  // remove the one left by a previous run
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd == -1) {
+    LOG(WARNING) << "failed to create shared memory " << name
+                 << ": " << strerror(errno);
+    return nullptr;
+  }
+  // allocate the pages now, otherwise we will get SIGBUS later if /dev/shm is
+  // smaller than "size"
+  int ret = posix_fallocate(fd, 0, size);
+  if (ret != 0) {
+    LOG(WARNING) << "failed to allocate " << size << " bytes for " << name
+                 << ": " << strerror(ret);
+    close(fd);
+    shm_unlink(name.c_str());
+    return nullptr;
+  }
+  std::shared_ptr<ShmRing> ring(new ShmRing());
+  ring->name_ = name;
+  ring->writer_ = true;
+  bool mapped = ring->Map(fd, size);
+  close(fd);
+  if (!mapped) return nullptr;
+  ring->header_->tail.store(0);
+  VLOG(1) << "created shared memory " << name << " with "
+          << ring->capacity_ << " bytes";
+  return ring;
+}
+
+std::shared_ptr<ShmRing> ShmRing::Open(const string& name) {
+  int fd = shm_open(name.c_str(), O_RDWR, 0600);
+  if (fd == -1) {
+    LOG(WARNING) << "failed to open shared memory " << name
+                 << ": " << strerror(errno);
+    return nullptr;
+  }
+  shm_unlink(name.c_str());
+  struct stat st;
+  CHECK_EQ(fstat(fd, &st), 0) << strerror(errno);
+  std::shared_ptr<ShmRing> ring(new ShmRing());
+  ring->name_ = name;
+  bool mapped = ring->Map(fd, st.st_size);
+  close(fd);
+  if (!mapped) return nullptr;
+  VLOG(1) << "opened shared memory " << name;
+  return ring;
+}
+
+bool ShmRing::Map(int fd, size_t size) {
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    LOG(WARNING) << "failed to mmap " << name_ << ": " << strerror(errno);
+    return false;
+  }
+  base_ = (char*)p;
+  size_ = size;
+  header_ = reinterpret_cast<Header*>(base_);
+  data_ = base_ + sizeof(Header);
+  capacity_ = size - sizeof(Header);
+  return true;
+}
+
+ShmRing::~ShmRing() {
+  if (base_) munmap(base_, size_);
+  // no-op if the reader has already unlinked it
+  if (writer_) shm_unlink(name_.c_str());
+}
+
+bool ShmRing::Write(const std::vector<SArray<char>>& data,
+                    std::vector<uint64>* pos) {
+  CHECK(writer_);
+  uint64 tail = header_->tail.load(std::memory_order_acquire);
+  uint64 p = write_pos_;
+  pos->clear();
+  for (const auto& d : data) {
+    size_t len = (sizeof(Record) + d.size() + kAlign - 1) / kAlign * kAlign;
+    // a too large array will stall the ring
+    if (len > capacity_ / 2) return false;
+    // the record cannot cross the end of the ring, fill the rest with a
+    // padding record
+    size_t offset = p % capacity_;
+    size_t pad = offset + len > capacity_ ? capacity_ - offset : 0;
+    if (p + pad + len - tail > capacity_) return false;
+    if (pad) {
+      Record* r = At(p);
+      r->len = pad; r->size = 0; r->freed = 1;
+      p += pad;
+    }
+    Record* r = At(p);
+    r->len = len; r->size = d.size(); r->freed = 0;
+    memcpy(r + 1, d.data(), d.size());
+    pos->push_back(p);
+    p += len;
+  }
+  // nothing is visible to the reader until the positions are sent, so
+  // returning false above does not need to rollback anything
+  last_write_pos_ = write_pos_;
+  write_pos_ = p;
+  return true;
+}
+
+void ShmRing::Unwrite() {
+  CHECK(writer_);
+  // the reader has not seen these records, so they are simply overwritten by
+  // the next Write
+  write_pos_ = last_write_pos_;
+}
+
+SArray<char> ShmRing::Read(uint64 pos) {
+  CHECK(!writer_);
+  Record* r = At(pos);
+  {
+    Lock l(mu_);
+    CHECK_GE(pos, read_pos_);
+    seen_pos_ = std::max(seen_pos_, pos + r->len);
+  }
+  char* buf = reinterpret_cast<char*>(r + 1);
+  SArray<char> data(buf, r->size, false);
+  auto ring = shared_from_this();
+  data.pointer().reset(buf, [ring, pos](char*) { ring->Release(pos); });
+  return data;
+}
+
+void ShmRing::Release(uint64 pos) {
+  Lock l(mu_);
+  At(pos)->freed = 1;
+  // records below seen_pos_ have been read, or are paddings
+  uint64 p = read_pos_;
+  while (p < seen_pos_) {
+    Record* r = At(p);
+    if (!r->freed) break;
+    p += r->len;
+  }
+  if (p != read_pos_) {
+    read_pos_ = p;
+    header_->tail.store(p, std::memory_order_release);
+  }
+}
+
+} // namespace PS
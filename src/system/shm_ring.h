@@ -0,0 +1,103 @@
+#pragma once
+#include <atomic>
+#include "util/common.h"
+#include "util/shared_array.h"
+namespace PS {
+
+/**
+ * @brief A single-producer single-consumer ring buffer placed in POSIX shared
+ * memory, which moves data arrays between two processes on the same machine.
+ *
+ * The writer copies an array into the ring once and passes its position to the
+ * reader through another channel, e.g. a small zmq message. The reader then
+ * gets an SArray pointing into the ring directly, namely zero-copy. The space
+ * is given back to the writer once the last copy of this SArray is deleted, and
+ * arrays can be released in any order.
+ */
+class ShmRing : public std::enable_shared_from_this<ShmRing> {
+ public:
+  /**
+   * @brief Creates the ring "name" with "size" bytes as the writer.
+   *
+   * @return nullptr if failed, e.g. /dev/shm is full
+   */
+  static std::shared_ptr<ShmRing> Create(const string& name, size_t size);
+
+  /**
+   * @brief Opens an existing ring as the reader. The name is unlinked once
+   * opened, so nothing is left in /dev/shm after both sides exit.
+   *
+   * @return nullptr if failed
+   */
+  static std::shared_ptr<ShmRing> Open(const string& name);
+
+  ~ShmRing();
+
+  /**
+   * @brief Copies all arrays in "data" into the ring, and returns their
+   * positions in "pos". It is all or nothing.
+   *
+   * @return false if there is no enough space
+   */
+  bool Write(const std::vector<SArray<char>>& data, std::vector<uint64>* pos);
+
+  /**
+   * @brief Takes back the arrays of the last successful Write, whose positions
+   * are not going to be delivered to the reader, e.g. the sending failed.
+   * Otherwise the reader never releases them, and the ring stalls.
+   */
+  void Unwrite();
+
+  /**
+   * @brief Returns the array at position "pos", zero-copy.
+   */
+  SArray<char> Read(uint64 pos);
+
+  size_t capacity() const { return capacity_; }
+
+ private:
+  ShmRing() { }
+  bool Map(int fd, size_t size);
+  void Release(uint64 pos);
+
+  // the layout of the shared memory: [Header][record][record]...
+  struct Header {
+    // all bytes before it has been released by the reader
+    std::atomic<uint64> tail;
+    char pad[56];
+  };
+  // a record is aligned to kAlign bytes, so is the array after it
+  struct Record {
+    uint64 len;    // bytes occupied, including this header and the padding
+    uint64 size;   // the array size in bytes
+    uint64 freed;  // 1 if it can be reclaimed
+    uint64 reserved;
+  };
+  static const size_t kAlign = sizeof(Record);
+
+  Record* At(uint64 pos) {
+    return reinterpret_cast<Record*>(data_ + pos % capacity_);
+  }
+
+  string name_;
+  bool writer_ = false;
+  char* base_ = nullptr;
+  size_t size_ = 0;
+  Header* header_ = nullptr;
+  char* data_ = nullptr;
+  size_t capacity_ = 0;
+
+  // only used by the writer
+  uint64 write_pos_ = 0;
+  // write_pos_ before the last Write
+  uint64 last_write_pos_ = 0;
+
+  // only used by the reader
+  std::mutex mu_;
+  uint64 read_pos_ = 0;
+  uint64 seen_pos_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(ShmRing);
+};
+
+} // namespace PS
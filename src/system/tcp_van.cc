@@ -0,0 +1,322 @@
+#include "system/tcp_van.h"
+#include <string.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "util/shared_array_inl.h"
+namespace PS {
+
+DECLARE_int32(bind_to);
+DEFINE_int32(tcp_connect_timeout, 10,
+             "timeout in sec for connecting to a node which is not listening");
+
+// the frames in a received message are 8-byte aligned in the buffer
+static size_t Align(size_t size) { return (size + 7) & ~(size_t)7; }
+
+TcpVan::~TcpVan() {
+  for (auto& it : send_fds_) close(it.second);
+  for (auto& it : recv_fds_) close(it.first);
+  if (listen_fd_ != -1) close(listen_fd_);
+  if (epoll_fd_ != -1) close(epoll_fd_);
+}
+
+void TcpVan::Bind() {
+  listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  CHECK_NE(listen_fd_, -1) << strerror(errno);
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  int port = FLAGS_bind_to;
+  if (!port) {
+    CHECK(my_node_.has_port()) << my_node_.ShortDebugString();
+    port = my_node_.port();
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  CHECK(!bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr)))
+      << "bind to port " << port << " failed: " << strerror(errno);
+  CHECK(!listen(listen_fd_, 1024)) << strerror(errno);
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  CHECK_NE(epoll_fd_, -1) << strerror(errno);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd_;
+  CHECK(!epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev))
+      << strerror(errno);
+
+  VLOG(1) << "BIND port " << port;
+}
+
+bool TcpVan::ConnectTo(const Node& node) {
+  NodeID id = node.id();
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  string port = std::to_string(node.port());
+  int ret = getaddrinfo(node.hostname().c_str(), port.c_str(), &hints, &res);
+  if (ret != 0) {
+    LOG(WARNING) << "failed to resolve " << node.hostname() << ": "
+                 << gai_strerror(ret);
+    return false;
+  }
+
+  // unlike zmq, connect fails if the node is not listening yet, e.g. the
+  // scheduler is starting. so retry for a while
+  int fd = -1;
+  for (int i = 0; i < FLAGS_tcp_connect_timeout * 10; ++i) {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    CHECK_NE(fd, -1) << strerror(errno);
+    if (connect(fd, res->ai_addr, res->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -1;
+    usleep(100000);
+  }
+  freeaddrinfo(res);
+  if (fd == -1) {
+    LOG(WARNING) << "connect to " << node.hostname() << ":" << port
+                 << " failed: " << strerror(errno);
+    return false;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  // tell the peer who I am
+  string my_id = my_node_.id();
+  uint64 len = my_id.size();
+  iovec iov[2] = {{&len, sizeof(len)}, {(void*)my_id.data(), len}};
+  if (!SendAll(fd, iov, 2)) {
+    LOG(WARNING) << "failed to send my id to " << id;
+    close(fd);
+    return false;
+  }
+
+  Lock l(send_fds_mu_);
+  send_fds_[id] = fd;
+  VLOG(1) << "CONNECT to " << id << " [" << node.hostname() << ":" << port
+          << "]";
+  return true;
+}
+
+void TcpVan::DisconnectFrom(const NodeID& id) {
+  Lock l(send_fds_mu_);
+  auto it = send_fds_.find(id);
+  if (it == send_fds_.end()) return;
+  close(it->second);
+  send_fds_.erase(it);
+}
+
+bool TcpVan::SendFrames(const NodeID& id, const std::vector<Frame*>& frames,
+                        size_t* send_bytes) {
+  int fd;
+  {
+    Lock l(send_fds_mu_);
+    auto it = send_fds_.find(id);
+    if (it == send_fds_.end()) {
+      LOG(WARNING) << "there is no socket to node " << id;
+      for (auto f : frames) DeleteFrame(f);
+      return false;
+    }
+    fd = it->second;
+  }
+
+  // header: the number of frames, and then the size of each frame
+  size_t n = frames.size();
+  static thread_local std::vector<uint64> header;
+  static thread_local std::vector<iovec> iov;
+  header.resize(n + 1);
+  iov.resize(n + 1);
+  header[0] = n;
+  iov[0].iov_base = header.data();
+  iov[0].iov_len = header.size() * sizeof(uint64);
+  for (size_t i = 0; i < n; ++i) {
+    header[i+1] = frames[i]->size();
+    iov[i+1].iov_base = frames[i]->buf();
+    iov[i+1].iov_len = frames[i]->size();
+    *send_bytes += frames[i]->size();
+  }
+  bool ret = SendAll(fd, iov.data(), iov.size());
+  if (!ret) {
+    LOG(WARNING) << "failed to send message to node [" << id
+                 << "] errno: " << strerror(errno);
+  }
+  for (auto f : frames) DeleteFrame(f);
+  return ret;
+}
+
+bool TcpVan::RecvFrames(NodeID* sender, std::vector<SArray<char>>* frames,
+                        size_t* recv_bytes) {
+  while (true) {
+    if (ready_pos_ >= ready_.size()) {
+      struct epoll_event events[64];
+      int n = epoll_wait(epoll_fd_, events, 64, -1);
+      if (n == -1) {
+        if (errno == EINTR) continue;  // may be interupted by google profiler
+        LOG(WARNING) << "epoll_wait failed: " << strerror(errno);
+        return false;
+      }
+      ready_.resize(n);
+      for (int i = 0; i < n; ++i) ready_[i] = events[i].data.fd;
+      ready_pos_ = 0;
+    }
+    int fd = ready_[ready_pos_++];
+    if (fd == listen_fd_) {
+      Accept();
+      continue;
+    }
+    auto it = recv_fds_.find(fd);
+    if (it == recv_fds_.end()) continue;  // closed
+
+    // read until it would block or a message is complete. the fd is reported
+    // by epoll again if there are more bytes
+    Conn* conn = &it->second;
+    while (true) {
+      int ret = ReadStage(fd, conn);
+      if (ret < 0) { Close(fd); break; }
+      if (ret == 0) break;
+      if (NextStage(conn, recv_bytes)) {
+        *sender = conn->id;
+        frames->swap(conn->frames);
+        conn->frames.clear();
+        return true;
+      }
+    }
+  }
+}
+
+int TcpVan::ReadStage(int fd, Conn* conn) {
+  auto& iov = conn->iov;
+  auto& pos = conn->iov_pos;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  while (true) {
+    while (pos < iov.size() && iov[pos].iov_len == 0) ++ pos;
+    if (pos == iov.size()) return 1;
+    msg.msg_iov = &iov[pos];
+    msg.msg_iovlen = std::min(iov.size() - pos, (size_t)IOV_MAX);
+    ssize_t received = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (received == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      return -1;
+    }
+    if (received == 0) return -1;  // closed by the peer
+    while (pos < iov.size() && (size_t)received >= iov[pos].iov_len) {
+      received -= iov[pos].iov_len; ++ pos;
+    }
+    if (pos < iov.size()) {
+      iov[pos].iov_base = (char*)iov[pos].iov_base + received;
+      iov[pos].iov_len -= received;
+    }
+  }
+}
+
+bool TcpVan::NextStage(Conn* conn, size_t* recv_bytes) {
+  bool done = false;
+  conn->iov.clear();
+  conn->iov_pos = 0;
+  switch (conn->stage) {
+    case Conn::ID_LEN:
+      CHECK_LT(conn->n, 1024);
+      conn->id.resize(conn->n);
+      conn->iov.push_back({&conn->id[0], conn->n});
+      conn->stage = Conn::ID;
+      return false;
+    case Conn::ID:
+      VLOG(1) << "node [" << conn->id << "] is connected";
+      break;
+    case Conn::NUM_FRAMES: {
+      CHECK_GT(conn->n, 0);
+      conn->sizes.resize(conn->n);
+      conn->iov.push_back({conn->sizes.data(), conn->n * sizeof(uint64)});
+      conn->stage = Conn::SIZES;
+      return false;
+    }
+    case Conn::SIZES: {
+      // read all frames into a single buffer
+      size_t total = 0;
+      for (uint64 s : conn->sizes) total += Align(s);
+      SArray<char> buf(total);
+      size_t pos = 0;
+      for (uint64 s : conn->sizes) {
+        conn->iov.push_back({buf.data() + pos, s});
+        conn->frames.push_back(buf.Segment(SizeR(pos, pos + s)));
+        pos += Align(s);
+      }
+      conn->stage = Conn::FRAMES;
+      return false;
+    }
+    case Conn::FRAMES:
+      for (uint64 s : conn->sizes) *recv_bytes += s;
+      done = true;
+      break;
+  }
+  // wait for the next message
+  conn->iov.push_back({&conn->n, sizeof(conn->n)});
+  conn->stage = Conn::NUM_FRAMES;
+  return done;
+}
+
+void TcpVan::Accept() {
+  int fd = accept4(listen_fd_, NULL, NULL, SOCK_CLOEXEC);
+  if (fd == -1) {
+    LOG(WARNING) << "accept failed: " << strerror(errno);
+    return;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  CHECK(!epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev)) << strerror(errno);
+  // the node id is read by RecvFrames as the first stage
+  Conn& conn = recv_fds_[fd];
+  conn.iov.push_back({&conn.n, sizeof(conn.n)});
+  VLOG(1) << "accepted a connection on file descriptor " << fd;
+}
+
+void TcpVan::Close(int fd) {
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+  close(fd);
+  auto it = recv_fds_.find(fd);
+  // the peer is unknown if it is closed before sending its id
+  bool known = it->second.stage > Conn::ID;
+  NodeID id = it->second.id;
+  recv_fds_.erase(it);
+  VLOG(1) << "connection from " << id << " is closed";
+  if (known && (IsScheduler() || id == scheduler_.id())) {
+    // it may block for a while
+    std::thread(&TcpVan::NodeDisconnected, this, id).detach();
+  }
+}
+
+bool TcpVan::SendAll(int fd, iovec* iov, int n) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  while (n > 0) {
+    msg.msg_iov = iov;
+    msg.msg_iovlen = std::min(n, IOV_MAX);
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (sent == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    // skip the sent bytes
+    while (n > 0 && (size_t)sent >= iov->iov_len) {
+      sent -= iov->iov_len; ++iov; --n;
+    }
+    if (n > 0) {
+      iov->iov_base = (char*)iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
+  }
+  return true;
+}
+
+} // namespace PS
@@ -0,0 +1,76 @@
+#pragma once
+#include <sys/uio.h>
+#include "system/van.h"
+namespace PS {
+
+/**
+ * @brief The transport over plain TCP sockets.
+ *
+ * Each node opens a connection to every node it sends to. A message is written
+ * by a single sendmsg call from the frame buffers directly, with a header
+ * containing the frame sizes. The receiving thread watches all incoming
+ * connections by epoll, and reads what is available on a ready connection
+ * without blocking, so a slow sender does not hold up the others. The frames
+ * of a message are read into a single buffer kept with the connection, and the
+ * message is returned once it is complete.
+ */
+class TcpVan : public Van {
+ public:
+  TcpVan() { }
+  virtual ~TcpVan();
+
+ protected:
+  virtual void Bind();
+  virtual bool ConnectTo(const Node& node);
+  virtual void DisconnectFrom(const NodeID& id);
+  virtual bool SendFrames(const NodeID& id, const std::vector<Frame*>& frames,
+                          size_t* send_bytes);
+  virtual bool RecvFrames(NodeID* sender, std::vector<SArray<char>>* frames,
+                          size_t* recv_bytes);
+  // a node is disconnected once its connection to this node is closed, which
+  // is detected by RecvFrames
+  virtual void Monitor() { }
+
+ private:
+  // an incoming connection, which is read in stages: the length of the
+  // peer's node id and the id once connected, then for each message the
+  // number of frames, their sizes and the frames
+  struct Conn {
+    enum Stage { ID_LEN, ID, NUM_FRAMES, SIZES, FRAMES };
+    Stage stage = ID_LEN;
+    NodeID id;
+    uint64 n = 0;
+    std::vector<uint64> sizes;
+    std::vector<SArray<char>> frames;
+    // the bytes still to read in the current stage
+    std::vector<iovec> iov;
+    size_t iov_pos = 0;
+  };
+  // accepts a new connection, the peer sends its node id first
+  void Accept();
+  // closes an incoming connection
+  void Close(int fd);
+  // reads the available bytes of the current stage without blocking. returns
+  // 1 if the stage is done, 0 if more bytes are needed, and -1 if the
+  // connection is closed or failed
+  static int ReadStage(int fd, Conn* conn);
+  // moves to the next stage, returns true if a message is complete
+  static bool NextStage(Conn* conn, size_t* recv_bytes);
+  // sends all bytes in "iov", returns false if failed
+  static bool SendAll(int fd, iovec* iov, int n);
+
+  int listen_fd_ = -1;
+  int epoll_fd_ = -1;
+  // the ready fds returned by the last epoll_wait
+  std::vector<int> ready_;
+  size_t ready_pos_ = 0;
+  // fd => the incoming connection, only used by the receiving thread
+  std::unordered_map<int, Conn> recv_fds_;
+  // the receiver => fd
+  std::unordered_map<NodeID, int> send_fds_;
+  std::mutex send_fds_mu_;
+
+  DISALLOW_COPY_AND_ASSIGN(TcpVan);
+};
+
+} // namespace PS
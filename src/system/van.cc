@@ -1,27 +1,43 @@
 #include "system/van.h"
 #include <string.h>
-#include <zmq.h>
-#include <libgen.h>
 #include "util/shared_array_inl.h"
+#include "util/histogram.h"
 #include "system/manager.h"
 #include "system/postoffice.h"
+#include "system/zmq_van.h"
+#include "system/tcp_van.h"
 namespace PS {
 
+DEFINE_string(van, "zmq", "the transport between nodes: zmq or tcp");
 DEFINE_int32(bind_to, 0, "binding port");
 DEFINE_bool(local, false, "run in local");
+DEFINE_int32(frame_pool_size, 1024, "the max number of frame buffers kept for "
+             "reuse when sending messages. 0 disables the reuse");
+DEFINE_int32(shm_buffer, 0, "the size in MB of the shared memory buffer for "
+             "sending data to a node on the same machine, e.g. 32. the sender "
+             "copies the data into it once, and the receiver reads them in "
+             "place. it is allocated for every pair of nodes on the machine. "
+             "0 disables it");
 
 DECLARE_string(my_node);
 DECLARE_string(scheduler);
 DECLARE_int32(num_workers);
 DECLARE_int32(num_servers);
 
+Van* Van::Create() {
+  if (FLAGS_van == "zmq") return new ZmqVan();
+  if (FLAGS_van == "tcp") return new TcpVan();
+  LOG(FATAL) << "unknown van: " << FLAGS_van;
+  return nullptr;
+}
+
 Van::~Van() {
+  // the transport is closed, so all frames have been returned
   Statistic();
   // LOG(INFO) << num_call_ << " " << send_time_ << " " << recv_time_;
-
-  for (auto& it : senders_) zmq_close(it.second);
-  zmq_close(receiver_);
-  zmq_ctx_destroy(context_);
+  shm_writers_.clear();
+  shm_readers_.clear();
+  for (Frame* f : frame_pool_) delete f;
 }
 
 void Van::Init() {
@@ -29,56 +45,21 @@ void Van::Init() {
   my_node_ = ParseNode(FLAGS_my_node);
   LOG(INFO) << "I'm [" << my_node_.ShortDebugString() << "]";
 
-  context_ = zmq_ctx_new();
-  CHECK(context_ != NULL) << "create 0mq context failed";
-
-  // one need to "sudo ulimit -n 65536" or edit /etc/security/limits.conf
-  zmq_ctx_set(context_, ZMQ_MAX_SOCKETS, 65536);
-  // zmq_ctx_set(context_, ZMQ_IO_THREADS, 4);
-
   Bind();
   // connect(my_node_);
   Connect(scheduler_);
-
-  // setup monitor
-  if (IsScheduler()) {
-    CHECK(!zmq_socket_monitor(receiver_, "inproc://monitor", ZMQ_EVENT_ALL));
-  } else {
-    CHECK(!zmq_socket_monitor(
-        senders_[scheduler_.id()], "inproc://monitor", ZMQ_EVENT_ALL));
-  }
-  monitor_thread_ = new std::thread(&Van::Monitor, this);
-  monitor_thread_->detach();
-}
-
-
-void Van::Bind() {
-  receiver_ = zmq_socket(context_, ZMQ_ROUTER);
-  CHECK(receiver_ != NULL)
-      << "create receiver socket failed: " << zmq_strerror(errno);
-  string addr = "tcp://*:";
-  if (FLAGS_bind_to) {
-    addr += std::to_string(FLAGS_bind_to);
-  } else {
-    CHECK(my_node_.has_port()) << my_node_.ShortDebugString();
-    addr += std::to_string(my_node_.port());
-  }
-  if (FLAGS_local) {
-    addr = "ipc:///tmp/" + my_node_.id();
-  }
-  CHECK(zmq_bind(receiver_, addr.c_str()) == 0)
-      << "bind to " << addr << " failed: " << zmq_strerror(errno);
-
-  VLOG(1) << "BIND address " << addr;
+  Monitor();
 }
 
 void Van::Disconnect(const Node& node) {
   CHECK(node.has_id()) << node.ShortDebugString();
   NodeID id = node.id();
-  if (senders_.find(id) != senders_.end()) {
-    zmq_close (senders_[id]);
+  Lock c(connect_mu_);
+  Lock l(mu_);
+  if (connected_.find(id) != connected_.end()) {
+    DisconnectFrom(id);
   }
-  senders_.erase(id);
+  connected_.erase(id);
   VLOG(1) << "DISCONNECT from " << node.id();
 }
 
@@ -87,47 +68,38 @@ bool Van::Connect(const Node& node) {
   CHECK(node.has_port()) << node.ShortDebugString();
   CHECK(node.has_hostname()) << node.ShortDebugString();
   NodeID id = node.id();
-  if (id == my_node_.id()) {
-    // update my node info
-    my_node_ = node;
-  }
-  if (senders_.find(id) != senders_.end()) {
-    return true;
-  }
-  void *sender = zmq_socket(context_, ZMQ_DEALER);
-  CHECK(sender != NULL) << zmq_strerror(errno);
-  string my_id = my_node_.id(); // address(my_node_);
-  zmq_setsockopt (sender, ZMQ_IDENTITY, my_id.data(), my_id.size());
-
-  // uint64_t hwm = 5000000;
-  // zmq_setsockopt (sender, ZMQ_SNDHWM, &hwm, sizeof(hwm));
-
-  // connect
-  string addr = "tcp://" + node.hostname() + ":" + std::to_string(node.port());
-  if (FLAGS_local) {
-    addr = "ipc:///tmp/" + node.id();
-  }
-  if (zmq_connect(sender, addr.c_str()) != 0) {
-    LOG(WARNING) << "connect to " + addr + " failed: " + zmq_strerror(errno);
-    return false;
+  Lock c(connect_mu_);
+  {
+    Lock l(mu_);
+    if (id == my_node_.id()) {
+      // update my node info
+      my_node_ = node;
+    }
+    if (connected_.find(id) != connected_.end()) {
+      return true;
+    }
   }
-
-  senders_[id] = sender;
+  // it may take a while, e.g. tcp retries until the node is listening, so
+  // mu_ is not held to let Send go on meanwhile
+  if (!ConnectTo(node)) return false;
+  Lock l(mu_);
+  connected_.insert(id);
   hostnames_[id] = node.hostname();
-
-  VLOG(1) << "CONNECT to " << id << " [" << addr << "]";
   return true;
 }
 
 bool Van::Send(Message* msg, size_t* send_bytes) {
   // find the socket
   NodeID id = msg->recver;
-  auto it = senders_.find(id);
-  if (it == senders_.end()) {
-    LOG(WARNING) << "there is no socket to node " + id;
-    return false;
+  bool is_local;
+  {
+    Lock l(mu_);
+    if (connected_.find(id) == connected_.end()) {
+      LOG(WARNING) << "there is no socket to node " + id;
+      return false;
+    }
+    is_local = hostnames_[id] == my_node_.hostname();
   }
-  void *socket = it->second;
 
   // double check
   bool has_key = !msg->key.empty();
@@ -138,50 +110,62 @@ bool Van::Send(Message* msg, size_t* send_bytes) {
   }
   int n = has_key + msg->value.size();
 
-  size_t data_size = 0;
+  // put the data into the shared memory if the receiver is on the same
+  // machine, then only the positions are sent
+  size_t shm_size = 0;
+  std::shared_ptr<ShmRing> shm_ring;
+  msg->task.clear_shm_pos();
+  if (n > 0 && is_local) {
+    auto ring = ShmWriter(id);
+    if (ring) {
+      std::vector<SArray<char>> data;
+      if (has_key) data.push_back(msg->key);
+      for (const auto& v : msg->value) data.push_back(v);
+      std::vector<uint64> pos;
+      if (ring->Write(data, &pos)) {
+        for (uint64 p : pos) msg->task.add_shm_pos(p);
+        for (const auto& d : data) shm_size += d.size();
+        shm_ring = ring;
+        n = 0;
+      }
+    }
+  }
+
   // auto tv = hwtic();
 
-  // send task
+  // the frames are kept by the thread to avoid allocation
+  static thread_local std::vector<Frame*> frames;
+  frames.clear();
+
+  // task
   size_t task_size = msg->task.ByteSize();
-  char* task_buf = new char[task_size+5];
-  CHECK(msg->task.SerializeToArray(task_buf, task_size))
-      << "failed to serialize " << msg->task.ShortDebugString();
-
-  int tag = ZMQ_SNDMORE;
-  if (n == 0) tag = 0; // ZMQ_DONTWAIT;
-  zmq_msg_t task_msg;
-  zmq_msg_init_data(&task_msg, task_buf, task_size, FreeData, NULL);
-
-  while (true) {
-    if (zmq_msg_send(&task_msg, socket, tag) == task_size) break;
-    if (errno == EINTR) continue;  // may be interupted by profiler
-    LOG(WARNING) << "failed to send message to node [" << id
-                 << "] errno: " << zmq_strerror(errno);
-    return false;
-  }
-  data_size += task_size;
+  Frame* task_frame = NewFrame();
+  task_frame->task.resize(task_size);
+  msg->task.SerializeWithCachedSizesToArray((uint8*)task_frame->task.data());
+  frames.push_back(task_frame);
 
-  // send data
+  // data
   for (int i = 0; i < n; ++i) {
-    SArray<char>* data = new SArray<char>(
-        (has_key && i == 0) ? msg->key : msg->value[i-has_key]);
-    zmq_msg_t data_msg;
-    zmq_msg_init_data(&data_msg, data->data(), data->size(), FreeData, data);
-    if (i == n - 1) tag = 0; // ZMQ_DONTWAIT;
-    while (true) {
-      if (zmq_msg_send(&data_msg, socket, tag) == data->size()) break;
-      if (errno == EINTR) continue;  // may be interupted by profiler
-      LOG(WARNING) << "failed to send message to node [" << id
-                   << "] errno: " << zmq_strerror(errno);
-      return false;
-    }
-    data_size += data->size();
+    Frame* frame = NewFrame();
+    frame->data = (has_key && i == 0) ? msg->key : msg->value[i-has_key];
+    frames.push_back(frame);
+  }
+
+  size_t data_size = 0;
+  if (!SendFrames(id, frames, &data_size)) {
+    LOG(WARNING) << "failed to send message to node [" << id << "]";
+    // the positions never reach the receiver, give the space back
+    if (shm_ring) shm_ring->Unwrite();
+    msg->task.clear_shm_pos();
+    return false;
   }
   // send_time_ += hwtoc(tv);
 
   // statistics
+  data_size += shm_size;
+  sent_by_shm_ += shm_size;
   *send_bytes += data_size;
-  if (hostnames_[id] == my_node_.hostname()) {
+  if (is_local) {
     sent_to_local_ += data_size;
   } else {
     sent_to_others_ += data_size;
@@ -190,84 +174,72 @@ bool Van::Send(Message* msg, size_t* send_bytes) {
   return true;
 }
 
-bool Van::Recv(Message* msg, size_t* recv_bytes) {
+bool Van::Recv(Message* msg, size_t* recv_bytes, bool decode) {
   size_t data_size = 0;
   msg->clear_data();
-  for (int i = 0; ; ++i) {
-    zmq_msg_t* zmsg = new zmq_msg_t;
-    CHECK(zmq_msg_init(zmsg) == 0) << zmq_strerror(errno);
-    while (true) {
-      if (zmq_msg_recv(zmsg, receiver_, 0) != -1) break;
-      if (errno == EINTR) continue;  // may be interupted by google profiler
-      LOG(WARNING) << "failed to receive message. errno: "
-                   << zmq_strerror(errno);
-      return false;
-    }
-    char* buf = CHECK_NOTNULL((char *)zmq_msg_data(zmsg));
-    size_t size = zmq_msg_size(zmsg);
-    data_size += size;
-
-    // auto tv = hwtic();
-    if (i == 0) {
-      // identify
-      msg->sender = std::string(buf, size);
-      msg->recver = my_node_.id();
-      zmq_msg_close(zmsg);
-      delete zmsg;
-    } else if (i == 1) {
-      // task
-      CHECK(msg->task.ParseFromArray(buf, size))
-          << "failed to parse string from " << msg->sender
-          << ". this is " << my_node_.id() << " " << size;
-      if (IsScheduler() && msg->task.control() &&
-          msg->task.ctrl().cmd() == Control::REQUEST_APP) {
-        // it is the first time the scheduler receive message from the
-        // sender. store the file desciptor of the sender for the monitor
-        int val[64]; size_t val_len = msg->sender.size();
-        CHECK_LT(val_len, 64*sizeof(int));
-        memcpy(val, msg->sender.data(), val_len);
-        CHECK(!zmq_getsockopt(
-            receiver_,  ZMQ_IDENTITY_FD, (char*)val, &val_len))
-            << "failed to get the file descriptor of " << msg->sender;
-        CHECK_EQ(val_len, 4);
-        int fd = val[0];
-        VLOG(1) << "node [" << msg->sender << "] is on file descriptor " << fd;
-        Lock l(fd_to_nodeid_mu_);
-        fd_to_nodeid_[fd] = msg->sender;
-      }
-      zmq_msg_close(zmsg);
-      delete zmsg;
-    } else {
-      // data
-      // SArray<char> data; data.CopyFrom(buf, size);
-
-      // ugly zero-copy
-      SArray<char> data(buf, size, false);
-      data.pointer().reset(buf, [zmsg](char*) {
-          zmq_msg_close(zmsg);
-          delete zmsg;
-        });
-      if (i == 2 && msg->task.has_key()) {
-        msg->key = data;
-      } else {
-        msg->value.push_back(data);
-      }
-    }
-    // recv_time_ += hwtoc(tv);
-
-    if (!zmq_msg_more(zmsg)) { CHECK_GT(i, 0); break; }
+  // the task and data are parsed in Decode
+  if (!RecvFrames(&msg->sender, &msg->value, &data_size)) {
+    LOG(WARNING) << "failed to receive message";
+    return false;
   }
+  CHECK(!msg->value.empty());
+  msg->recv_time = Histogram::Now();
 
   *recv_bytes += data_size;
-  if (hostnames_[msg->sender] == my_node_.hostname()) {
+  bool is_local;
+  {
+    Lock l(mu_);
+    msg->recver = my_node_.id();
+    auto it = hostnames_.find(msg->sender);
+    is_local = it != hostnames_.end() && it->second == my_node_.hostname();
+  }
+  if (is_local) {
     received_from_local_ += data_size;
   } else {
     received_from_others_ += data_size;
   }
-  VLOG(1) << "FROM: " << msg->sender << " " << msg->ShortDebugString();
+  if (decode) Decode(msg);
   return true;
 }
 
+void Van::Decode(Message* msg) {
+  CHECK(!msg->value.empty());
+  std::vector<SArray<char>> frames;
+  frames.swap(msg->value);
+
+  // task
+  CHECK(msg->task.ParseFromArray(frames[0].data(), frames[0].size()))
+      << "failed to parse string from " << msg->sender
+      << ". this is " << msg->recver << " " << frames[0].size();
+  if (msg->task.control() && msg->task.ctrl().cmd() == Control::REQUEST_APP &&
+      IsScheduler()) {
+    // it is the first time the scheduler receive message from the sender
+    Accepted(msg->sender);
+  }
+  frames.erase(frames.begin());
+
+  if (msg->task.shm_pos_size()) {
+    // the data are in the shared memory
+    CHECK(frames.empty());
+    auto ring = CHECK_NOTNULL(ShmReader(msg->sender));
+    for (int j = 0; j < msg->task.shm_pos_size(); ++j) {
+      frames.push_back(ring->Read(msg->task.shm_pos(j)));
+      received_by_shm_ += frames.back().size();
+    }
+    msg->task.clear_shm_pos();
+  }
+
+  // data
+  for (size_t j = 0; j < frames.size(); ++j) {
+    if (j == 0 && msg->task.has_key()) {
+      msg->key = frames[j];
+    } else {
+      msg->value.push_back(frames[j]);
+    }
+  }
+  VLOG(1) << "FROM: " << msg->sender << " " << msg->ShortDebugString();
+}
+
 void Van::Statistic() {
   // if (my_node_.role() == Node::UNUSED || my_node_.role() == Node::SCHEDULER) return;
   auto gb = [](size_t x) { return  x / 1e9; };
@@ -275,7 +247,73 @@ void Van::Statistic() {
             << " sent " << gb(sent_to_local_ + sent_to_others_)
             << " (local " << gb(sent_to_local_) << ") Gbyte,"
             << " received " << gb(received_from_local_ + received_from_others_)
-            << " (local " << gb(received_from_local_) << ") Gbyte";
+            << " (local " << gb(received_from_local_) << ") Gbyte,"
+            << " shared memory: sent " << gb(sent_by_shm_)
+            << " received " << gb(received_by_shm_) << " Gbyte";
+}
+
+Van::Frame* Van::NewFrame() {
+  {
+    Lock l(frame_pool_mu_);
+    if (!frame_pool_.empty()) {
+      Frame* frame = frame_pool_.back();
+      frame_pool_.pop_back();
+      return frame;
+    }
+  }
+  Frame* frame = new Frame();
+  frame->van = this;
+  return frame;
+}
+
+void Van::DeleteFrame(Frame* frame) {
+  // release the array here rather than in the pool
+  frame->data.clear();
+  // do not keep a large task buffer
+  if (frame->task.capacity() > 1024) {
+    std::vector<char>().swap(frame->task);
+  } else {
+    frame->task.clear();
+  }
+  Van* van = frame->van;
+  {
+    Lock l(van->frame_pool_mu_);
+    if (van->frame_pool_.size() < (size_t)FLAGS_frame_pool_size) {
+      van->frame_pool_.push_back(frame);
+      return;
+    }
+  }
+  delete frame;
+}
+
+string Van::ShmName(const NodeID& sender, const NodeID& recver) {
+  // node ids are only unique within a job, the scheduler address tells the
+  // jobs on the same machine apart
+  string name = "/ps_" + scheduler_.hostname() + "_" +
+                std::to_string(scheduler_.port()) + "_" + sender + "_" + recver;
+  for (size_t i = 1; i < name.size(); ++i) {
+    if (!isalnum(name[i])) name[i] = '_';
+  }
+  return name;
+}
+
+std::shared_ptr<ShmRing> Van::ShmWriter(const NodeID& recver) {
+  if (FLAGS_shm_buffer <= 0) return nullptr;
+  Lock l(shm_mu_);
+  auto it = shm_writers_.find(recver);
+  if (it != shm_writers_.end()) return it->second;
+  // store nullptr if failed, so we will not try it again
+  auto ring = ShmRing::Create(ShmName(my_node().id(), recver),
+                              (size_t)FLAGS_shm_buffer << 20);
+  shm_writers_[recver] = ring;
+  return ring;
+}
+
+std::shared_ptr<ShmRing> Van::ShmReader(const NodeID& sender) {
+  Lock l(shm_mu_);
+  auto& ring = shm_readers_[sender];
+  if (!ring) ring = ShmRing::Open(ShmName(sender, my_node().id()));
+  return ring;
 }
 
 Node Van::ParseNode(const string& node_str) {
@@ -295,46 +333,8 @@ Node Van::ParseNode(const string& node_str) {
   return node;
 }
 
-void Van::Monitor() {
-  VLOG(1) << "starting monitor...";
-  void *s = CHECK_NOTNULL(zmq_socket (context_, ZMQ_PAIR));
-  CHECK(!zmq_connect (s, "inproc://monitor"));
-  while (true) {
-    zmq_msg_t msg;
-    zmq_msg_init(&msg);
-    if (zmq_msg_recv(&msg, s, 0) == -1) {
-      if (errno == EINTR) continue;  // may be interupted by google profiler
-      break;
-    }
-    uint8_t *data = (uint8_t *)zmq_msg_data (&msg);
-    int event = *(uint16_t *)(data);
-    int value = *(uint32_t *)(data + 2);
-
-    if (event == ZMQ_EVENT_DISCONNECTED) {
-      auto& manager = Postoffice::instance().manager();
-      if (IsScheduler()) {
-        Lock l(fd_to_nodeid_mu_);
-        if (fd_to_nodeid_.find(value) == fd_to_nodeid_.end()) {
-          LOG(WARNING) << "cannot find the node id for FD = " << value;
-          continue;
-        }
-        manager.NodeDisconnected(fd_to_nodeid_[value]);
-      } else {
-        manager.NodeDisconnected(scheduler_.id());
-      }
-    }
-    if (event == ZMQ_EVENT_MONITOR_STOPPED) break;
-  }
-  zmq_close (s);
-  VLOG(1) << "monitor stopped.";
+void Van::NodeDisconnected(const NodeID& id) {
+  Postoffice::instance().manager().NodeDisconnected(id);
 }
 
 } // namespace PS
-
-
-// check whether I could connect to a specified node
-// bool connected(const Node& node);
-// bool Van::connected(const Node& node) {
-//   auto it = senders_.find(node.id());
-//   return it != senders_.end();
-// }
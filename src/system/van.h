@@ -2,17 +2,24 @@
 #include "util/common.h"
 #include "system/proto/node.pb.h"
 #include "system/message.h"
+#include "system/shm_ring.h"
 namespace PS {
 
 /**
- * @brief Van sends (receives) packages to (from) a node The current
- * implementation uses ZeroMQ
+ * @brief Van sends (receives) packages to (from) a node.
  *
+ * It is the base of the transports, which handles the parts shared by all of
+ * them: the encoding of messages, the shared memory between nodes on the same
+ * machine and the statistics. A transport only moves a list of frames between
+ * nodes. The transport is chosen by the flag -van, see Create.
  */
 class Van {
  public:
-  Van() { }
-  ~Van();
+  /**
+   * @brief Creates the transport specified by -van, "zmq" (default) or "tcp"
+   */
+  static Van* Create();
+  virtual ~Van();
 
   void Init();
 
@@ -20,34 +27,96 @@ class Van {
   bool Connect(const Node&  node);
 
   bool Send(Message* msg, size_t* send_bytes);
-  bool Recv(Message* msg, size_t* recv_bytes);
+  /**
+   * @brief Receives a message. If "decode" is false, the raw frames are stored
+   * in msg->value, and one need to call Decode later, possibly in another
+   * thread.
+   */
+  bool Recv(Message* msg, size_t* recv_bytes, bool decode = true);
+  /**
+   * @brief Parses the task and data of a message returned by Recv(.., false)
+   */
+  void Decode(Message* msg);
 
   static Node ParseNode(const string& node_str);
 
-  Node& my_node() { return my_node_; }
+  /**
+   * @brief Returns a copy of my node, which is updated by Connect, e.g. when
+   * my key range is changed
+   */
+  Node my_node() { Lock l(mu_); return my_node_; }
   Node& scheduler() { return scheduler_; };
- private:
-  // bind to my port
-  void Bind();
-
-  static void FreeData(void *data, void *hint) {
-    if (hint == NULL) {
-      delete [] (char*)data;
-    } else {
-      delete (SArray<char>*)hint;
-    }
-  }
-
-  bool IsScheduler() { return my_node_.role() == Node::SCHEDULER; }
-  // for scheduler: monitor the liveness of all other nodes
-  // for other nodes: monitor the liveness of the scheduler
-  void Monitor();
-
-  void *context_ = nullptr;
-  void *receiver_ = nullptr;
+
+  // the data bytes sent and received through the shared memory, see
+  // -shm_buffer
+  size_t sent_by_shm() const { return sent_by_shm_; }
+  size_t received_by_shm() const { return received_by_shm_; }
+
+ protected:
+  Van() { }
+
+  // the buffer of a frame being sent, either the serialized task or a data
+  // array. they are reused to avoid memory allocation for every message.
+  struct Frame {
+    Van* van;
+    std::vector<char> task;
+    SArray<char> data;
+    char* buf() { return task.empty() ? data.data() : task.data(); }
+    size_t size() { return task.empty() ? data.size() : task.size(); }
+  };
+  Frame* NewFrame();
+  // gives the frame back once it is sent
+  static void DeleteFrame(Frame* frame);
+
+  // -- the interface of a transport --
+
+  // binds to my port
+  virtual void Bind() = 0;
+  // connects to "node". it is called only once for a node
+  virtual bool ConnectTo(const Node& node) = 0;
+  virtual void DisconnectFrom(const NodeID& id) = 0;
+  // sends "frames" as a single message to node "id", the first one is the
+  // task. it is never called concurrently for the same node. DeleteFrame must
+  // be called on every frame once it is not used, even if failed
+  virtual bool SendFrames(const NodeID& id, const std::vector<Frame*>& frames,
+                          size_t* send_bytes) = 0;
+  // receives a message sent by SendFrames. it is called by a single thread
+  virtual bool RecvFrames(NodeID* sender, std::vector<SArray<char>>* frames,
+                          size_t* recv_bytes) = 0;
+  // starts to detect the failure of nodes. the scheduler monitors the liveness
+  // of all other nodes, while the other nodes monitor the scheduler
+  virtual void Monitor() = 0;
+  // called by the scheduler when it receives the first message from "id"
+  virtual void Accepted(const NodeID& id) { }
+
+  // reports that "id" is disconnected to the manager
+  void NodeDisconnected(const NodeID& id);
+  bool IsScheduler() { return my_node().role() == Node::SCHEDULER; }
+  // written by Connect under mu_ and connect_mu_. a transport may read it
+  // directly only in Bind and ConnectTo
   Node my_node_;
   Node scheduler_;
-  std::unordered_map<NodeID, void *> senders_;
+
+ private:
+  std::vector<Frame*> frame_pool_;
+  std::mutex frame_pool_mu_;
+
+  // shared memory for nodes on the same machine. returns nullptr if it is
+  // disabled or failed
+  std::shared_ptr<ShmRing> ShmWriter(const NodeID& recver);
+  std::shared_ptr<ShmRing> ShmReader(const NodeID& sender);
+  string ShmName(const NodeID& sender, const NodeID& recver);
+  std::unordered_map<NodeID, std::shared_ptr<ShmRing>> shm_writers_;
+  std::unordered_map<NodeID, std::shared_ptr<ShmRing>> shm_readers_;
+  std::mutex shm_mu_;
+
+  // the connected nodes
+  std::unordered_set<NodeID> connected_;
+  // protects connected_ and hostnames_, Send is called by multiple threads
+  std::mutex mu_;
+  // serializes Connect and Disconnect, so a node is connected only once. it is
+  // locked before mu_
+  std::mutex connect_mu_;
 
   DISALLOW_COPY_AND_ASSIGN(Van);
 
@@ -55,15 +124,12 @@ class Van {
   // print statistic info
   void Statistic();
   std::unordered_map<NodeID, string> hostnames_;
-  size_t sent_to_local_ = 0;
-  size_t sent_to_others_ = 0;
+  std::atomic<size_t> sent_to_local_{0};
+  std::atomic<size_t> sent_to_others_{0};
   size_t received_from_local_ = 0;
   size_t received_from_others_ = 0;
-
-  // for monitor
-  std::unordered_map<int, NodeID> fd_to_nodeid_;
-  std::mutex fd_to_nodeid_mu_;
-  std::thread* monitor_thread_;
+  std::atomic<size_t> sent_by_shm_{0};
+  std::atomic<size_t> received_by_shm_{0};
 
   // debug performance
   // double send_time_ = 0;
@@ -0,0 +1,222 @@
+#include "system/zmq_van.h"
+#include <string.h>
+#include <zmq.h>
+#include "util/shared_array_inl.h"
+namespace PS {
+
+DECLARE_int32(bind_to);
+DECLARE_bool(local);
+DEFINE_int32(io_threads, 1, "the number of zmq I/O threads");
+DEFINE_int32(sndhwm, 0, "the max number of messages queued in zmq for a node "
+             "before sending blocks. 0 uses the zmq default");
+
+ZmqVan::~ZmqVan() {
+  for (auto& it : senders_) zmq_close(it.second);
+  zmq_close(receiver_);
+  zmq_ctx_destroy(context_);
+}
+
+void ZmqVan::Bind() {
+  context_ = zmq_ctx_new();
+  CHECK(context_ != NULL) << "create 0mq context failed";
+
+  // one need to "sudo ulimit -n 65536" or edit /etc/security/limits.conf
+  zmq_ctx_set(context_, ZMQ_MAX_SOCKETS, 65536);
+  CHECK_GT(FLAGS_io_threads, 0);
+  zmq_ctx_set(context_, ZMQ_IO_THREADS, FLAGS_io_threads);
+
+  receiver_ = zmq_socket(context_, ZMQ_ROUTER);
+  CHECK(receiver_ != NULL)
+      << "create receiver socket failed: " << zmq_strerror(errno);
+  string addr = "tcp://*:";
+  if (FLAGS_bind_to) {
+    addr += std::to_string(FLAGS_bind_to);
+  } else {
+    CHECK(my_node_.has_port()) << my_node_.ShortDebugString();
+    addr += std::to_string(my_node_.port());
+  }
+  if (FLAGS_local) {
+    addr = "ipc:///tmp/" + my_node_.id();
+  }
+  CHECK(zmq_bind(receiver_, addr.c_str()) == 0)
+      << "bind to " << addr << " failed: " << zmq_strerror(errno);
+
+  VLOG(1) << "BIND address " << addr;
+}
+
+void ZmqVan::DisconnectFrom(const NodeID& id) {
+  Lock l(senders_mu_);
+  auto it = senders_.find(id);
+  if (it == senders_.end()) return;
+  zmq_close(it->second);
+  senders_.erase(it);
+}
+
+bool ZmqVan::ConnectTo(const Node& node) {
+  NodeID id = node.id();
+  void *sender = zmq_socket(context_, ZMQ_DEALER);
+  CHECK(sender != NULL) << zmq_strerror(errno);
+  string my_id = my_node_.id(); // address(my_node_);
+  zmq_setsockopt (sender, ZMQ_IDENTITY, my_id.data(), my_id.size());
+
+  if (FLAGS_sndhwm > 0) {
+    int hwm = FLAGS_sndhwm;
+    zmq_setsockopt (sender, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+  }
+
+  // connect
+  string addr = "tcp://" + node.hostname() + ":" + std::to_string(node.port());
+  if (FLAGS_local) {
+    addr = "ipc:///tmp/" + node.id();
+  }
+  if (zmq_connect(sender, addr.c_str()) != 0) {
+    LOG(WARNING) << "connect to " + addr + " failed: " + zmq_strerror(errno);
+    return false;
+  }
+
+  Lock l(senders_mu_);
+  senders_[id] = sender;
+
+  VLOG(1) << "CONNECT to " << id << " [" << addr << "]";
+  return true;
+}
+
+bool ZmqVan::SendFrames(const NodeID& id, const std::vector<Frame*>& frames,
+                        size_t* send_bytes) {
+  void *socket;
+  {
+    Lock l(senders_mu_);
+    auto it = senders_.find(id);
+    CHECK(it != senders_.end());
+    socket = it->second;
+  }
+  size_t n = frames.size();
+  for (size_t i = 0; i < n; ++i) {
+    Frame* frame = frames[i];
+    size_t size = frame->size();
+    zmq_msg_t data_msg;
+    zmq_msg_init_data(&data_msg, frame->buf(), size, FreeData, frame);
+    int tag = i == n - 1 ? 0 : ZMQ_SNDMORE;
+    while (true) {
+      if (zmq_msg_send(&data_msg, socket, tag) == size) break;
+      if (errno == EINTR) continue;  // may be interupted by profiler
+      LOG(WARNING) << "failed to send message to node [" << id
+                   << "] errno: " << zmq_strerror(errno);
+      // zmq does not own the frames which are not sent
+      zmq_msg_close(&data_msg);
+      for (size_t j = i + 1; j < n; ++j) DeleteFrame(frames[j]);
+      return false;
+    }
+    *send_bytes += size;
+  }
+  return true;
+}
+
+bool ZmqVan::RecvFrames(NodeID* sender, std::vector<SArray<char>>* frames,
+                        size_t* recv_bytes) {
+  for (int i = 0; ; ++i) {
+    zmq_msg_t* zmsg = new zmq_msg_t;
+    CHECK(zmq_msg_init(zmsg) == 0) << zmq_strerror(errno);
+    while (true) {
+      if (zmq_msg_recv(zmsg, receiver_, 0) != -1) break;
+      if (errno == EINTR) continue;  // may be interupted by google profiler
+      LOG(WARNING) << "failed to receive message. errno: "
+                   << zmq_strerror(errno);
+      return false;
+    }
+    char* buf = CHECK_NOTNULL((char *)zmq_msg_data(zmsg));
+    size_t size = zmq_msg_size(zmsg);
+    bool more = zmq_msg_more(zmsg);
+    *recv_bytes += size;
+
+    // auto tv = hwtic();
+    if (i == 0) {
+      // identify
+      *sender = std::string(buf, size);
+      zmq_msg_close(zmsg);
+      delete zmsg;
+    } else {
+      // ugly zero-copy
+      SArray<char> data(buf, size, false);
+      data.pointer().reset(buf, [zmsg](char*) {
+          zmq_msg_close(zmsg);
+          delete zmsg;
+        });
+      frames->push_back(data);
+    }
+    // recv_time_ += hwtoc(tv);
+
+    if (!more) { CHECK_GT(i, 0); break; }
+  }
+  return true;
+}
+
+void ZmqVan::Accepted(const NodeID& id) {
+  // store the file desciptor of the sender for the monitor
+  int val[64]; size_t val_len = id.size();
+  CHECK_LT(val_len, 64*sizeof(int));
+  memcpy(val, id.data(), val_len);
+  CHECK(!zmq_getsockopt(
+      receiver_,  ZMQ_IDENTITY_FD, (char*)val, &val_len))
+      << "failed to get the file descriptor of " << id;
+  CHECK_EQ(val_len, 4);
+  int fd = val[0];
+  VLOG(1) << "node [" << id << "] is on file descriptor " << fd;
+  Lock l(fd_to_nodeid_mu_);
+  fd_to_nodeid_[fd] = id;
+}
+
+void ZmqVan::Monitor() {
+  if (IsScheduler()) {
+    CHECK(!zmq_socket_monitor(receiver_, "inproc://monitor", ZMQ_EVENT_ALL));
+  } else {
+    Lock l(senders_mu_);
+    CHECK(!zmq_socket_monitor(
+        senders_[scheduler_.id()], "inproc://monitor", ZMQ_EVENT_ALL));
+  }
+  monitor_thread_ = new std::thread(&ZmqVan::MonitorLoop, this);
+  monitor_thread_->detach();
+}
+
+void ZmqVan::MonitorLoop() {
+  VLOG(1) << "starting monitor...";
+  void *s = CHECK_NOTNULL(zmq_socket (context_, ZMQ_PAIR));
+  CHECK(!zmq_connect (s, "inproc://monitor"));
+  while (true) {
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    if (zmq_msg_recv(&msg, s, 0) == -1) {
+      if (errno == EINTR) continue;  // may be interupted by google profiler
+      break;
+    }
+    uint8_t *data = (uint8_t *)zmq_msg_data (&msg);
+    int event = *(uint16_t *)(data);
+    int value = *(uint32_t *)(data + 2);
+
+    if (event == ZMQ_EVENT_DISCONNECTED) {
+      if (IsScheduler()) {
+        Lock l(fd_to_nodeid_mu_);
+        if (fd_to_nodeid_.find(value) == fd_to_nodeid_.end()) {
+          LOG(WARNING) << "cannot find the node id for FD = " << value;
+          continue;
+        }
+        NodeDisconnected(fd_to_nodeid_[value]);
+      } else {
+        NodeDisconnected(scheduler_.id());
+      }
+    }
+    if (event == ZMQ_EVENT_MONITOR_STOPPED) break;
+  }
+  zmq_close (s);
+  VLOG(1) << "monitor stopped.";
+}
+
+} // namespace PS
+
+
+// check whether I could connect to a specified node
+// bool connected(const Node& node);
+// bool Van::connected(const Node& node) {
+//   auto it = senders_.find(node.id());
+//   return it != senders_.end();
+// }
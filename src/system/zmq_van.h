@@ -0,0 +1,47 @@
+#pragma once
+#include "system/van.h"
+namespace PS {
+
+/**
+ * @brief The transport using ZeroMQ, the default one.
+ *
+ * A node receives messages from all others by a ROUTER socket, and sends to
+ * each of them by a DEALER socket.
+ */
+class ZmqVan : public Van {
+ public:
+  ZmqVan() { }
+  virtual ~ZmqVan();
+
+ protected:
+  virtual void Bind();
+  virtual bool ConnectTo(const Node& node);
+  virtual void DisconnectFrom(const NodeID& id);
+  virtual bool SendFrames(const NodeID& id, const std::vector<Frame*>& frames,
+                          size_t* send_bytes);
+  virtual bool RecvFrames(NodeID* sender, std::vector<SArray<char>>* frames,
+                          size_t* recv_bytes);
+  virtual void Monitor();
+  virtual void Accepted(const NodeID& id);
+
+ private:
+  // called by zmq once a frame is sent, "hint" is the Frame
+  static void FreeData(void *data, void *hint) {
+    DeleteFrame((Frame*)hint);
+  }
+  void MonitorLoop();
+
+  void *context_ = nullptr;
+  void *receiver_ = nullptr;
+  std::unordered_map<NodeID, void *> senders_;
+  std::mutex senders_mu_;
+
+  // for monitor
+  std::unordered_map<int, NodeID> fd_to_nodeid_;
+  std::mutex fd_to_nodeid_mu_;
+  std::thread* monitor_thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(ZmqVan);
+};
+
+} // namespace PS
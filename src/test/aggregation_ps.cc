@@ -20,7 +20,7 @@ class Worker : public App {
  public:
   virtual void Run() {
     for (int i = 0; i < FLAGS_n; ++i) {
-      int ts = Submit(Task(), kServerGroup);
+      int64 ts = Submit(Task(), kServerGroup);
       usleep(FLAGS_interval);
       Wait(ts);
       LL << MyNodeID() << " " << i;
@@ -0,0 +1,53 @@
+#include "gtest/gtest.h"
+#include "system/assigner.h"
+using namespace PS;
+
+TEST(NodeAssigner, SampleKeys) {
+  std::vector<Key> keys;
+  for (Key k = 0; k < 100000; ++k) { keys.push_back(k); keys.push_back(k); }
+  NodeAssigner::KeySample sample;
+  NodeAssigner::SampleKeys(keys.data(), keys.size(), 100, &sample);
+  EXPECT_GT(sample.size(), 800);
+  EXPECT_LT(sample.size(), 1200);
+  for (size_t i = 0; i < sample.size(); ++i) {
+    EXPECT_EQ(sample[i].second, 2);
+    if (i) {
+      EXPECT_LT(sample[i-1].first, sample[i].first);
+    }
+  }
+  // the same keys are sampled
+  NodeAssigner::KeySample sample2;
+  NodeAssigner::SampleKeys(keys.data(), keys.size(), 100, &sample2);
+  EXPECT_EQ(sample, sample2);
+}
+
+TEST(NodeAssigner, Partition) {
+  // half of the pushes are in the first 1/10 of the key range
+  Range<Key> range(0, 1000000);
+  NodeAssigner::KeySample sample;
+  for (Key k = 0; k < 100000; k += 10) sample.push_back(std::make_pair(k, 9));
+  for (Key k = 100000; k < 1000000; k += 10) {
+    sample.push_back(std::make_pair(k, 1));
+  }
+  int n = 4;
+  std::vector<Key> even;
+  for (int i = 0; i < n; ++i) even.push_back(range.EvenDivide(n, i).begin());
+  even.push_back(range.end());
+  EXPECT_GT(NodeAssigner::Imbalance(sample, even), 2);
+
+  auto bound = NodeAssigner::Partition(sample, range, n);
+  ASSERT_EQ(bound.size(), n + 1);
+  EXPECT_EQ(bound.front(), range.begin());
+  EXPECT_EQ(bound.back(), range.end());
+  for (int i = 0; i < n; ++i) EXPECT_LT(bound[i], bound[i+1]);
+  EXPECT_LT(NodeAssigner::Imbalance(sample, bound), 1.01);
+
+  // by the number of keys
+  NodeAssigner::MergeSample(&sample, true);
+  bound = NodeAssigner::Partition(sample, range, n);
+  EXPECT_LT(NodeAssigner::Imbalance(sample, bound), 1.01);
+
+  // too few samples, falls back to the even partition
+  sample.resize(1);
+  EXPECT_EQ(NodeAssigner::Partition(sample, range, n), even);
+}
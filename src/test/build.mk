@@ -1,15 +1,30 @@
 test: build/hello_ps \
 build/aggregation_ps \
 build/network_perf_ps \
+build/executor_perf_ps \
+build/startup_perf_ps \
 build/kv_vector_ps \
 build/kv_vector_buffer_ps \
 build/kv_map_ps \
 build/kv_map_perf_ps \
+build/kv_map_replica_ps \
+build/server_migration_ps \
+build/checkpoint_ps \
+build/shm_van_ps \
 build/kv_layer_ps \
 build/kv_layer_perf_ps \
 build/assign_op_test \
 build/parallel_ordered_match_test \
-build/common_test
+build/common_test \
+build/shm_ring_test \
+build/histogram_test \
+build/request_tracker_test \
+build/assigner_test \
+build/model_file_test \
+build/flat_map_test \
+build/flat_map_perf_test \
+build/compact_float_test \
+build/future_test
 
 build/%_ps: src/test/%_ps.cc $(PS_LIB)
 	$(CC) $(CFLAGS) $^ $(LDFLAGS) -o $@
@@ -19,11 +34,12 @@ TESTFLAGS = $(TEST_MAIN) -lgtest $(LDFLAGS)
 
 build/parallel_ordered_match_test: build/util/file.o build/util/proto/*.o build/data/proto/*.pb.o
 
+build/shm_ring_test: build/system/shm_ring.o
+
+build/model_file_test: build/util/file.o build/util/proto/*.o build/data/proto/*.pb.o
+
 build/%_test: build/test/%_test.o
 	$(CC) $(CFLAGS) $(filter %.o %.a %.cc, $^) $(TESTFLAGS) -o $@
 
-# build/reassign_server_key_range: src/test/reassign_server_key_range.cc $(PS_LIB)
-# 	$(CC) $(CFLAGS) $^ $(LDFLAGS) -o $@
-
 # build/fixing_float_test: src/test/fixing_float_test.cc src/filter/fixing_float.h $(PS_LIB)
 # 	$(CC) $(CFLAGS) $< $(PS_LIB) $(TESTFLAGS) -o $@
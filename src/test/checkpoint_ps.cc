@@ -0,0 +1,74 @@
+/**
+ * @brief Test of server checkpoints. The worker pushes all keys in the first
+ * half of the rounds and then only the even ones, with a full checkpoint in
+ * between and an incremental one at last. Then restore them with another
+ * number of servers and check the pulled values, e.g.
+ *
+ *   script/local.sh 2 1 build/checkpoint_ps
+ *   script/local.sh 3 1 build/checkpoint_ps -restore
+ */
+#include "parameter/kv_map.h"
+#include "test/kv_test_worker.h"
+DEFINE_string(checkpoint_dir, "/tmp/ps_checkpoint", "");
+DEFINE_bool(restore, false, "restore from the checkpoints and check");
+namespace PS {
+
+class Server : public App {
+ public:
+  // the checkpoint commands from the worker
+  virtual void ProcessRequest(Message* request) {
+    model_.Checkpoint(request->task.param().checkpoint());
+  }
+ private:
+  KVMap<K, V> model_;
+};
+
+class Worker : public KVTestWorker {
+ public:
+  virtual void Run() {
+    SArray<K> even;
+    for (int i = 0; i < FLAGS_n; i += 2) even.push_back(key_[i]);
+    std::string full = FLAGS_checkpoint_dir + "/ckpt-0";
+    std::string incr = FLAGS_checkpoint_dir + "/ckpt-1";
+    int half = FLAGS_rounds / 2;
+
+    if (FLAGS_restore) {
+      CheckpointCall call;
+      call.set_cmd(CheckpointCall::RESTORE);
+      call.add_prefix(full);
+      call.add_prefix(incr);
+      SendCheckpoint(call);
+      Check([half](int i) { return (V)(i % 2 == 0 ? FLAGS_rounds : half); });
+      return;
+    }
+
+    for (int r = 1; r <= FLAGS_rounds; ++r) {
+      Push(r <= half ? key_ : even, r);
+      if (r == half || r == FLAGS_rounds) {
+        CheckpointCall call;
+        call.set_cmd(CheckpointCall::SAVE);
+        call.set_incremental(r != half);
+        call.add_prefix(r == half ? full : incr);
+        SendCheckpoint(call);
+      }
+    }
+  }
+ private:
+  void SendCheckpoint(const CheckpointCall& call) {
+    Task task;
+    *task.mutable_param()->mutable_checkpoint() = call;
+    Wait(Submit(task, kServerGroup));
+  }
+};
+
+App* App::Create(const std::string& conf) {
+  if (IsWorker()) return new Worker();
+  if (IsServer()) return new Server();
+  return new App();
+}
+
+}  // namespace PS
+
+int main(int argc, char *argv[]) {
+  return PS::RunSystem(argc, argv);
+}
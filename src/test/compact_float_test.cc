@@ -0,0 +1,66 @@
+#include "gtest/gtest.h"
+#include "util/compact_float.h"
+using namespace PS;
+
+// the relative error of one value, and the mean of many stochastic roundings
+template <typename F>
+void TestCompactFloat(float min, float max, float rel_err) {
+  F f;
+  EXPECT_EQ(f.get(), 0);
+  f.set(0); EXPECT_EQ(f.get(), 0);
+
+  for (float x = min; x < max; x *= 1.7) {
+    f.set(x);
+    EXPECT_NEAR(f.get(), x, x * rel_err);
+    // representable values are kept
+    float y = f.get();
+    f.set(y);
+    EXPECT_EQ(f.get(), y);
+
+    double sum = 0;
+    int n = 10000;
+    for (int i = 0; i < n; ++i) { f.set(x); sum += f.get(); }
+    EXPECT_NEAR(sum / n, x, x * rel_err / 10);
+  }
+}
+
+TEST(CompactFloat, Float32) { TestCompactFloat<Float32>(1e-10, 1e10, 1e-7); }
+TEST(CompactFloat, Float16) { TestCompactFloat<Float16>(1e-4, 6e4, 1e-3); }
+TEST(CompactFloat, BFloat16) { TestCompactFloat<BFloat16>(1e-10, 1e10, 1e-2); }
+TEST(CompactFloat, LogFloat8) { TestCompactFloat<LogFloat8>(2e-5, 5e4, 0.1); }
+
+TEST(CompactFloat, Clamp) {
+  Float16 h; BFloat16 b; LogFloat8 l;
+  h.set(-1); b.set(-1); l.set(-1);
+  EXPECT_EQ(h.get(), 0); EXPECT_EQ(b.get(), 0); EXPECT_EQ(l.get(), 0);
+  h.set(1e6); EXPECT_EQ(h.get(), 65504);
+  l.set(1e6); EXPECT_NEAR(l.get(), 55109, 1);
+  l.set(1e-8); EXPECT_LE(l.get(), 2e-5);
+}
+
+// small increments are not lost on average
+TEST(CompactFloat, Accumulate) {
+  LogFloat8 f;
+  f.set(100);
+  for (int i = 0; i < 100000; ++i) f.set(f.get() + 0.01);
+  EXPECT_NEAR(f.get(), 1100, 300);
+
+  Float16 h;
+  h.set(1000);
+  for (int i = 0; i < 100000; ++i) h.set(h.get() + 0.01);
+  EXPECT_NEAR(h.get(), 2000, 100);
+}
+
+// the same seed gives the same roundings
+TEST(CompactFloat, Seed) {
+  std::vector<uint8> a, b;
+  LogFloat8 f;
+  SeedCompactFloat(7);
+  for (int i = 0; i < 1000; ++i) { f.set(1.03); a.push_back(f.code); }
+  SeedCompactFloat(7);
+  for (int i = 0; i < 1000; ++i) { f.set(1.03); b.push_back(f.code); }
+  EXPECT_EQ(a, b);
+  // both codes around 1.03 are used
+  EXPECT_NE(*std::min_element(a.begin(), a.end()),
+            *std::max_element(a.begin(), a.end()));
+}
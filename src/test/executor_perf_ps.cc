@@ -0,0 +1,69 @@
+#include "ps.h"
+#include "util/resource_usage.h"
+
+DEFINE_int32(n, 100000, "the number of requests sent by a worker");
+DEFINE_int32(depth, 1000,
+             "requests are sent in blocks of this size. within a block, "
+             "request t depends on request t-1 but they are sent in the "
+             "reverse order, so up to depth requests queue in the executor of "
+             "a server before the first one of the block arrives");
+DEFINE_int32(waiters, 1,
+             "the number of threads waiting for the requests, the i-th one "
+             "waits for the timestamps t with t % waiters == i. run with "
+             "-print_latency to see the wakeups per finished request");
+namespace PS {
+
+class Server : public App {
+ public:
+  virtual void ProcessRequest(Message* request) { ++ num_; }
+  virtual ~Server() {
+    LOG(INFO) << MyNodeID() << ": processed " << num_ << " requests";
+  }
+ private:
+  size_t num_ = 0;
+};
+
+class Worker : public App {
+ public:
+  virtual void Slice(const Message& request, const std::vector<Range<Key>>& krs,
+                     std::vector<Message*>* msgs) {
+    for (auto m : *msgs) *m = request;
+  }
+
+  virtual void Run() {
+    int n = FLAGS_n, depth = std::max(1, FLAGS_depth);
+    auto tv = tic();
+    for (int i = 0; i < n; i += depth) {
+      for (int t = std::min(n, i + depth) - 1; t >= i; --t) {
+        Message msg;
+        msg.recver = kServerGroup;
+        msg.task.set_time(t);
+        msg.task.add_wait_time(t - 1);
+        Submit(&msg);
+      }
+    }
+    std::vector<std::thread> waiters;
+    int k = std::max(1, FLAGS_waiters);
+    for (int i = 0; i < k; ++i) {
+      waiters.push_back(std::thread([this, i, k, n]() {
+            for (int t = i; t < n; t += k) Wait(t);
+          }));
+    }
+    for (auto& w : waiters) w.join();
+    double thr = (double)n / toc(tv);
+    printf("%s: depth %d, %d waiters, %.0lf requests/sec\n",
+           MyNodeID().c_str(), depth, k, thr);
+  }
+};
+
+App* App::Create(const std::string& conf) {
+  if (IsWorker()) return new Worker();
+  if (IsServer()) return new Server();
+  return new App();
+}
+
+}  // namespace PS
+
+int main(int argc, char *argv[]) {
+  return PS::RunSystem(argc, argv);
+}
@@ -0,0 +1,80 @@
+#include "gtest/gtest.h"
+#include "util/flat_map.h"
+#include "util/resource_usage.h"
+using namespace PS;
+
+namespace PS {
+DEFINE_int32(num_threads, 1, "each thread owns a map and a share of the keys, "
+             "the same as the processing threads of KVMap");
+}  // namespace PS
+DEFINE_int64(num_keys, 1000000, "the number of random keys inserted");
+DEFINE_bool(unordered_map, false, "use std::unordered_map rather than FlatMap");
+
+// the FTRL entry with w, 12 bytes
+struct Entry { float w = 0, z = 0, sqrt_n = 0; };
+
+// random keys, the same sequence for the same seed
+struct KeyGen {
+  explicit KeyGen(uint64 seed) : s(seed * 0x9E3779B97F4A7C15ULL + 1) { }
+  uint64 operator()() {
+    s ^= s << 13; s ^= s >> 7; s ^= s << 17;
+    return s;
+  }
+  uint64 s;
+};
+
+// runs f(t) in FLAGS_num_threads threads, returns the seconds
+template <typename F>
+double Run(F f) {
+  auto tv = hwtic();
+  std::vector<std::thread> th;
+  for (int t = 0; t < FLAGS_num_threads; ++t) th.push_back(std::thread(f, t));
+  for (auto& t : th) t.join();
+  return hwtoc(tv);
+}
+
+template <typename Map>
+void Bench(const char* name) {
+  int nt = FLAGS_num_threads;
+  size_t n = FLAGS_num_keys / nt;
+  std::vector<Map> maps(nt);
+  double mem = ResUsage::myPhyMem();
+
+  double t = Run([&](int i) {
+      KeyGen key(i);
+      for (size_t j = 0; j < n; ++j) maps[i][key()].w = j;
+    });
+  size_t size = 0;
+  for (const auto& m : maps) size += m.size();
+  double bytes = (ResUsage::myPhyMem() - mem) * 1e6 / size;
+  LOG(INFO) << name << ": " << size << " keys, " << nt << " threads, "
+            << bytes << " bytes per key";
+  LOG(INFO) << "  insert: " << size / t / 1e6 << " M keys/sec";
+
+  std::vector<size_t> found(nt);
+  t = Run([&](int i) {
+      KeyGen key(i);
+      const Map& m = maps[i];
+      for (size_t j = 0; j < n; ++j) found[i] += m.find(key()) != m.end();
+    });
+  LOG(INFO) << "  lookup: " << size / t / 1e6 << " M keys/sec";
+  for (int i = 0; i < nt; ++i) EXPECT_EQ(found[i], maps[i].size());
+
+  t = Run([&](int i) {
+      KeyGen key(i + nt);
+      const Map& m = maps[i];
+      found[i] = 0;
+      for (size_t j = 0; j < n; ++j) found[i] += m.find(key()) != m.end();
+    });
+  LOG(INFO) << "  lookup missed keys: " << size / t / 1e6 << " M keys/sec";
+}
+
+// e.g. ./flat_map_perf_test -num_keys 100000000. each run is a new process,
+// so the memory is measured from the same start
+TEST(FlatMap, Perf) {
+  if (FLAGS_unordered_map) {
+    Bench<std::unordered_map<uint64, Entry>>("unordered_map");
+  } else {
+    Bench<FlatMap<uint64, Entry>>("FlatMap");
+  }
+}
@@ -0,0 +1,77 @@
+#include "gtest/gtest.h"
+#include "util/flat_map.h"
+using namespace PS;
+
+// applies the same random inserts, lookups and erases to both maps
+TEST(FlatMap, Random) {
+  FlatMap<uint64, int> map;
+  std::unordered_map<uint64, int> ref;
+  srand(0);
+  for (int i = 0; i < 200000; ++i) {
+    uint64 k = rand() % 10000;
+    int op = rand() % 4;
+    if (op < 2) {
+      map[k] += i; ref[k] += i;
+    } else if (op == 2) {
+      EXPECT_EQ(map.erase(k), ref.erase(k));
+    } else {
+      auto it = map.find(k);
+      auto jt = ref.find(k);
+      ASSERT_EQ(it == map.end(), jt == ref.end());
+      if (jt != ref.end()) {
+        EXPECT_EQ(it->second, jt->second);
+      }
+    }
+    ASSERT_EQ(map.size(), ref.size());
+  }
+  size_t n = 0;
+  for (const auto& e : map) {
+    EXPECT_EQ(e.second, ref[e.first]);
+    ++ n;
+  }
+  EXPECT_EQ(n, ref.size());
+}
+
+TEST(FlatMap, EraseWhileIterating) {
+  FlatMap<uint64, int> map;
+  for (uint64 k = 0; k < 10000; ++k) map[k << 32] = k;
+  for (auto it = map.begin(); it != map.end(); ) {
+    if (it->second % 2) {
+      it = map.erase(it);
+    } else {
+      ++ it;
+    }
+  }
+  EXPECT_EQ(map.size(), 5000);
+  for (uint64 k = 0; k < 10000; ++k) {
+    EXPECT_EQ(map.count(k << 32), k % 2 == 0);
+  }
+  // the deleted slots are reused
+  size_t cap = map.capacity();
+  for (int i = 0; i < 100; ++i) {
+    for (uint64 k = 1; k < 10000; k += 2) map[k << 32] = k;
+    for (uint64 k = 1; k < 10000; k += 2) map.erase(k << 32);
+  }
+  EXPECT_EQ(map.capacity(), cap);
+  EXPECT_EQ(map.size(), 5000);
+}
+
+TEST(FlatMap, Memory) {
+  FlatMap<uint64, float> map;
+  size_t n = 1000000;
+  map.reserve(n);
+  size_t cap = map.capacity();
+  for (uint64 k = 0; k < n; ++k) map[k * 7] = k;
+  EXPECT_EQ(map.capacity(), cap);
+  // less than twice of the minimal capacity, which is 7/8 full
+  EXPECT_LT(cap, n * 8 / 7 * 2);
+  const auto& m = map;
+  for (uint64 k = 0; k < n; ++k) {
+    auto it = m.find(k * 7);
+    ASSERT_TRUE(it != m.end());
+    EXPECT_EQ(it->second, k);
+  }
+  map.clear();
+  EXPECT_EQ(map.capacity(), 0);
+  EXPECT_TRUE(map.find(0) == map.end());
+}
@@ -0,0 +1,45 @@
+#include "gtest/gtest.h"
+#include "util/future.h"
+using namespace PS;
+
+TEST(Future, Then) {
+  Future a;
+  int n = 0;
+  Future b = a.Then([&n]() { ++ n; });
+  Future c = b.Then([&n]() { n *= 10; });
+  EXPECT_FALSE(a.IsReady());
+  EXPECT_FALSE(c.IsReady());
+  a.Set();
+  EXPECT_TRUE(c.IsReady());
+  EXPECT_EQ(n, 10);
+
+  // runs immediately if ready
+  a.Then([&n]() { ++ n; });
+  EXPECT_EQ(n, 11);
+}
+
+TEST(Future, Chain) {
+  Future pull, push;
+  bool computed = false;
+  Future done = pull.Then([&]() { computed = true; return push; });
+  pull.Set();
+  EXPECT_TRUE(computed);
+  EXPECT_FALSE(done.IsReady());
+  push.Set();
+  EXPECT_TRUE(done.IsReady());
+}
+
+TEST(Future, WhenAll) {
+  EXPECT_TRUE(Future::WhenAll({}).IsReady());
+  std::vector<Future> fs(100);
+  Future all = Future::WhenAll(fs);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.push_back(std::thread([&fs, i]() {
+          for (size_t j = i; j < fs.size(); j += 4) fs[j].Set();
+        }));
+  }
+  all.Wait();
+  for (auto& f : fs) EXPECT_TRUE(f.IsReady());
+  for (auto& t : threads) t.join();
+}
@@ -17,7 +17,7 @@ class Worker : public App {
   }
 
   virtual void Run() {
-    int ts = Submit(Task(), kServerGroup);
+    int64 ts = Submit(Task(), kServerGroup);
     Wait(ts);
 
     ts = Submit(Task(), kServerGroup);
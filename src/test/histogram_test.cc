@@ -0,0 +1,40 @@
+#include "gtest/gtest.h"
+#include "util/histogram.h"
+using namespace PS;
+
+TEST(Histogram, Percentile) {
+  Histogram h;
+  EXPECT_EQ(h.Percentile(.5), 0);
+  for (int i = 1; i <= 10000; ++i) h.Add(i);
+  EXPECT_EQ(h.count(), 10000);
+  EXPECT_EQ(h.max(), 10000);
+  EXPECT_DOUBLE_EQ(h.mean(), 5000.5);
+  // at most 1/16 relative error
+  for (double p : {.1, .5, .9, .99}) {
+    double v = h.Percentile(p);
+    EXPECT_GE(v, p * 10000);
+    EXPECT_LE(v, p * 10000 * (1 + 1.0 / 16));
+  }
+  EXPECT_EQ(h.Percentile(1), 10000);
+}
+
+TEST(Histogram, Small) {
+  Histogram h;
+  for (int i = 0; i < 16; ++i) h.Add(i);
+  for (int i = 0; i < 16; ++i) EXPECT_EQ(h.Percentile((i + 1) / 16.0), i);
+  h.Add((uint64)1 << 50);
+  EXPECT_EQ(h.Percentile(1), (uint64)1 << 50);
+}
+
+TEST(Histogram, Threads) {
+  Histogram h;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.push_back(std::thread([&h]() {
+          for (int i = 0; i < 100000; ++i) h.Add(i % 1000);
+        }));
+  }
+  for (auto& t : threads) t.join();
+  EXPECT_EQ(h.count(), 400000);
+  EXPECT_EQ(h.max(), 999);
+}
@@ -46,7 +46,7 @@ class Worker : public App {
     for (int i = 0; i < n; ++i) {
       auto& val = layers[i];
       val.SetValue(1);
-      int ts = model_.Push(
+      int64 ts = model_.Push(
           Parameter::Request(i), val.data(), val.size());
       pull_time[i] = model_.Pull(
           Parameter::Request(i, -1, {ts}), val.data(), val.size(),
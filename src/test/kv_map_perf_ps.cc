@@ -1,5 +1,10 @@
 /**
  * @brief  Performance test of KVMap
+ *
+ * By default workers push and pull the keys in ../test/keys. With -num_keys,
+ * they use random synthetic keys instead, e.g. with 100M keys on 4 servers
+ *
+ *   script/local.sh 4 1 -num_keys 100000000 -batch 1000000 -n 500 -flat_map
  */
 #include <random>
 #include "ps.h"
@@ -9,6 +14,12 @@
 #include "util/resource_usage.h"
 namespace PS {
 DEFINE_int32(n, 10, "repeat n times");
+DEFINE_int32(server_threads, 1, "the number of threads a server uses");
+DEFINE_bool(flat_map, false, "servers store the entries in FlatMap instead of "
+            "std::unordered_map");
+DEFINE_uint64(num_keys, 0, "if positive, use random keys chosen from this "
+              "number of distinct keys");
+DEFINE_int32(batch, 1000000, "the number of synthetic keys in a message");
 
 typedef uint64 K;  // key
 typedef float V;   // value type
@@ -19,24 +30,39 @@ struct Entry {
   V value = 0;
 };
 
+template <typename M>
 class Server : public App {
+ public:
+  Server() { vec_.ProcessInParallel(FLAGS_server_threads); }
+  virtual ~Server() {
+    size_t n = vec_.size();
+    double mem = ResUsage::myPhyMem();
+    printf("%s: %lu keys, memory %.1lf MB, %.1lf bytes per key\n",
+           MyNodeID().c_str(), n, mem, n ? mem * 1e6 / n : 0);
+  }
  private:
-  KVMap<K, V, Entry> vec_;
+  KVMap<K, V, Entry, KVMapState, M> vec_;
 };
 
 class Worker : public App {
  public:
   virtual void Run() {
     std::random_device rd;
-    std::mt19937 gen(rd());
+    std::mt19937_64 gen(rd());
     std::uniform_int_distribution<> dis(0, 21);
-    size_t bytes = 0;
-    auto tv = tic();
+    size_t bytes = 0, keys = 0;
+    double time = 0;
     for (int i = 0; i < FLAGS_n; ++i) {
-
-      int k = dis(gen);
       SArray<K> key;
-      key.ReadFromFile("../test/keys/key_" + std::to_string(k));
+      if (FLAGS_num_keys) {
+        // spread the keys over the whole key range, so servers get even parts
+        key.resize(FLAGS_batch);
+        for (auto& k : key) k = (gen() % FLAGS_num_keys) * 0x9E3779B97F4A7C15;
+        std::sort(key.begin(), key.end());
+        key.resize(std::unique(key.begin(), key.end()) - key.begin());
+      } else {
+        key.ReadFromFile("../test/keys/key_" + std::to_string(dis(gen)));
+      }
       SArray<V> val(key.size());
       ParamInitConfig cf;
       cf.set_type(ParamInitConfig::GAUSSIAN);
@@ -44,16 +70,19 @@ class Worker : public App {
       cf.set_std(1);
       val.SetValue(cf);
 
-      int ts = vec_.Push(Parameter::Request(i), key, {val});
+      auto tv = tic();
+      int64 ts = vec_.Push(Parameter::Request(i), key, {val});
       vec_.Wait(vec_.Pull(Parameter::Request(i, ts+1, {ts}), key));
+      time += toc(tv);
       CHECK_EQ(vec_[i].value.size(), key.size());
       vec_.Clear(i);
       bytes += key.size() * (sizeof(K) + sizeof(V)) * 2;
+      keys += key.size();
     }
 
-    double thr = (double) bytes / toc(tv) / 1000000;
-    printf("%s: %d push/pull, throughput %.3lf MB/sec\n",
-           MyNodeID().c_str(), FLAGS_n, thr);
+    printf("%s: %d push/pull, throughput %.3lf MB/sec, %.3lf M keys/sec\n",
+           MyNodeID().c_str(), FLAGS_n, (double) bytes / time / 1000000,
+           (double) keys / time / 1000000);
   }
  private:
   KVVector<K, V> vec_;
@@ -61,7 +90,10 @@ class Worker : public App {
 
 App* App::Create(const std::string& conf) {
   if (IsWorker()) return new Worker();
-  if (IsServer()) return new Server();
+  if (IsServer()) {
+    if (FLAGS_flat_map) return new Server<FlatMap<K, Entry>>();
+    return new Server<std::unordered_map<K, Entry>>();
+  }
   return new App();
 }
 
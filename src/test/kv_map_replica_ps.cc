@@ -0,0 +1,41 @@
+/**
+ * @brief  Test of server replication. Workers keep pushing to KVMap and pull
+ * at last. Kill a server meanwhile, its key range should be taken over by its
+ * replica, and the pulled values are still correct, e.g.
+ *
+ *   script/local.sh 3 1 build/kv_map_replica_ps -num_replicas 1 &
+ *   sleep 3; pkill -9 -f "id:'S1'"
+ */
+#include "parameter/kv_map.h"
+#include "test/kv_test_worker.h"
+namespace PS {
+
+class Server : public App {
+ public:
+  virtual ~Server() {
+    size_t n = 0;
+    for (const auto& it : model_.replicas()) n += it.second.size();
+    LOG(INFO) << MyNodeID() << ": " << model_.size() << " entries, "
+              << n << " entries of other servers";
+  }
+ private:
+  class Model : public KVMap<K, V> {
+   public:
+    size_t size() { return data_[0].size(); }
+    const std::unordered_map<NodeID, std::unordered_map<K, KVMapEntry<V>>>&
+    replicas() { return replica_; }
+  };
+  Model model_;
+};
+
+App* App::Create(const std::string& conf) {
+  if (IsWorker()) return new KVTestWorker();
+  if (IsServer()) return new Server();
+  return new App();
+}
+
+}  // namespace PS
+
+int main(int argc, char *argv[]) {
+  return PS::RunSystem(argc, argv);
+}
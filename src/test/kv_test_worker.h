@@ -0,0 +1,57 @@
+/**
+ * @brief The worker of the tests of server failures, key migrations and
+ * checkpoints. The -n keys are spread over the whole key range, so every server
+ * gets some of them. By default it pushes value r to all keys in round r = 1,
+ * ..., -rounds with -interval milliseconds in between, and then pulls them and
+ * checks that the last push is kept.
+ */
+#pragma once
+#include "ps.h"
+#include "parameter/kv_vector.h"
+DEFINE_int32(n, 100000, "the number of keys");
+DEFINE_int32(rounds, 100, "the number of pushes of each worker");
+DEFINE_int32(interval, 100, "the milliseconds between two pushes");
+namespace PS {
+typedef uint64 K;  // key
+typedef float V;   // value type
+
+class KVTestWorker : public App {
+ public:
+  KVTestWorker() : key_(FLAGS_n) {
+    K step = kMaxKey / FLAGS_n;
+    for (int i = 0; i < FLAGS_n; ++i) key_[i] = step * i;
+  }
+  virtual ~KVTestWorker() { }
+
+  virtual void Run() {
+    for (int r = 1; r <= FLAGS_rounds; ++r) {
+      Push(key_, r);
+      std::this_thread::sleep_for(std::chrono::milliseconds(FLAGS_interval));
+    }
+    Check([](int i) { return (V)FLAGS_rounds; });
+  }
+
+ protected:
+  // pushes value "v" to all keys in "key"
+  void Push(const SArray<K>& key, V v) {
+    vec_.Wait(vec_.Push(Parameter::Request(0), key, {SArray<V>(key.size(), v)}));
+  }
+
+  // pulls all keys, and fails if the i-th value is not expected(i)
+  void Check(const std::function<V(int)>& expected) {
+    vec_.Wait(vec_.Pull(Parameter::Request(0), key_));
+    const auto& val = vec_[0].value;
+    CHECK_EQ(val.size(), key_.size());
+    int wrong = 0;
+    for (int i = 0; i < FLAGS_n; ++i) wrong += val[i] != expected(i);
+    CHECK_EQ(wrong, 0) << MyNodeID() << ": " << wrong << " of " << FLAGS_n
+                       << " pulled values are wrong";
+    printf("%s: all %d pulled values are correct\n", MyNodeID().c_str(),
+           FLAGS_n);
+  }
+
+  SArray<K> key_;
+  KVVector<K, V> vec_;
+};
+
+}  // namespace PS
@@ -46,7 +46,7 @@ class Worker : public App {
     SArray<V> val1 = {1, 2, 1, 2, 1, 2, 1, 2};
     SArray<V> val2 = {3, 4, 3, 4, 3, 4, 3, 4};
 
-    int ts = vec_.Push(Parameter::Request(4), key, {val1, val2});
+    int64 ts = vec_.Push(Parameter::Request(4), key, {val1, val2});
     // this pull request will depends on a virtual timestamp ts+1 which is used for
     // aggregation
     vec_.Wait(vec_.Pull(Parameter::Request(4, ts+2, {ts+1}), key));
@@ -44,8 +44,8 @@ class Worker : public App {
       key = {0, 1, 3, 4};
     }
 
-    int ts1 = vec_.Pull(Parameter::Request(0), key);
-    int ts2 = vec_.Pull(Parameter::Request(1), key);
+    int64 ts1 = vec_.Pull(Parameter::Request(0), key);
+    int64 ts2 = vec_.Pull(Parameter::Request(1), key);
 
     vec_.Wait(ts1);
     std::cout << MyNodeID() << ": pulled value in channel 0 " << vec_[0].value
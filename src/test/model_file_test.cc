@@ -0,0 +1,104 @@
+#include "gtest/gtest.h"
+#include "util/model_file.h"
+using namespace PS;
+
+// writes n sorted keys with gaps, then looks up both the written keys and the
+// gaps between them
+void TestModelFile(size_t n, bool compress) {
+  SArray<uint64> key(n);
+  SArray<float> val(n);
+  for (size_t i = 0; i < n; ++i) {
+    key[i] = i * 3 + 1;
+    val[i] = (float)i / 2;
+  }
+  std::string file = "/tmp/model_file_test";
+  ModelFile<uint64, float>::Write(file, key, val, 1, compress, 1000);
+
+  ModelFile<uint64, float> model;
+  ASSERT_TRUE(model.Open(file));
+  EXPECT_EQ(model.size(), n);
+  if (n) {
+    EXPECT_EQ(model.front(), key.front());
+    EXPECT_EQ(model.back(), key.back());
+  }
+  float v;
+  for (size_t i = 0; i < n; ++i) {
+    ASSERT_TRUE(model.Get(key[i], &v));
+    EXPECT_EQ(v, val[i]);
+    EXPECT_FALSE(model.Get(key[i] + 1, &v));
+  }
+  EXPECT_FALSE(model.Get(0, &v));
+  EXPECT_FALSE(model.Get(n * 3 + 1, &v));
+
+  // random lookups, which move between the blocks if compressed
+  srand(0);
+  for (size_t i = 0; n && i < 10000; ++i) {
+    size_t j = rand() % n;
+    ASSERT_TRUE(model.Get(key[j], &v));
+    EXPECT_EQ(v, val[j]);
+  }
+
+  // the value size does not match
+  ModelFile<uint64, double> wrong;
+  EXPECT_FALSE(wrong.Open(file));
+}
+
+TEST(ModelFile, Plain) {
+  TestModelFile(0, false);
+  TestModelFile(1, false);
+  TestModelFile(100000, false);
+}
+
+TEST(ModelFile, Compressed) {
+  TestModelFile(0, true);
+  TestModelFile(1, true);
+  TestModelFile(100000, true);
+}
+
+TEST(ModelFile, MultiValues) {
+  int k = 3;
+  SArray<uint64> key(1000);
+  SArray<float> val(key.size() * k);
+  for (size_t i = 0; i < key.size(); ++i) key[i] = i * 10;
+  for (size_t i = 0; i < val.size(); ++i) val[i] = i;
+  std::string file = "/tmp/model_file_test";
+  for (bool compress : {false, true}) {
+    ModelFile<uint64, float>::Write(file, key, val, k, compress, 100);
+    ModelFile<uint64, float> model;
+    ASSERT_TRUE(model.Open(file));
+    EXPECT_EQ(model.k(), k);
+    float v[3];
+    ASSERT_TRUE(model.Get(990, v));
+    for (int j = 0; j < k; ++j) EXPECT_EQ(v[j], val[99 * k + j]);
+  }
+}
+
+// a truncated or corrupt file is rejected by Open rather than crashing
+TEST(ModelFile, Corrupt) {
+  SArray<uint64> key(10000);
+  SArray<float> val(key.size());
+  for (size_t i = 0; i < key.size(); ++i) { key[i] = i * 2; val[i] = i; }
+  std::string file = "/tmp/model_file_test";
+  for (bool compress : {false, true}) {
+    ModelFile<uint64, float>::Write(file, key, val, 1, compress, 1000);
+    size_t bytes = File::size(file);
+    ASSERT_EQ(truncate(file.c_str(), bytes - 1), 0);
+    ModelFile<uint64, float> model;
+    EXPECT_FALSE(model.Open(file));
+    // only the header and a part of the index are left
+    ASSERT_EQ(truncate(file.c_str(), 100), 0);
+    EXPECT_FALSE(model.Open(file));
+  }
+
+  // the end offset of the compressed blocks is beyond the file
+  ModelFile<uint64, float>::Write(file, key, val, 1, true, 1000);
+  {
+    std::unique_ptr<File> f(File::openOrDie(file, "r+"));
+    uint64 nb = 10, end = 1ULL << 40;
+    f->seek(64 + nb * sizeof(uint64) + nb * sizeof(uint64));
+    f->writeOrDie(&end, sizeof(end));
+    f->close();
+  }
+  ModelFile<uint64, float> model;
+  EXPECT_FALSE(model.Open(file));
+}
@@ -4,6 +4,12 @@
 DEFINE_int32(n, 1000, "repeat n times");
 DEFINE_int32(data_size, 1000,
               "data in KB sent from a worker to a server");
+DEFINE_int32(small_msg, 0,
+             "if > 0, send n small messages with this number of bytes, and "
+             "report messages/sec. run with -frame_pool_size 0 to compare "
+             "with allocating buffers for every message, or with -van tcp to "
+             "compare the transports");
+DEFINE_int32(window, 100, "the max number of unfinished small messages");
 DEFINE_bool(server_aggregation, false,
             "servers will aggregate the data from servs if true");
 namespace PS {
@@ -29,6 +35,10 @@ class Worker : public App {
   }
 
   virtual void Run() {
+    if (FLAGS_small_msg > 0) {
+      SendSmallMessages();
+      return;
+    }
     int n = FLAGS_n;
     int m = FLAGS_data_size;
     auto tv = tic();
@@ -37,13 +47,34 @@ class Worker : public App {
       Message msg;
       msg.add_value(val);
       msg.recver = kServerGroup;
-      int ts = Submit(&msg);
+      int64 ts = Submit(&msg);
       Wait(ts);
     }
     double thr = (double)m / 1000.0 * n * sys_.manager().num_servers() / toc(tv);
     printf("%s: packet size: %d KB, throughput %.3lf MB/sec\n",
            MyNodeID().c_str(), m, thr);
   }
+
+  void SendSmallMessages() {
+    int n = FLAGS_n;
+    SArray<char> val(FLAGS_small_msg, 1);
+    std::deque<int64> pending;
+    auto tv = tic();
+    for (int j = 0; j < n; ++j) {
+      Message msg;
+      msg.add_value(val);
+      msg.recver = kServerGroup;
+      pending.push_back(Submit(&msg));
+      if (pending.size() >= FLAGS_window) {
+        Wait(pending.front());
+        pending.pop_front();
+      }
+    }
+    for (int64 ts : pending) Wait(ts);
+    double thr = (double)n * sys_.manager().num_servers() / toc(tv);
+    printf("%s: packet size: %d bytes, throughput %.0lf messages/sec\n",
+           MyNodeID().c_str(), FLAGS_small_msg, thr);
+  }
 };
 
 App* App::Create(const std::string& conf) {
@@ -0,0 +1,73 @@
+#include "gtest/gtest.h"
+#include "system/request_tracker.h"
+using namespace PS;
+
+TEST(RequestTracker, InOrder) {
+  RequestTracker tracker;
+  EXPECT_TRUE(tracker.IsFinished(-1));
+  EXPECT_FALSE(tracker.IsFinished(0));
+  for (int64 t = 0; t < 100000; ++t) {
+    tracker.Finish(t);
+    EXPECT_TRUE(tracker.IsFinished(t));
+    EXPECT_FALSE(tracker.IsFinished(t+1));
+  }
+  EXPECT_EQ(tracker.watermark(), 100000);
+  // nothing is kept for finished timestamps
+  EXPECT_LE(tracker.capacity(), 64);
+}
+
+TEST(RequestTracker, OutOfOrder) {
+  RequestTracker tracker;
+  int n = 10000;
+  std::vector<int64> ts(n);
+  for (int i = 0; i < n; ++i) ts[i] = i;
+  srand(0);
+  std::random_shuffle(ts.begin(), ts.end());
+  std::vector<bool> finished(n);
+  for (int i = 0; i < n; ++i) {
+    tracker.Finish(ts[i]);
+    finished[ts[i]] = true;
+    if (i % 100 == 0) {
+      for (int t = 0; t < n; ++t) EXPECT_EQ(tracker.IsFinished(t), finished[t]);
+    }
+  }
+  EXPECT_EQ(tracker.watermark(), n);
+}
+
+TEST(RequestTracker, Large) {
+  RequestTracker tracker;
+  int64 begin = ((int64)1 << 31) - 1000;
+  int64 end = ((int64)1 << 33);
+  // skip to begin
+  EXPECT_TRUE(tracker.Finish(begin));
+  EXPECT_EQ(tracker.watermark(), begin - (1 << 20) + 1);
+  EXPECT_TRUE(tracker.IsFinished(begin));
+  EXPECT_FALSE(tracker.IsFinished(begin + 1));
+
+  // every other timestamp, then the rest
+  for (int64 t = begin + 2; t < begin + 4000; t += 2) tracker.Finish(t);
+  EXPECT_FALSE(tracker.IsFinished(begin + 1));
+  EXPECT_TRUE(tracker.IsFinished(begin + 2));
+  for (int64 t = begin + 1; t < begin + 4000; t += 2) tracker.Finish(t);
+  for (int64 t = begin; t < begin + 4000; ++t) {
+    EXPECT_TRUE(tracker.IsFinished(t));
+  }
+  EXPECT_FALSE(tracker.IsFinished(begin + 4000));
+
+  for (int64 t = end - 10; t < end; ++t) tracker.Finish(t);
+  EXPECT_TRUE(tracker.IsFinished(end - 1));
+  EXPECT_FALSE(tracker.IsFinished(end));
+  EXPECT_LE(tracker.capacity(), 1 << 20);
+}
+
+TEST(RequestTracker, MaxWindow) {
+  RequestTracker tracker(100);
+  // 0 is never finished
+  for (int64 t = 1; t < 100; ++t) EXPECT_FALSE(tracker.Finish(t));
+  EXPECT_FALSE(tracker.IsFinished(0));
+  EXPECT_EQ(tracker.watermark(), 0);
+  EXPECT_TRUE(tracker.Finish(100));
+  EXPECT_TRUE(tracker.IsFinished(0));
+  EXPECT_EQ(tracker.watermark(), 101);
+  EXPECT_LE(tracker.capacity(), 128);
+}
@@ -0,0 +1,47 @@
+/**
+ * @brief Test of adding and removing servers at runtime. Workers keep pushing
+ * to KVVector and pull at last. The scheduler removes server "-remove" after
+ * "-remove_delay" seconds, and a server started later with the same
+ * -num_servers splits the largest key range. The pulled values should be still
+ * correct, e.g.
+ *
+ *   script/local.sh 3 2 build/server_migration_ps -remove S0 &
+ *   sleep 2; build/server_migration_ps -num_servers 3 -num_workers 2 \
+ *     -my_node "role:SERVER,hostname:'127.0.0.1',port:9700,id:'S3'" \
+ *     -scheduler "role:SCHEDULER,hostname:'127.0.0.1',port:8001,id:'H'"
+ */
+#include "test/kv_test_worker.h"
+DEFINE_string(remove, "", "the server to remove");
+DEFINE_int32(remove_delay, 3, "remove the server after this many seconds");
+namespace PS {
+
+class Scheduler : public App {
+ public:
+  virtual void Run() {
+    if (FLAGS_remove.empty()) return;
+    std::this_thread::sleep_for(std::chrono::seconds(FLAGS_remove_delay));
+    sys_.manager().RemoveServer(FLAGS_remove);
+  }
+};
+
+class Server : public App {
+ public:
+  virtual ~Server() {
+    LOG(INFO) << MyNodeID() << ": key range "
+              << Range<Key>(MyNode().key()).ToString();
+  }
+ private:
+  KVVector<K, V> vec_;
+};
+
+App* App::Create(const std::string& conf) {
+  if (IsWorker()) return new KVTestWorker();
+  if (IsServer()) return new Server();
+  return new Scheduler();
+}
+
+}  // namespace PS
+
+int main(int argc, char *argv[]) {
+  return PS::RunSystem(argc, argv);
+}
@@ -0,0 +1,78 @@
+#include "gtest/gtest.h"
+#include "system/shm_ring.h"
+#include "util/shared_array_inl.h"
+using namespace PS;
+
+SArray<char> RandArray(size_t n) {
+  SArray<char> a(n);
+  for (size_t i = 0; i < n; ++i) a[i] = rand() % 128;
+  return a;
+}
+
+bool Equal(const SArray<char>& a, const SArray<char>& b) {
+  return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+TEST(ShmRing, ReadWrite) {
+  string name = "/ps_shm_ring_test_" + std::to_string(getpid());
+  auto writer = ShmRing::Create(name, 1 << 16);
+  ASSERT_TRUE(writer != nullptr);
+  auto reader = ShmRing::Open(name);
+  ASSERT_TRUE(reader != nullptr);
+
+  std::vector<uint64> pos;
+  for (int k = 0; k < 1000; ++k) {
+    std::vector<SArray<char>> in;
+    for (int i = 0; i < 3; ++i) in.push_back(RandArray(rand() % 5000));
+    ASSERT_TRUE(writer->Write(in, &pos));
+    ASSERT_EQ(pos.size(), in.size());
+    std::vector<SArray<char>> out;
+    for (auto p : pos) out.push_back(reader->Read(p));
+    // release in the reverse order
+    for (int i = 2; i >= 0; --i) {
+      EXPECT_TRUE(Equal(in[i], out[i]));
+      out.pop_back();
+    }
+  }
+}
+
+TEST(ShmRing, Full) {
+  string name = "/ps_shm_ring_test_" + std::to_string(getpid());
+  auto writer = ShmRing::Create(name, 1 << 16);
+  auto reader = ShmRing::Open(name);
+  std::vector<uint64> pos;
+
+  // too large
+  EXPECT_FALSE(writer->Write({RandArray(writer->capacity())}, &pos));
+
+  std::vector<SArray<char>> in, out;
+  while (true) {
+    in.push_back(RandArray(1000));
+    if (!writer->Write({in.back()}, &pos)) { in.pop_back(); break; }
+    out.push_back(reader->Read(pos[0]));
+  }
+  EXPECT_GT(in.size(), 50);
+
+  // still full if the first one is not released
+  auto first = out[0];
+  out.clear();
+  EXPECT_FALSE(writer->Write({RandArray(1000)}, &pos));
+  EXPECT_TRUE(Equal(in[0], first));
+  first.clear();
+  EXPECT_TRUE(writer->Write({RandArray(1000)}, &pos));
+}
+
+// the records of an undelivered write do not stall the ring
+TEST(ShmRing, Unwrite) {
+  string name = "/ps_shm_ring_test_" + std::to_string(getpid());
+  auto writer = ShmRing::Create(name, 1 << 16);
+  auto reader = ShmRing::Open(name);
+  std::vector<uint64> pos;
+  for (int k = 0; k < 1000; ++k) {
+    auto in = RandArray(1000);
+    ASSERT_TRUE(writer->Write({RandArray(1000)}, &pos));
+    writer->Unwrite();
+    ASSERT_TRUE(writer->Write({in}, &pos));
+    EXPECT_TRUE(Equal(in, reader->Read(pos[0])));
+  }
+}
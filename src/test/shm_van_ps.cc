@@ -0,0 +1,49 @@
+/**
+ * @brief Test of sending data through the shared memory between the nodes on
+ * the same machine. It is the same as KVTestWorker, but -shm_buffer is 16 by
+ * default, and every worker and server checks that the data are sent and
+ * received through the shared memory rather than zmq, e.g.
+ *
+ *   script/local.sh 2 2 build/shm_van_ps -rounds 10
+ */
+#include "test/kv_test_worker.h"
+namespace PS {
+DECLARE_int32(shm_buffer);
+
+// fails if nothing is sent or received through the shared memory
+void CheckShm() {
+  const auto& van = Postoffice::instance().manager().van();
+  LOG(INFO) << MyNodeID() << ": sent " << van.sent_by_shm() << " bytes and "
+            << "received " << van.received_by_shm() << " bytes through the "
+            << "shared memory";
+  CHECK_GT(van.sent_by_shm(), 0);
+  CHECK_GT(van.received_by_shm(), 0);
+}
+
+class Worker : public KVTestWorker {
+ public:
+  virtual void Run() {
+    KVTestWorker::Run();
+    CheckShm();
+  }
+};
+
+class Server : public App {
+ public:
+  virtual ~Server() { CheckShm(); }
+ private:
+  KVVector<K, V> vec_;
+};
+
+App* App::Create(const std::string& conf) {
+  if (IsWorker()) return new Worker();
+  if (IsServer()) return new Server();
+  return new App();
+}
+
+}  // namespace PS
+
+int main(int argc, char *argv[]) {
+  PS::FLAGS_shm_buffer = 16;
+  return PS::RunSystem(argc, argv);
+}
@@ -0,0 +1,63 @@
+/**
+ * @brief  Measures how long it takes to start and stop the system
+ *
+ * To simulate hundreds of nodes on a single machine:
+ *   ulimit -n 65536
+ *   script/local.sh 100 400 build/startup_perf_ps -local
+ */
+#include "ps.h"
+#include "util/resource_usage.h"
+namespace PS {
+
+// the time this process started, roughly when the nodes are launched
+static auto g_launch = tic();
+
+// Workers and servers tell the scheduler they are in App::Run
+class Member : public App {
+ public:
+  virtual void Run() {
+    printf("%s: in App::Run after %.3lf sec\n", MyNodeID().c_str(),
+           toc(g_launch));
+    Wait(Submit(Task(), SchedulerID()));
+  }
+};
+
+class Scheduler : public App {
+ public:
+  virtual void ProcessRequest(Message* request) {
+    {
+      Lock l(mu_);
+      ++ num_running_;
+    }
+    cond_.notify_all();
+  }
+
+  virtual void Run() {
+    auto& manager = sys_.manager();
+    manager.WaitServersReady();
+    manager.WaitWorkersReady();
+    int n = manager.num_servers() + manager.num_workers();
+    std::unique_lock<std::mutex> lk(mu_);
+    cond_.wait(lk, [this, n] { return num_running_ >= n; });
+    printf("all %d nodes are in App::Run after %.3lf sec\n", n, toc(g_launch));
+  }
+ private:
+  int num_running_ = 0;
+  std::mutex mu_;
+  std::condition_variable cond_;
+};
+
+App* App::Create(const std::string& conf) {
+  if (IsScheduler()) return new Scheduler();
+  return new Member();
+}
+
+}  // namespace PS
+
+int main(int argc, char *argv[]) {
+  PS::StartSystem(argc, argv);
+  auto tv = PS::tic();
+  PS::StopSystem();
+  printf("%s: stopped in %.3lf sec\n", PS::MyNodeID().c_str(), PS::toc(tv));
+  return 0;
+}
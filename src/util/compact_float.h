@@ -0,0 +1,114 @@
+#pragma once
+#include <math.h>
+#include "util/common.h"
+namespace PS {
+
+/**
+ * @brief Low precision storages of a nonnegative float, such as the
+ * accumulated gradients of AdaGrad and FTRL in a server entry.
+ *
+ * A storage has get() and set(x). set rounds x stochastically, namely up with
+ * the probability of its distance to the lower representable value, and down
+ * otherwise. So the rounding is unbiased, and the small increments of an
+ * accumulator are not always lost. Values beyond the range are clamped.
+ *
+ * - Float32: the float itself, 4 bytes
+ * - Float16: IEEE half precision, 2 bytes, in [6e-8, 65504]
+ * - BFloat16: the higher 16 bits of a float, 2 bytes, 8 significant bits
+ * - LogFloat8: 1 byte, 0 or 2^(-16 + i/8) for i = 0, ..., 254, so in [1.5e-5,
+ *   5.5e4] with a 9% relative step
+ */
+struct Float32 {
+  float get() const { return v; }
+  void set(float x) { v = x; }
+  float v = 0;
+};
+
+/// @brief The state of the xorshift generator of the rounding, one per thread.
+/// It starts from a fixed seed, so a run with the same thread and the same
+/// sequence of set is reproducible
+inline uint32& CompactFloatState() {
+  static thread_local uint32 s = 2463534242U;
+  return s;
+}
+
+/// @brief Restarts the generator of the calling thread from "seed"
+inline void SeedCompactFloat(uint32 seed) {
+  // xorshift stays 0 from 0
+  CompactFloatState() = seed ? seed : 2463534242U;
+}
+
+/// @brief A uniform random number in [1, 2^32) of the calling thread
+inline uint32 CompactFloatRand() {
+  uint32& s = CompactFloatState();
+  s ^= s << 13; s ^= s >> 17; s ^= s << 5;
+  return s;
+}
+
+struct Float16 {
+  float get() const {
+    uint32 e = bits >> 10, m = bits & 0x3FF;
+    if (e == 0) return m * (1.0f / (1 << 24));  // subnormal
+    uint32 u = ((e + 127 - 15) << 23) | (m << 13);
+    float x; memcpy(&x, &u, 4);
+    return x;
+  }
+  void set(float x) {
+    if (!(x > 0)) { bits = 0; return; }
+    if (x >= 65504.0f) { bits = 0x7BFF; return; }
+    if (x < 1.0f / (1 << 14)) {
+      // subnormal, in units of 2^-24, the largest one rounds up to the
+      // smallest normal 0x400
+      bits = (uint16)(x * (1 << 24) + CompactFloatRand() * (1.0 / 4294967296.0));
+      return;
+    }
+    uint32 u; memcpy(&u, &x, 4);
+    // add a random number below the dropped 13 bits, the carry rounds up
+    u += CompactFloatRand() & 0x1FFF;
+    uint32 e = (u >> 23) - 127 + 15;
+    bits = e >= 31 ? 0x7BFF : (uint16)((e << 10) | ((u >> 13) & 0x3FF));
+  }
+  uint16 bits = 0;
+};
+
+struct BFloat16 {
+  float get() const {
+    uint32 u = (uint32)bits << 16;
+    float x; memcpy(&x, &u, 4);
+    return x;
+  }
+  void set(float x) {
+    if (!(x > 0)) { bits = 0; return; }
+    uint32 u; memcpy(&u, &x, 4);
+    uint64 r = (uint64)u + (CompactFloatRand() & 0xFFFF);
+    bits = r >= 0x7F800000 ? 0x7F7F : (uint16)(r >> 16);
+  }
+  uint16 bits = 0;
+};
+
+struct LogFloat8 {
+  float get() const { return Table()[code]; }
+  void set(float x) {
+    const float* t = Table();
+    if (!(x > 0)) { code = 0; return; }
+    if (x >= t[255]) { code = 255; return; }
+    // the lower code c with t[c] <= x < t[c+1]
+    int c = x < t[1] ? 0 : std::min(254, 1 + (int)((log2f(x) + 16) * 8));
+    if (t[c] > x) -- c;
+    if (t[c+1] <= x) ++ c;
+    float p = (x - t[c]) / (t[c+1] - t[c]);
+    code = c + (CompactFloatRand() * (1.0 / 4294967296.0) < p);
+  }
+  uint8 code = 0;
+ private:
+  static const float* Table() {
+    static const std::vector<float> t = []() {
+        std::vector<float> t(256, 0);
+        for (int i = 1; i < 256; ++i) t[i] = exp2(-16 + (i - 1) / 8.0);
+        return t;
+      }();
+    return t.data();
+  }
+};
+
+}  // namespace PS
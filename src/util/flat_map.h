@@ -0,0 +1,301 @@
+#pragma once
+#include "util/common.h"
+namespace PS {
+
+/**
+ * @brief A hash map storing the entries in a flat array with open addressing.
+ *
+ * Compared to std::unordered_map, it has no per-entry node and pointer. The
+ * keys and the values are stored in two arrays, so an entry costs sizeof(K) +
+ * sizeof(V) plus a control byte without padding, and the load factor is up to
+ * 7/8. A lookup usually touches one cache line of control bytes, one of keys,
+ * and the value.
+ *
+ * The slots are probed in groups of 8. Each slot has a control byte, which is
+ * either empty, deleted, or the 7-bit tag of the hash of its key. A group of
+ * control bytes is loaded as a uint64 and matched against the tag with a few
+ * word operations, so only the slots with the same tag compare the keys. Erased
+ * slots are marked as deleted, and cleaned by the next rehash.
+ *
+ * The interface is a subset of std::unordered_map. Inserting may move the
+ * entries, which invalidates the iterators and the references to the
+ * entries. Erasing does not. Not thread safe, KVMap gives each processing
+ * thread its own map.
+ *
+ * @tparam K the key type
+ * @tparam V the value type, which must be default constructible
+ */
+template <typename K, typename V, typename Hash = std::hash<K>>
+class FlatMap {
+ public:
+  /// @brief An entry, dereferenced from an iterator
+  template <bool kConst>
+  struct Ref {
+    const K& first;
+    typename std::conditional<kConst, const V, V>::type& second;
+  };
+
+  template <bool kConst>
+  class Iter {
+   public:
+    typedef typename std::conditional<kConst, const FlatMap, FlatMap>::type Map;
+    Iter() { }
+    Iter(Map* map, size_t i) : map_(map), i_(i) { Skip(); }
+    // iterator to const_iterator
+    Iter(const Iter<false>& it) : map_(it.map_), i_(it.i_) { }
+
+    Ref<kConst> operator*() const {
+      return Ref<kConst>{map_->keys_[i_], map_->vals_[i_]};
+    }
+    struct Arrow {
+      Ref<kConst> ref;
+      const Ref<kConst>* operator->() const { return &ref; }
+    };
+    Arrow operator->() const { return Arrow{**this}; }
+    Iter& operator++() { ++ i_; Skip(); return *this; }
+    Iter operator++(int) { Iter it = *this; ++ *this; return it; }
+    bool operator==(const Iter& it) const { return i_ == it.i_; }
+    bool operator!=(const Iter& it) const { return i_ != it.i_; }
+   private:
+    friend class FlatMap;
+    template <bool> friend class Iter;
+    // moves to the next full slot
+    void Skip() {
+      size_t n = map_->capacity();
+      while (i_ < n && !IsFull(map_->ctrl_[i_])) ++ i_;
+    }
+    Map* map_ = nullptr;
+    size_t i_ = 0;
+  };
+  typedef Iter<false> iterator;
+  typedef Iter<true> const_iterator;
+
+  FlatMap() { }
+  ~FlatMap() { }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  /// @brief the number of slots
+  size_t capacity() const { return ctrl_.size(); }
+
+  /// @brief Removes all entries and frees the memory
+  void clear() {
+    std::vector<uint8>().swap(ctrl_);
+    std::vector<K>().swap(keys_);
+    std::vector<V>().swap(vals_);
+    size_ = deleted_ = 0;
+  }
+
+  void swap(FlatMap& other) {
+    ctrl_.swap(other.ctrl_);
+    keys_.swap(other.keys_);
+    vals_.swap(other.vals_);
+    std::swap(size_, other.size_);
+    std::swap(deleted_, other.deleted_);
+  }
+
+  /// @brief Makes room for "n" entries without rehashing
+  void reserve(size_t n) {
+    if (n * 8 > capacity() * 7) Rehash(Capacity(n));
+  }
+
+  /// @brief Returns the value of "key", inserts a default one if not found
+  V& operator[](const K& key) {
+    size_t i;
+    if (Find(key, &i)) return vals_[i];
+    return vals_[Insert(key)];
+  }
+
+  /**
+   * @brief Calls f(i, (*this)[key[i]]) for i = 0, ..., n-1.
+   *
+   * The keys are hashed in batches, and the slots of a key are prefetched
+   * several keys ahead, so the cache misses of different keys overlap instead
+   * of one after another.
+   */
+  template <typename F>
+  void visit(const K* key, size_t n, F f) {
+    const size_t kBatch = 256, kAhead = 16;
+    uint64 h[kBatch];
+    for (size_t b = 0; b < n; b += kBatch) {
+      size_t m = std::min(kBatch, n - b);
+      for (size_t j = 0; j < m; ++j) h[j] = Mix(key[b+j]);
+      for (size_t j = 0; j < std::min(kAhead, m); ++j) Prefetch(h[j]);
+      for (size_t j = 0; j < m; ++j) {
+        if (j + kAhead < m) Prefetch(h[j + kAhead]);
+        size_t i;
+        if (!Find(key[b+j], h[j], &i)) i = Insert(key[b+j], h[j]);
+        f(b + j, vals_[i]);
+      }
+    }
+  }
+
+  iterator find(const K& key) {
+    size_t i;
+    return Find(key, &i) ? iterator(this, i) : end();
+  }
+  const_iterator find(const K& key) const {
+    size_t i;
+    return Find(key, &i) ? const_iterator(this, i) : end();
+  }
+  size_t count(const K& key) const { size_t i; return Find(key, &i); }
+
+  /// @brief Erases the entry at "it", returns the iterator to the next one
+  iterator erase(iterator it) {
+    Erase(it.i_);
+    return ++ it;
+  }
+  size_t erase(const K& key) {
+    size_t i;
+    if (!Find(key, &i)) return 0;
+    Erase(i);
+    return 1;
+  }
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, capacity()); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, capacity()); }
+
+ private:
+  static const uint8 kEmpty = 0x80;
+  static const uint8 kDeleted = 0xFE;
+  static const size_t kGroup = 8;
+  static const uint64 kLsbs = 0x0101010101010101ULL;
+  static const uint64 kMsbs = 0x8080808080808080ULL;
+  static bool IsFull(uint8 c) { return (c & 0x80) == 0; }
+
+  // the 64-bit finalizer of murmurhash3, std::hash of integers is the identity
+  static uint64 Mix(const K& key) {
+    uint64 h = Hash()(key);
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+  // the highest 7 bits are the tag, the lowest ones are the position
+  static uint8 Tag(uint64 h) { return h >> 57; }
+
+  // the control bytes of the group starting at "g", the i-th byte of the group
+  // is the i-th byte of the returned word
+  uint64 Load(size_t g) const {
+    uint64 c;
+    memcpy(&c, ctrl_.data() + g, sizeof(c));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    c = __builtin_bswap64(c);
+#endif
+    return c;
+  }
+  // the msb of a byte is set if the byte equals "tag". it may also be set for a
+  // full byte next to a matched one, so the keys still need to be compared
+  static uint64 Match(uint64 c, uint8 tag) {
+    uint64 x = c ^ (kLsbs * tag);
+    return (x - kLsbs) & ~x & kMsbs;
+  }
+  // exact, empty is 0x80 while deleted is 0xFE
+  static uint64 MatchEmpty(uint64 c) { return c & (~c << 6) & kMsbs; }
+  static uint64 MatchEmptyOrDeleted(uint64 c) { return c & kMsbs; }
+  // the index in the group of the lowest matched byte
+  static size_t Lowest(uint64 m) { return __builtin_ctzll(m) >> 3; }
+
+  // prefetches the control bytes, the keys and the values of the group of hash
+  // "h". the values of a group may span two cache lines, only the first one is
+  // fetched
+  void Prefetch(uint64 h) const {
+    if (capacity() == 0) return;
+    size_t g = h & (capacity() - 1) & ~(kGroup - 1);
+    __builtin_prefetch(ctrl_.data() + g);
+    __builtin_prefetch(keys_.data() + g);
+    __builtin_prefetch(vals_.data() + g);
+  }
+
+  // the smallest power of 2 capacity holding "n" entries
+  static size_t Capacity(size_t n) {
+    size_t cap = 16;
+    while (cap * 7 < n * 8) cap *= 2;
+    return cap;
+  }
+
+  bool Find(const K& key, size_t* i) const { return Find(key, Mix(key), i); }
+  bool Find(const K& key, uint64 h, size_t* i) const {
+    if (size_ == 0) return false;
+    size_t mask = capacity() - 1;
+    uint8 tag = Tag(h);
+    size_t g = h & mask & ~(kGroup - 1);
+    for (size_t probe = 0; probe < capacity(); probe += kGroup) {
+      uint64 c = Load(g);
+      for (uint64 m = Match(c, tag); m; m &= m - 1) {
+        size_t j = g + Lowest(m);
+        if (keys_[j] == key) { *i = j; return true; }
+      }
+      if (MatchEmpty(c)) return false;
+      g = (g + kGroup) & mask;
+    }
+    return false;
+  }
+
+  // inserts "key", which does not exist, with a default value
+  size_t Insert(const K& key) { return Insert(key, Mix(key)); }
+  size_t Insert(const K& key, uint64 h) {
+    if ((size_ + deleted_ + 1) * 8 > capacity() * 7) {
+      // rehash without growing if half of the used slots are deleted
+      size_t cap = deleted_ > size_ ? capacity() : capacity() * 2;
+      Rehash(std::max<size_t>(16, cap));
+    }
+    size_t i = Claim(h);
+    keys_[i] = key;
+    vals_[i] = V();
+    return i;
+  }
+
+  // marks the first empty or deleted slot in the probe sequence of hash "h" as
+  // full, there must be one
+  size_t Claim(uint64 h) {
+    size_t mask = capacity() - 1;
+    size_t g = h & mask & ~(kGroup - 1);
+    while (true) {
+      uint64 m = MatchEmptyOrDeleted(Load(g));
+      if (m) {
+        size_t i = g + Lowest(m);
+        if (ctrl_[i] == kDeleted) -- deleted_;
+        ctrl_[i] = Tag(h);
+        ++ size_;
+        return i;
+      }
+      g = (g + kGroup) & mask;
+    }
+  }
+
+  void Erase(size_t i) {
+    ctrl_[i] = kDeleted;
+    vals_[i] = V();
+    -- size_;
+    ++ deleted_;
+  }
+
+  void Rehash(size_t cap) {
+    CHECK_EQ(cap & (cap - 1), 0);
+    std::vector<uint8> ctrl(cap, (uint8)kEmpty);
+    std::vector<K> keys(cap);
+    std::vector<V> vals(cap);
+    ctrl.swap(ctrl_);
+    keys.swap(keys_);
+    vals.swap(vals_);
+    size_ = deleted_ = 0;
+    for (size_t i = 0; i < ctrl.size(); ++i) {
+      if (!IsFull(ctrl[i])) continue;
+      size_t j = Claim(Mix(keys[i]));
+      keys_[j] = keys[i];
+      vals_[j] = std::move(vals[i]);
+    }
+  }
+
+  std::vector<uint8> ctrl_;
+  std::vector<K> keys_;
+  std::vector<V> vals_;
+  size_t size_ = 0;
+  // the number of deleted slots
+  size_t deleted_ = 0;
+};
+
+}  // namespace PS
@@ -0,0 +1,111 @@
+#pragma once
+#include <atomic>
+#include "util/common.h"
+namespace PS {
+
+/**
+ * @brief The completion of an asynchronous operation, such as a submitted
+ * request, see Customer::WhenFinished.
+ *
+ * A future is a handle of a shared state, copying it is cheap. It is fulfilled
+ * once by Set, and then all continuations registered by Then run in the thread
+ * calling Set, or immediately in the calling thread if it is already
+ * fulfilled. Thread safe.
+ *
+ * Sample usage:
+ *
+ *   Future f = WhenFinished(Pull(..)).Then([this]() {
+ *       ComputeGradient();
+ *       return WhenFinished(Push(..));
+ *     });
+ *   f.Wait();
+ */
+class Future {
+ public:
+  Future() : state_(std::make_shared<State>()) { }
+
+  /// @brief Returns a fulfilled future
+  static Future Ready() { Future f; f.Set(); return f; }
+
+  /// @brief Returns a future fulfilled when all "futures" are fulfilled
+  static Future WhenAll(const std::vector<Future>& futures) {
+    Future all;
+    if (futures.empty()) { all.Set(); return all; }
+    auto left = std::make_shared<std::atomic<size_t>>(futures.size());
+    for (const auto& f : futures) {
+      f.OnReady([left, all]() { if (-- *left == 0) all.Set(); });
+    }
+    return all;
+  }
+
+  /// @brief Returns true if it is fulfilled, does not block
+  bool IsReady() const {
+    Lock l(state_->mu);
+    return state_->ready;
+  }
+
+  /// @brief Blocks until it is fulfilled
+  void Wait() const {
+    std::unique_lock<std::mutex> lk(state_->mu);
+    state_->cond.wait(lk, [this] { return state_->ready; });
+  }
+
+  /**
+   * @brief Runs "f" once it is fulfilled. "f" returns either void or another
+   * Future.
+   *
+   * @return a future fulfilled after "f" returns, or after the future returned
+   * by "f" is fulfilled
+   */
+  template <typename F>
+  Future Then(F f) const {
+    Future next;
+    OnReady([f, next]() {
+        RunThen(f, next, std::is_same<decltype(f()), Future>());
+      });
+    return next;
+  }
+
+  /// @brief Fulfills it, and runs the continuations. Only the first call has
+  /// effect
+  void Set() const {
+    std::vector<std::function<void()>> thens;
+    {
+      Lock l(state_->mu);
+      if (state_->ready) return;
+      state_->ready = true;
+      thens.swap(state_->thens);
+    }
+    state_->cond.notify_all();
+    for (auto& f : thens) f();
+  }
+
+ private:
+  struct State {
+    std::mutex mu;
+    std::condition_variable cond;
+    bool ready = false;
+    std::vector<std::function<void()>> thens;
+  };
+
+  void OnReady(const std::function<void()>& f) const {
+    {
+      Lock l(state_->mu);
+      if (!state_->ready) { state_->thens.push_back(f); return; }
+    }
+    f();
+  }
+
+  template <typename F>
+  static void RunThen(F& f, const Future& next, std::false_type) {
+    f(); next.Set();
+  }
+  template <typename F>
+  static void RunThen(F& f, const Future& next, std::true_type) {
+    f().OnReady([next]() { next.Set(); });
+  }
+
+  std::shared_ptr<State> state_;
+};
+
+} // namespace PS
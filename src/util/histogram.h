@@ -0,0 +1,102 @@
+#pragma once
+#include <atomic>
+#include <cmath>
+#include "util/common.h"
+namespace PS {
+
+/**
+ * @brief A lock-free histogram of latencies in microseconds.
+ *
+ * Values are put into log-linear buckets: each power of two is divided into 16
+ * buckets, so the relative error of a percentile is at most 1/16. Values up to
+ * 2^40 us are supported, the larger ones are counted in the last bucket. It is
+ * safe to call Add from multiple threads.
+ */
+class Histogram {
+ public:
+  Histogram() { Clear(); }
+
+  /// @brief The current time in microseconds from an arbitrary point
+  static uint64 Now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  /// @brief Adds the latency from "start", which is returned by Now(). Ignores
+  /// it if start is 0, namely not set.
+  void AddSince(uint64 start) {
+    if (start) Add(Now() - start);
+  }
+
+  void Add(uint64 v) {
+    buckets_[Index(v)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(v, std::memory_order_relaxed);
+    uint64 max = max_.load(std::memory_order_relaxed);
+    while (v > max && !max_.compare_exchange_weak(max, v)) { }
+  }
+
+  void Clear() {
+    for (auto& b : buckets_) b.store(0);
+    count_ = 0; sum_ = 0; max_ = 0;
+  }
+
+  uint64 count() const { return count_; }
+  uint64 max() const { return max_; }
+  double mean() const { return count_ ? (double)sum_ / count_ : 0; }
+
+  /// @brief Returns the p-th percentile, p is in [0, 1]
+  uint64 Percentile(double p) const {
+    uint64 n = count_;
+    if (n == 0) return 0;
+    uint64 target = std::max<uint64>(1, std::ceil(p * n));
+    uint64 sum = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      sum += buckets_[i].load(std::memory_order_relaxed);
+      // returns the upper bound of the bucket
+      if (sum >= target && i < kNumBuckets - 1) {
+        return std::min<uint64>(Lower(i+1) - 1, max_);
+      }
+    }
+    return max_;
+  }
+
+  /// @brief Returns a summary such as "n=10 mean=5.2 p50=4 p90=9 p99=12 max=12"
+  string ToString() const {
+    std::stringstream ss;
+    ss << "n=" << count() << " mean=" << mean() << " p50=" << Percentile(.5)
+       << " p90=" << Percentile(.9) << " p99=" << Percentile(.99)
+       << " max=" << max();
+    return ss.str();
+  }
+
+ private:
+  static const int kSubBits = 4;
+  static const int kSub = 1 << kSubBits;
+  static const int kMaxBits = 40;
+  static const int kNumBuckets = (kMaxBits - kSubBits + 1) * kSub + 1;
+
+  static int Index(uint64 v) {
+    if (v < kSub) return v;
+    int e = 63 - __builtin_clzll(v);
+    if (e >= kMaxBits) return kNumBuckets - 1;
+    return (e - kSubBits + 1) * kSub + ((v >> (e - kSubBits)) & (kSub - 1));
+  }
+
+  // the smallest value in bucket i
+  static uint64 Lower(int i) {
+    if (i < kSub) return i;
+    if (i >= kNumBuckets - 1) return (uint64)1 << kMaxBits;
+    int e = i / kSub + kSubBits - 1;
+    return ((uint64)1 << e) + ((uint64)(i % kSub) << (e - kSubBits));
+  }
+
+  std::atomic<uint64> buckets_[kNumBuckets];
+  std::atomic<uint64> count_;
+  std::atomic<uint64> sum_;
+  std::atomic<uint64> max_;
+
+  DISALLOW_COPY_AND_ASSIGN(Histogram);
+};
+
+} // namespace PS
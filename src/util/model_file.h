@@ -0,0 +1,299 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util/common.h"
+#include "util/file.h"
+#include "util/shared_array_inl.h"
+namespace PS {
+
+/**
+ * @brief A sorted binary model file, which is memory mapped and looked up
+ * without parsing.
+ *
+ * Layout: a 64-byte header, and then either the key array followed by the
+ * value array, where a value is k entries of V, or if compressed, the block
+ * index and the snappy compressed blocks. A block has block_size keys and their
+ * values. The index has the first keys of blocks, the offsets of blocks, and
+ * the compressed sizes of the keys in blocks.
+ *
+ * An uncompressed file is looked up by binary search on the mapped keys,
+ * narrowed by a sparse in-memory index. A compressed file decompresses the
+ * block containing the key, and caches the last one, so Get is not thread safe
+ * then.
+ *
+ * Sample usage:
+ *
+ *   ModelFile<Key, float>::Write("model", key, value);
+ *   ModelFile<Key, float> model;
+ *   CHECK(model.Open("model"));
+ *   float w; if (model.Get(key, &w)) ...
+ */
+template <typename K, typename V>
+class ModelFile {
+ public:
+  ModelFile() { }
+  ~ModelFile() { Close(); }
+
+  /// @brief Writes the sorted unique "key" and their "val", k entries per key,
+  /// into "file"
+  static void Write(const std::string& file, const SArray<K>& key,
+                    const SArray<V>& val, int k = 1, bool compress = false,
+                    size_t block_size = 1 << 16);
+
+  /// @brief Maps "file", returns false if it is not a model file of K and V
+  bool Open(const std::string& file);
+  void Close();
+
+  /// @brief Returns the k entries of "key" in "val", false if not found
+  bool Get(K key, V* val);
+
+  /// @brief the number of keys
+  size_t size() const { return header_ ? header_->num : 0; }
+  int k() const { return header_ ? header_->k : 1; }
+  /// @brief the smallest and the largest keys
+  K front() const { return front_; }
+  K back() const { return back_; }
+
+ private:
+  static const uint32 kMagic = 0x444d5350;  // "PSMD"
+  static const uint32 kVersion = 1;
+  static const size_t kIndexStride = 256;
+  struct Header {
+    uint32 magic;
+    uint32 version;
+    uint32 key_size;
+    uint32 value_size;
+    uint64 num;
+    uint32 k;
+    uint32 compressed;
+    uint64 block_size;
+    uint64 num_blocks;
+    uint64 reserved[2];
+  };
+  static_assert(sizeof(Header) == 64, "the header is 64 bytes");
+  static uint64 Align(uint64 x) { return (x + 7) / 8 * 8; }
+
+  // loads block "b" into the cache, returns false if it is corrupt
+  bool LoadBlock(size_t b);
+  // returns true if the block index fits the file and is consistent
+  bool CheckIndex() const;
+
+  char* data_ = nullptr;
+  size_t bytes_ = 0;
+  const Header* header_ = nullptr;
+  K front_ = 0, back_ = 0;
+
+  // uncompressed
+  const K* key_ = nullptr;
+  const V* val_ = nullptr;
+  std::vector<K> index_;  // key_[i * kIndexStride]
+
+  // compressed
+  const K* first_ = nullptr;
+  const uint64* offset_ = nullptr;
+  const uint64* key_bytes_ = nullptr;
+  size_t cached_ = (size_t)-1;
+  SArray<K> cache_key_;
+  SArray<V> cache_val_;
+};
+
+template <typename K, typename V>
+void ModelFile<K,V>::Write(const std::string& file, const SArray<K>& key,
+                           const SArray<V>& val, int k, bool compress,
+                           size_t block_size) {
+  CHECK_EQ(key.size() * k, val.size());
+  CHECK_GT(block_size, 0);
+  Header h;
+  memset(&h, 0, sizeof(h));
+  h.magic = kMagic; h.version = kVersion;
+  h.key_size = sizeof(K); h.value_size = sizeof(V);
+  h.num = key.size(); h.k = k; h.compressed = compress;
+  h.block_size = block_size;
+  h.num_blocks = compress ? (key.size() + block_size - 1) / block_size : 0;
+
+  std::unique_ptr<File> f(File::openOrDie(file, "w"));
+  f->writeOrDie(&h, sizeof(h));
+  const char zero[8] = {0};
+  if (!compress) {
+    f->writeOrDie(key.data(), key.size() * sizeof(K));
+    uint64 pos = sizeof(h) + key.size() * sizeof(K);
+    f->writeOrDie(zero, Align(pos) - pos);
+    f->writeOrDie(val.data(), val.size() * sizeof(V));
+  } else {
+    size_t nb = h.num_blocks;
+    std::vector<K> first(nb);
+    std::vector<uint64> offset(nb + 1), key_bytes(nb);
+    std::vector<SArray<char>> blocks(nb * 2);
+    uint64 pos = Align(sizeof(h) + nb * sizeof(K)) + (nb * 2 + 1) * sizeof(uint64);
+    for (size_t b = 0; b < nb; ++b) {
+      SizeR r(b * block_size, std::min((b + 1) * block_size, key.size()));
+      first[b] = key[r.begin()];
+      blocks[b*2] = key.Segment(r).CompressTo();
+      blocks[b*2+1] = val.Segment(r * k).CompressTo();
+      key_bytes[b] = blocks[b*2].size();
+      offset[b] = pos;
+      pos += blocks[b*2].size() + blocks[b*2+1].size();
+    }
+    offset[nb] = pos;
+    f->writeOrDie(first.data(), nb * sizeof(K));
+    uint64 p = sizeof(h) + nb * sizeof(K);
+    f->writeOrDie(zero, Align(p) - p);
+    f->writeOrDie(offset.data(), offset.size() * sizeof(uint64));
+    f->writeOrDie(key_bytes.data(), key_bytes.size() * sizeof(uint64));
+    for (const auto& b : blocks) f->writeOrDie(b.data(), b.size());
+  }
+  CHECK(f->flush() && f->close()) << "failed to write " << file;
+}
+
+template <typename K, typename V>
+bool ModelFile<K,V>::Open(const std::string& file) {
+  Close();
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd == -1) {
+    LOG(WARNING) << "failed to open " << file << ": " << strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+    close(fd);
+    return false;
+  }
+  bytes_ = st.st_size;
+  void* p = mmap(NULL, bytes_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    LOG(WARNING) << "failed to mmap " << file << ": " << strerror(errno);
+    return false;
+  }
+  data_ = (char*)p;
+  header_ = (const Header*)data_;
+  const Header& h = *header_;
+  if (h.magic != kMagic || h.version != kVersion || h.key_size != sizeof(K) ||
+      h.value_size != sizeof(V)) {
+    LOG(WARNING) << file << " is not a model file with " << sizeof(K)
+                 << "-byte keys and " << sizeof(V) << "-byte values";
+    Close();
+    return false;
+  }
+  if (h.num == 0) return true;
+  // the sizes are compared by division, so a corrupt header cannot overflow
+  bool ok = h.k > 0 && h.num <= bytes_ / sizeof(K);
+  if (ok && !h.compressed) {
+    uint64 pos = Align(sizeof(Header) + h.num * sizeof(K));
+    ok = pos <= bytes_ && (bytes_ - pos) / sizeof(V) / h.k >= h.num;
+    if (ok) {
+      key_ = (const K*)(data_ + sizeof(Header));
+      val_ = (const V*)(data_ + pos);
+      for (size_t i = 0; i < h.num; i += kIndexStride) {
+        index_.push_back(key_[i]);
+      }
+      front_ = key_[0]; back_ = key_[h.num - 1];
+    }
+  } else if (ok) {
+    ok = CheckIndex();
+    if (ok) {
+      size_t nb = h.num_blocks;
+      first_ = (const K*)(data_ + sizeof(Header));
+      offset_ = (const uint64*)(data_ + Align(sizeof(Header) + nb * sizeof(K)));
+      key_bytes_ = offset_ + nb + 1;
+      front_ = first_[0];
+      ok = LoadBlock(nb - 1);
+      if (ok) back_ = cache_key_.back();
+    }
+  }
+  if (!ok) {
+    LOG(WARNING) << file << " is truncated or corrupt";
+    Close();
+    return false;
+  }
+  return true;
+}
+
+template <typename K, typename V>
+bool ModelFile<K,V>::CheckIndex() const {
+  const Header& h = *header_;
+  if (h.block_size == 0 || h.num_blocks != (h.num - 1) / h.block_size + 1) {
+    return false;
+  }
+  // the first keys, nb + 1 offsets, and nb key sizes
+  size_t nb = h.num_blocks;
+  uint64 pos = Align(sizeof(Header) + nb * sizeof(K));
+  if (pos > bytes_ || (bytes_ - pos) / sizeof(uint64) < nb * 2 + 1) {
+    return false;
+  }
+  const uint64* offset = (const uint64*)(data_ + pos);
+  const uint64* key_bytes = offset + nb + 1;
+  if (offset[0] != pos + (nb * 2 + 1) * sizeof(uint64) || offset[nb] > bytes_) {
+    return false;
+  }
+  for (size_t b = 0; b < nb; ++b) {
+    if (offset[b] > offset[b+1] || key_bytes[b] > offset[b+1] - offset[b]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename K, typename V>
+void ModelFile<K,V>::Close() {
+  if (data_) munmap(data_, bytes_);
+  data_ = nullptr; header_ = nullptr; bytes_ = 0;
+  key_ = nullptr; val_ = nullptr; index_.clear();
+  first_ = nullptr; offset_ = key_bytes_ = nullptr;
+  cached_ = (size_t)-1; cache_key_.clear(); cache_val_.clear();
+}
+
+template <typename K, typename V>
+bool ModelFile<K,V>::LoadBlock(size_t b) {
+  if (b == cached_) return true;
+  const char* p = data_ + offset_[b];
+  size_t key_bytes = key_bytes_[b];
+  size_t val_bytes = offset_[b+1] - offset_[b] - key_bytes;
+  // UncompressFrom fails on a corrupt block, so check it first. a block has
+  // 1 to block_size keys
+  size_t n = 0, m = 0;
+  if (!snappy::IsValidCompressedBuffer(p, key_bytes) ||
+      !snappy::IsValidCompressedBuffer(p + key_bytes, val_bytes) ||
+      !snappy::GetUncompressedLength(p, key_bytes, &n) ||
+      !snappy::GetUncompressedLength(p + key_bytes, val_bytes, &m) ||
+      n == 0 || n % sizeof(K) || n / sizeof(K) > header_->block_size ||
+      m != n / sizeof(K) * header_->k * sizeof(V)) {
+    return false;
+  }
+  cache_key_.UncompressFrom(p, key_bytes);
+  cache_val_.UncompressFrom(p + key_bytes, val_bytes);
+  cached_ = b;
+  return true;
+}
+
+template <typename K, typename V>
+bool ModelFile<K,V>::Get(K key, V* val) {
+  if (size() == 0 || key < front_ || key > back_) return false;
+  int k = header_->k;
+  const K* begin; const K* end; const V* value;
+  if (!header_->compressed) {
+    size_t j = std::upper_bound(index_.begin(), index_.end(), key)
+               - index_.begin() - 1;
+    begin = key_ + j * kIndexStride;
+    end = key_ + std::min<size_t>((j + 1) * kIndexStride, header_->num);
+    value = val_;
+  } else {
+    size_t nb = header_->num_blocks;
+    size_t b = std::upper_bound(first_, first_ + nb, key) - first_ - 1;
+    if (!LoadBlock(b)) {
+      LOG(WARNING) << "block " << b << " of the model file is corrupt";
+      return false;
+    }
+    begin = cache_key_.begin();
+    end = cache_key_.end();
+    value = cache_val_.data();
+  }
+  const K* it = std::lower_bound(begin, end, key);
+  if (it == end || *it != key) return false;
+  size_t i = it - (header_->compressed ? begin : key_);
+  memcpy(val, value + i * k, k * sizeof(V));
+  return true;
+}
+
+}  // namespace PS